@@ -1,26 +1,54 @@
 {
+  "variables": {
+    # PYTHON_TS_BENCH=1 的时候多编译一个带微基准的python-ts-bench, 见tests/bench-native.ts
+    "python_ts_bench%": "<!(node -p \"process.env.PYTHON_TS_BENCH ? 1 : 0\")"
+  },
+  "target_defaults": {
+    "cflags!": [ "-fno-exceptions" ],
+    "cflags_cc!": [ "-fno-exceptions" ],
+    "include_dirs": [
+      "<!@(node -p \"require('node-addon-api').include\")",
+      "<!@(node -p \"require('./src/gyp').include_dirs\")"
+    ],
+    "dependencies": [
+      "<!(node -p \"require('node-addon-api').gyp\")"
+    ],
+    "link_settings": {
+      "libraries": [
+        "<!@(node -p \"require('./src/gyp').libraries\")"
+      ],
+      "library_dirs": [
+        "<!@(node -p \"require('./src/gyp').library_dirs\")"
+      ]
+    },
+    "defines": [
+      "NAPI_DISABLE_CPP_EXCEPTIONS",
+      "NAPI_VERSION=6",
+      "<!@(node -p \"require('./src/gyp').defines\")"
+    ]
+  },
   "targets": [
     {
       "target_name": "python-ts",
-      "sources": [ "src/binding.cc" ],
-      "cflags!": [ "-fno-exceptions" ],
-      "cflags_cc!": [ "-fno-exceptions" ],
-      "include_dirs": [
-        "<!@(node -p \"require('node-addon-api').include\")",
-        "<!@(node -p \"require('./src/gyp').include_dirs\")"
-      ],
-      "dependencies": [
-        "<!(node -p \"require('node-addon-api').gyp\")"
-      ],
-      "link_settings": {
-        "libraries": [
-          "<!@(node -p \"require('./src/gyp').libraries\")"
-        ],
-        "library_dirs": [
-          "<!@(node -p \"require('./src/gyp').library_dirs\")"
-        ]
-      },
-      "defines": ["NAPI_DISABLE_CPP_EXCEPTIONS"]
+      "sources": [ "src/binding.cc" ]
     }
   ],
-}
\ No newline at end of file
+  "conditions": [
+    [ "python_ts_bench==1", {
+      "targets": [
+        {
+          "target_name": "python-ts-bench",
+          "sources": [ "src/binding.cc" ],
+          "defines": [ "PYTHON_TS_BENCH" ],
+          "conditions": [
+            # 动态加载的.node里对operator new的调用默认会绑到node自己导出的那一份上, 替换的不会被调用;
+            # -Bsymbolic让addon里的引用优先绑到addon自己的定义. macOS和Windows链接的时候就绑好了, 不用加
+            [ "OS=='linux'", {
+              "ldflags": [ "-Wl,-Bsymbolic" ]
+            }]
+          ]
+        }
+      ]
+    }]
+  ]
+}
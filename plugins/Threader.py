@@ -25,3 +25,8 @@ def incr_in_thread(value: int):
 
 def incr_in_executor(value: int):
     executor.submit(incr, value)
+
+
+def incr_and_wait(value: int):
+    # 等线程池里跑完再返回, 计时的时候工作都在这次调用里
+    executor.submit(incr, value).result()
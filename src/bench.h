@@ -0,0 +1,349 @@
+/* binding内部函数的微基准, 只在python-ts-bench这个target里编译(定义了PYTHON_TS_BENCH)
+被binding.cc在Init之前include, 和binding.cc是同一个编译单元, 可以直接调用内部函数
+这些函数都要一个活的napi_env, 所以做成addon的一个导出函数_bench, 由tests/bench-native.ts加载运行
+每个用例先预热, 然后按batch个操作一组计时(steady_clock), 一组的平均值算一个样本, p50/p99按样本算
+allocs_per_op是C++的operator new次数, py_allocs_per_op是Python的PyMem/PyObject分配次数
+*/
+enum BenchKind
+{
+    BENCH_SERIALIZE,       // serialize_pyobject, 每次是新的对象
+    BENCH_NAPI_TO_PY,      // napi_value_to_pyobject
+    BENCH_PY_TO_NAPI,      // pyobject_to_napi_value
+    BENCH_ENTER_PYTHON,    // EnterPython + LeavePython
+    BENCH_ACQUIRE_GIL,     // AcquireGIL + ReleaseGIL, 不持有GIL的时候跑
+    BENCH_GET_PYEXCEPTION, // PyErr_SetString + get_pyexception
+    BENCH_OPERATOR_NEW,    // 一次new, 检查替换的operator new真的被调用了, allocs_per_op应该是1
+    BENCH_KIND_COUNT
+};
+
+const char *BENCH_NAMES[] = {"serialize_pyobject", "napi_value_to_pyobject", "pyobject_to_napi_value",
+                             "EnterPython",        "AcquireGIL",             "get_pyexception",
+                             "operator_new"};
+
+std::atomic<bool> bench_counting(false);
+std::atomic<uint64_t> bench_allocs(0), bench_py_allocs(0);
+
+/* 替换全局的operator new来数C++的分配次数
+只有这个target里有, 正式的python-ts不受影响; 其他的new/delete变体默认都转到这两个上面
+*/
+void *operator new(size_t size)
+{
+    void *p;
+    if (bench_counting.load(std::memory_order_relaxed))
+    {
+        bench_allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// 包在Python原来的分配器外面数次数, 只在_bench运行期间装上
+struct BenchAllocator
+{
+    PyMemAllocatorDomain domain;
+    PyMemAllocatorEx original;
+};
+
+BenchAllocator bench_allocators[] = {{PYMEM_DOMAIN_MEM, {}}, {PYMEM_DOMAIN_OBJ, {}}};
+
+void *bench_pymalloc(void *ctx, size_t size)
+{
+    BenchAllocator *allocator = (BenchAllocator *)ctx;
+    if (bench_counting.load(std::memory_order_relaxed))
+        bench_py_allocs.fetch_add(1, std::memory_order_relaxed);
+    return allocator->original.malloc(allocator->original.ctx, size);
+}
+
+void *bench_pycalloc(void *ctx, size_t nelem, size_t elsize)
+{
+    BenchAllocator *allocator = (BenchAllocator *)ctx;
+    if (bench_counting.load(std::memory_order_relaxed))
+        bench_py_allocs.fetch_add(1, std::memory_order_relaxed);
+    return allocator->original.calloc(allocator->original.ctx, nelem, elsize);
+}
+
+void *bench_pyrealloc(void *ctx, void *ptr, size_t size)
+{
+    BenchAllocator *allocator = (BenchAllocator *)ctx;
+    if (bench_counting.load(std::memory_order_relaxed))
+        bench_py_allocs.fetch_add(1, std::memory_order_relaxed);
+    return allocator->original.realloc(allocator->original.ctx, ptr, size);
+}
+
+void bench_pyfree(void *ctx, void *ptr)
+{
+    BenchAllocator *allocator = (BenchAllocator *)ctx;
+    allocator->original.free(allocator->original.ctx, ptr);
+}
+
+// 需要持有GIL; free-threaded的Python对象直接从mimalloc的堆上分配, 不能挂钩子, 只数C++的
+bool bench_hook_pymem(bool install)
+{
+#ifdef Py_GIL_DISABLED
+    return false;
+#else
+    PyMemAllocatorEx hook;
+    size_t i;
+    for (i = 0; i < sizeof(bench_allocators) / sizeof(bench_allocators[0]); i++)
+    {
+        if (install)
+        {
+            PyMem_GetAllocator(bench_allocators[i].domain, &bench_allocators[i].original);
+            hook.ctx = &bench_allocators[i];
+            hook.malloc = bench_pymalloc;
+            hook.calloc = bench_pycalloc;
+            hook.realloc = bench_pyrealloc;
+            hook.free = bench_pyfree;
+            PyMem_SetAllocator(bench_allocators[i].domain, &hook);
+        }
+        else
+        {
+            PyMem_SetAllocator(bench_allocators[i].domain, &bench_allocators[i].original);
+        }
+    }
+    return true;
+#endif
+}
+
+struct BenchState
+{
+    Napi::Value payload;          // napi_value_to_pyobject的输入
+    PyObject *pypayload;          // pyobject_to_napi_value的输入
+    std::vector<PyObject *> fresh; // serialize_pyobject的输入, 每组重新生成
+    std::vector<Napi::Object> wrappers;
+    std::vector<int *> allocated; // operator_new的结果, 留到每组之后再delete, 免得编译器把new/delete一起优化掉
+};
+
+// 一次操作, 计时范围内的部分
+void bench_op(Napi::Env &env, BenchKind kind, BenchState &bench, size_t i)
+{
+    PyObject *object;
+    PyThreadState *ts;
+
+    switch (kind)
+    {
+    case BENCH_SERIALIZE:
+        bench.wrappers[i] = serialize_pyobject(env, bench.fresh[i], NULL);
+        break;
+    case BENCH_NAPI_TO_PY:
+        object = napi_value_to_pyobject(env, bench.payload);
+        Py_XDECREF(object);
+        break;
+    case BENCH_PY_TO_NAPI:
+        pyobject_to_napi_value(env, bench.pypayload, NULL);
+        break;
+    case BENCH_ENTER_PYTHON:
+        LeavePython(EnterPython(NULL));
+        break;
+    case BENCH_ACQUIRE_GIL:
+        AcquireGIL(NULL, &ts);
+        ReleaseGIL(NULL, &ts);
+        break;
+    case BENCH_GET_PYEXCEPTION:
+        PyErr_SetString(PyExc_ValueError, "bench");
+        get_pyexception(env, "bench");
+        break;
+    case BENCH_OPERATOR_NEW:
+        bench.allocated.push_back(new int((int)i));
+        break;
+    default:
+        break;
+    }
+}
+
+// 每组之前的准备和之后的清理, 不计时; serialize_pyobject需要每次都是没见过的对象
+void bench_prepare(Napi::Env &env, BenchKind kind, BenchState &bench, size_t batch)
+{
+    size_t i;
+    if (kind == BENCH_OPERATOR_NEW)
+    {
+        // 预留好, push_back的时候不再分配
+        bench.allocated.reserve(batch);
+        return;
+    }
+    if (kind != BENCH_SERIALIZE)
+        return;
+    bench.fresh.resize(batch);
+    bench.wrappers.resize(batch);
+    for (i = 0; i < batch; i++)
+    {
+        bench.fresh[i] = PyFloat_FromDouble((double)i + 0.5);
+    }
+}
+
+void bench_cleanup(Napi::Env &env, BenchKind kind, BenchState &bench)
+{
+    AddonData *data = addon_data(env);
+    Napi::Object objects = data->objects.Value();
+    Napi::Array references = data->references.Value().As<Napi::Array>();
+    size_t i;
+
+    if (kind == BENCH_OPERATOR_NEW)
+    {
+        for (i = 0; i < bench.allocated.size(); i++)
+            delete bench.allocated[i];
+        bench.allocated.clear();
+        return;
+    }
+    if (kind != BENCH_SERIALIZE)
+        return;
+    for (i = 0; i < bench.fresh.size(); i++)
+    {
+        // 和_delete_pyobject一样把登记去掉, serialize_pyobject加的引用也还回去
+        objects.Delete(bench.wrappers[i].Get("value"));
+        references.Set(bench.wrappers[i].Get("index").As<Napi::Number>().Uint32Value(), env.Null());
+        Py_DECREF(bench.fresh[i]);
+        Py_DECREF(bench.fresh[i]);
+    }
+    bench.fresh.clear();
+    bench.wrappers.clear();
+}
+
+double bench_percentile(std::vector<double> &samples, double p)
+{
+    size_t rank;
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    rank = (size_t)std::ceil(p * samples.size());
+    return samples[rank == 0 ? 0 : rank - 1];
+}
+
+Napi::Object bench_case(Napi::Env &env, BenchKind kind, BenchState &bench, size_t iterations, size_t batch,
+                        bool pyhooked)
+{
+    Napi::Object result = Napi::Object::New(env);
+    std::vector<double> samples;
+    std::chrono::steady_clock::time_point start;
+    double elapsed, total = 0;
+    uint64_t allocs, py_allocs;
+    size_t round, rounds = (iterations + batch - 1) / batch, i;
+
+    // 预热一组, 让scratch_pool, pool_states之类的缓存先建好
+    {
+        Napi::HandleScope scope(env);
+        bench_prepare(env, kind, bench, batch);
+        for (i = 0; i < batch; i++)
+            bench_op(env, kind, bench, i);
+        bench_cleanup(env, kind, bench);
+    }
+
+    bench_allocs = 0;
+    bench_py_allocs = 0;
+    for (round = 0; round < rounds; round++)
+    {
+        Napi::HandleScope scope(env);
+        bench_prepare(env, kind, bench, batch);
+        bench_counting = true;
+        start = std::chrono::steady_clock::now();
+        for (i = 0; i < batch; i++)
+            bench_op(env, kind, bench, i);
+        elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        bench_counting = false;
+        bench_cleanup(env, kind, bench);
+        samples.push_back(elapsed / batch);
+        total += elapsed;
+    }
+    allocs = bench_allocs;
+    py_allocs = bench_py_allocs;
+
+    result.Set("name", BENCH_NAMES[kind]);
+    result.Set("ops", (double)(rounds * batch));
+    result.Set("ns_per_op", total / (rounds * batch));
+    result.Set("p50_ns", bench_percentile(samples, 0.5));
+    result.Set("p99_ns", bench_percentile(samples, 0.99));
+    result.Set("allocs_per_op", (double)allocs / (rounds * batch));
+    result.Set("py_allocs_per_op", pyhooked ? Napi::Value(Napi::Number::New(env, (double)py_allocs / (rounds * batch)))
+                                            : env.Null());
+    return result;
+}
+
+/* 跑一遍全部的用例
+参数
+    options: {iterations?: number, batch?: number, payload?: any}, payload是转换用例的输入, 默认是一个小的JSON对象
+返回
+    JSON字符串 {python, free_threaded, iterations, batch, cases: [{name, ops, ns_per_op, p50_ns, p99_ns, allocs_per_op, py_allocs_per_op}]}
+*/
+Napi::Value _bench(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object options = Napi::Object::New(env), result = Napi::Object::New(env);
+    Napi::Array cases = Napi::Array::New(env);
+    BenchState bench;
+    size_t iterations = 100000, batch = 100;
+    uint32_t kind;
+    bool pyhooked;
+
+    if (info.Length() >= 1 && info[0].IsObject())
+    {
+        options = info[0].As<Napi::Object>();
+    }
+    if (options.Get("iterations").IsNumber())
+        iterations = (size_t)std::max(1.0, options.Get("iterations").As<Napi::Number>().DoubleValue());
+    if (options.Get("batch").IsNumber())
+        batch = (size_t)std::max(1.0, options.Get("batch").As<Napi::Number>().DoubleValue());
+    bench.payload = options.Has("payload")
+                        ? options.Get("payload")
+                        : napi_parse_json(env, Napi::String::New(env, "{\"id\": 1, \"name\": \"bench\", \"score\": 0.5, "
+                                                                      "\"tags\": [\"a\", \"b\", \"c\"], "
+                                                                      "\"nested\": {\"ok\": true, \"none\": null}}"));
+
+    if (!__init_python(env))
+    {
+        Napi::Error::New(env, "Python is not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    if (gil_session > 0)
+    {
+        Napi::Error::New(env, "Can not run benchmarks inside `withGIL`").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    EnterPython(NULL);
+    bench.pypayload = napi_value_to_pyobject(env, bench.payload);
+    if (bench.pypayload == NULL)
+    {
+        PyErr_Clear();
+        LeavePython(NULL);
+        Napi::TypeError::New(env, "Argument `payload` can not be converted to Python").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    pyhooked = bench_hook_pymem(true);
+    for (kind = 0; kind < BENCH_KIND_COUNT; kind++)
+    {
+        if (kind == BENCH_ACQUIRE_GIL || kind == BENCH_ENTER_PYTHON)
+        {
+            // 这两个要从不持有GIL的状态开始
+            LeavePython(NULL);
+            cases.Set(kind, bench_case(env, (BenchKind)kind, bench, iterations, batch, pyhooked));
+            EnterPython(NULL);
+        }
+        else
+        {
+            cases.Set(kind, bench_case(env, (BenchKind)kind, bench, iterations, batch, pyhooked));
+        }
+    }
+    bench_hook_pymem(false);
+    Py_DECREF(bench.pypayload);
+    LeavePython(NULL);
+
+    result.Set("python", Py_GetVersion());
+#ifdef Py_GIL_DISABLED
+    result.Set("free_threaded", true);
+#else
+    result.Set("free_threaded", false);
+#endif
+    result.Set("iterations", (double)iterations);
+    result.Set("batch", (double)batch);
+    result.Set("cases", cases);
+    return napi_dump_json(env, result);
+}
@@ -4,33 +4,494 @@
 #include <ctime>
 #include <map>
 #include <set>
+#include <vector>
+#include <cmath>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <list>
+#include <thread>
+#include <memory>
+#include <condition_variable>
+#include <cstring>
 #include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include <napi.h>
 #include <Python.h>
 
 const int MAX_CODE_SIZE = 1024;
 const char *PYOBJECT_WRAPPER = "python-ts/PyObject*";
 const char *PYTHREADSTATE_WRAPPER = "python-ts/PyThreadState*";
-const char *OBJECTS = "python-ts/objects";
-const char *CONTEXTS = "python-ts/contexts";
-const char *REFERENCES = "python-ts/references";
 
 std::string runtime_path = "x64";
 wchar_t *py_program = NULL;
+std::atomic<bool> py_ready(false); // 初始化完成以后每次调用都只看这个, 不用拿mutex
 PyObject *py_main = NULL;
 PyThreadState *py_mainstate = NULL;
 PyGILState_STATE gstate;
-uint32_t rtop = 0, ctop = 0;
 std::mutex mutex, smutex;
 bool debug = false;
+thread_local int gil_session = 0; // withGIL会话的嵌套深度, 大于0时本线程一直持有GIL
+std::thread::id py_main_thread;                      // 调用Py_Initialize的线程, py_mainstate属于它
+thread_local PyThreadState *thread_mainstate = NULL; // 其他线程(worker_threads)在主解释器上的PyThreadState
+std::atomic<int> bound_workers(0);                   // 绑定了sub-interpreter而且还没退出的worker_threads
+
+void drop_pycaches(PyThreadState *state, bool release); // 定义在结果缓存那一节
+void drop_pool_states(PyInterpreterState *interp, bool release); // 定义在AcquireGIL前面
+void drop_record_types(PyInterpreterState *interp, bool release); // 定义在records选项那一节
+void drop_native_types(PyInterpreterState *interp, bool release); // 定义在NativeKind后面
+PyThreadState *thread_main_state();                                // 定义在EnterPython前面
+void __end_pycontext(PyThreadState *substate, PyObject *main);     // 定义在context那一节
+
+// 定义在JS函数那一节
+struct JsCallable;
+JsCallable *new_js_callable(const Napi::Env &env, const Napi::Function &function);
+PyObject *js_callable_to_pyobject(JsCallable *callable);
+void release_js_callable(JsCallable *callable);
+Napi::Value js_callable_value(JsCallable *callable);
+
+class PyScheduledWorker;
+
+/* 每个加载了本插件的JS环境(主线程和每个worker_threads)一份, 用napi_set_instance_data挂在env上
+Python运行时是整个进程共享的, 这里只放各个JS环境自己的表和计数器, 都只在这个环境的JS线程上访问, 不用加锁
+worker_threads调用_bind_worker以后有自己的sub-interpreter, 它就是这个worker的默认context, worker退出的时候跟着销毁
+*/
+struct AddonData
+{
+    Napi::ObjectReference references; // 所有没被Py_DECREF的序列化对象必须都在这里面
+    Napi::ObjectReference contexts;   // 所有创建的context, str表示的uintptr_t指针
+    Napi::ObjectReference objects;    // 为了复用references/contexts, str指针 -> {type, index}
+    uint32_t rtop, ctop;
+    std::deque<std::pair<uint32_t, double>> wrapper_times; // (第一个index, 时间), PyWrapper的time从这里查
+    std::map<uint32_t, PyScheduledWorker *> pytasks;        // 还没完成的异步调用, id => worker, 用来取消
+    uint32_t pytask_top;                                    // id从1开始
+    Napi::ObjectReference worker_context;                   // 主线程的是空的
+    PyThreadState *worker_state;
+    PyObject *worker_main;
+};
+
+inline AddonData *addon_data(Napi::Env env)
+{
+    return env.GetInstanceData<AddonData>();
+}
+
+/* 可选的时间线追踪, 导出成Chrome trace-event格式, 可以直接用Perfetto或者chrome://tracing打开
+记录: 各个入口, 拿GIL, 异步worker的Execute/OnOK, 新建PyWrapper
+每个线程一个固定大小的环形缓冲区, 只有所属线程写, 写满了覆盖最旧的; 第一次记事件的时候才分配
+没开的时候TraceSpan只读一次原子变量
+*/
+const size_t TRACE_CAPACITY = 1 << 16; // 每个线程最多保留的事件数
+
+struct TraceEvent
+{
+    const char *name; // 都是字符串常量, 不复制
+    const char *cat;
+    uint64_t start_ns, dur_ns;
+};
+
+struct TraceBuffer
+{
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> head; // 写过的事件总数, 下一个写在head % TRACE_CAPACITY
+    uint32_t tid;
+    bool main; // 初始化Python的JS主线程
+};
+
+std::atomic<bool> tracing(false);
+std::mutex trace_mutex;
+std::vector<TraceBuffer *> trace_buffers; // 线程退出以后缓冲区也留着, 还能导出
+thread_local TraceBuffer *trace_buffer = NULL;
+const std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+
+inline uint64_t trace_now()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                          trace_epoch)
+        .count();
+}
+
+void trace_event(const char *name, const char *cat, uint64_t start_ns, uint64_t end_ns)
+{
+    TraceBuffer *buffer = trace_buffer;
+    TraceEvent *event;
+    uint64_t head;
+
+    if (buffer == NULL)
+    {
+        buffer = new TraceBuffer();
+        buffer->events.resize(TRACE_CAPACITY);
+        buffer->head = 0;
+        buffer->main = std::this_thread::get_id() == py_main_thread;
+        trace_mutex.lock();
+        buffer->tid = (uint32_t)trace_buffers.size() + 1;
+        trace_buffers.push_back(buffer);
+        trace_mutex.unlock();
+        trace_buffer = buffer;
+    }
+    head = buffer->head.load(std::memory_order_relaxed);
+    event = &buffer->events[head % TRACE_CAPACITY];
+    event->name = name;
+    event->cat = cat;
+    event->start_ns = start_ns;
+    event->dur_ns = end_ns - start_ns;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// 从构造到析构算一个事件; 构造的时候没开追踪的话什么都不记
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, const char *cat)
+        : _name(name), _cat(cat), _start(tracing.load(std::memory_order_relaxed) ? trace_now() : NOT_TRACED) {}
+    ~TraceSpan()
+    {
+        if (_start != NOT_TRACED && tracing.load(std::memory_order_relaxed))
+            trace_event(_name, _cat, _start, trace_now());
+    }
+
+private:
+    static const uint64_t NOT_TRACED = ~(uint64_t)0;
+    const char *_name, *_cat;
+    uint64_t _start;
+    TraceSpan(const TraceSpan &);
+    TraceSpan &operator=(const TraceSpan &);
+};
+
+/* 按context统计Python的内存
+_enable_memory_accounting()要在Python初始化之前调用, 给PYMEM_DOMAIN_MEM和PYMEM_DOMAIN_OBJ各套一层分配器:
+每块内存前面多PYMEM_HEADER_SIZE字节, 记下大小和分配它的解释器, 释放的时候记回同一个解释器上;
+计数先攒在线程自己的变量里, 换了解释器或者攒够PYMEM_FLUSH_BYTES才加到全局的原子变量上, 读到的数有这么多的误差
+设置了上限的解释器, 超过上限的分配直接返回NULL, 在Python里就是MemoryError
+这两个domain都要拿着GIL调用, context共用一个GIL, 所以钩子之间不会并发; PYMEM_DOMAIN_RAW不拿GIL, 分不清是哪个解释器, 不统计
+free-threaded的Python用mimalloc管理对象, GC要遍历mimalloc的堆, 不能套; 套上以后也不再拿掉, 分配出去的内存前面都带着头
+bench.h的钩子是在Python初始化以后套在这一层外面的, 互不影响
+*/
+#if PY_VERSION_HEX >= 0x030D0000
+#define PYMEM_TSTATE() PyThreadState_GetUnchecked()
+#else
+#define PYMEM_TSTATE() _PyThreadState_UncheckedGet()
+#endif
+
+struct PyMemHeader
+{
+    uint32_t slot, generation;
+    size_t size;
+};
+
+struct PyMemSlot
+{
+    std::atomic<PyInterpreterState *> interp; // NULL表示空闲; 0号不分配给解释器, 记没有PyThreadState的时候的分配
+    std::atomic<uint32_t> generation;          // 解释器销毁以后加一, 之前分配的内存释放的时候不再记账
+    std::atomic<int64_t> live, peak, blocks, limit, denied;
+};
+
+struct PyMemPending
+{
+    uint32_t slot, generation;
+    int64_t bytes, blocks;
+};
+
+const size_t PYMEM_HEADER_SIZE = 16; // 保持pymalloc的16字节对齐
+const uint32_t MAX_PYMEM_SLOTS = 256; // 同时存在的解释器多于这个数的时候, 多出来的记到0号
+const int64_t PYMEM_FLUSH_BYTES = 64 << 10;
+
+static_assert(sizeof(PyMemHeader) <= PYMEM_HEADER_SIZE, "PyMemHeader is too large");
+
+PyMemSlot pymem_slots[MAX_PYMEM_SLOTS];
+PyMemAllocatorEx pymem_original[2]; // MEM, OBJ
+std::atomic<bool> pymem_accounting(false);
+thread_local PyMemPending pymem_pending = {0, 0, 0, 0};
+thread_local PyInterpreterState *pymem_last_interp = NULL;
+thread_local uint32_t pymem_last_slot = 0;
+
+// 把本线程攒下的计数加到全局上; 期间解释器被销毁了的话直接丢掉
+void pymem_flush()
+{
+    PyMemSlot &slot = pymem_slots[pymem_pending.slot];
+    int64_t live, peak;
+
+    if (pymem_pending.bytes != 0 || pymem_pending.blocks != 0)
+    {
+        if (slot.generation.load(std::memory_order_relaxed) == pymem_pending.generation)
+        {
+            live = slot.live.fetch_add(pymem_pending.bytes, std::memory_order_relaxed) + pymem_pending.bytes;
+            slot.blocks.fetch_add(pymem_pending.blocks, std::memory_order_relaxed);
+            peak = slot.peak.load(std::memory_order_relaxed);
+            while (live > peak && !slot.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+            {
+            }
+        }
+        pymem_pending.bytes = pymem_pending.blocks = 0;
+    }
+}
+
+void pymem_count(uint32_t slot, uint32_t generation, int64_t bytes, int64_t blocks)
+{
+    if (pymem_pending.slot != slot || pymem_pending.generation != generation)
+    {
+        pymem_flush();
+        pymem_pending.slot = slot;
+        pymem_pending.generation = generation;
+    }
+    pymem_pending.bytes += bytes;
+    pymem_pending.blocks += blocks;
+    if (pymem_pending.bytes >= PYMEM_FLUSH_BYTES || pymem_pending.bytes <= -PYMEM_FLUSH_BYTES)
+    {
+        pymem_flush();
+    }
+}
+
+// interp对应的slot, 没有的话claim为true时占一个空的; 都占满了返回0
+uint32_t pymem_slot_of(PyInterpreterState *interp, bool claim)
+{
+    PyInterpreterState *expected;
+    uint32_t i;
+
+    for (i = 1; i < MAX_PYMEM_SLOTS; i++)
+    {
+        if (pymem_slots[i].interp.load(std::memory_order_relaxed) == interp)
+            return i;
+    }
+    for (i = 1; claim && i < MAX_PYMEM_SLOTS; i++)
+    {
+        expected = NULL;
+        if (pymem_slots[i].interp.compare_exchange_strong(expected, interp))
+            return i;
+    }
+    return 0;
+}
+
+// 当前线程的PyThreadState属于哪个slot, 上一次的结果缓存在线程变量里
+uint32_t pymem_current_slot()
+{
+    PyThreadState *tstate = PYMEM_TSTATE();
+
+    if (tstate == NULL)
+    {
+        return 0;
+    }
+    if (pymem_last_interp != tstate->interp ||
+        pymem_slots[pymem_last_slot].interp.load(std::memory_order_relaxed) != tstate->interp)
+    {
+        pymem_last_interp = tstate->interp;
+        pymem_last_slot = pymem_slot_of(tstate->interp, true);
+    }
+    return pymem_last_slot;
+}
+
+// 再分配size字节会不会超过上限, 超过的话记一次拒绝
+bool pymem_admit(uint32_t slot, size_t size)
+{
+    PyMemSlot &target = pymem_slots[slot];
+    int64_t limit = target.limit.load(std::memory_order_relaxed);
+    int64_t pending = pymem_pending.slot == slot ? pymem_pending.bytes : 0;
+
+    if (limit <= 0 || target.live.load(std::memory_order_relaxed) + pending + (int64_t)size <= limit)
+    {
+        return true;
+    }
+    target.denied.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// zero为true的时候是calloc
+void *pymem_alloc(PyMemAllocatorEx *original, size_t nelem, size_t elsize, bool zero)
+{
+    PyMemHeader *header;
+    uint32_t slot = pymem_current_slot();
+    size_t size;
+
+    if (elsize != 0 && nelem > (PY_SSIZE_T_MAX - PYMEM_HEADER_SIZE) / elsize)
+    {
+        return NULL;
+    }
+    size = nelem * elsize;
+    if (!pymem_admit(slot, size))
+    {
+        return NULL;
+    }
+    header = (PyMemHeader *)(zero ? original->calloc(original->ctx, 1, size + PYMEM_HEADER_SIZE)
+                                  : original->malloc(original->ctx, size + PYMEM_HEADER_SIZE));
+    if (header == NULL)
+    {
+        return NULL;
+    }
+    header->slot = slot;
+    header->generation = pymem_slots[slot].generation.load(std::memory_order_relaxed);
+    header->size = size;
+    pymem_count(slot, header->generation, (int64_t)size, 1);
+    return (char *)header + PYMEM_HEADER_SIZE;
+}
+
+void *pymem_malloc(void *ctx, size_t size)
+{
+    return pymem_alloc((PyMemAllocatorEx *)ctx, 1, size, false);
+}
+
+void *pymem_calloc(void *ctx, size_t nelem, size_t elsize)
+{
+    return pymem_alloc((PyMemAllocatorEx *)ctx, nelem, elsize, true);
+}
+
+// 内存还是记在原来分配它的解释器上
+void *pymem_realloc(void *ctx, void *ptr, size_t size)
+{
+    PyMemAllocatorEx *original = (PyMemAllocatorEx *)ctx;
+    PyMemHeader *header;
+    bool current;
+
+    if (ptr == NULL)
+    {
+        return pymem_malloc(ctx, size);
+    }
+    header = (PyMemHeader *)((char *)ptr - PYMEM_HEADER_SIZE);
+    // 槽位已经换给别的context的话, 这块内存不算谁的, 也不受限额约束, 和pymem_free一样先看代数
+    current = pymem_slots[header->slot].generation.load(std::memory_order_relaxed) == header->generation;
+    if (size > PY_SSIZE_T_MAX - PYMEM_HEADER_SIZE ||
+        (current && size > header->size && !pymem_admit(header->slot, size - header->size)))
+    {
+        return NULL;
+    }
+    header = (PyMemHeader *)original->realloc(original->ctx, header, size + PYMEM_HEADER_SIZE);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+    if (current)
+    {
+        pymem_count(header->slot, header->generation, (int64_t)size - (int64_t)header->size, 0);
+    }
+    header->size = size;
+    return (char *)header + PYMEM_HEADER_SIZE;
+}
+
+void pymem_free(void *ctx, void *ptr)
+{
+    PyMemAllocatorEx *original = (PyMemAllocatorEx *)ctx;
+    PyMemHeader *header;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+    header = (PyMemHeader *)((char *)ptr - PYMEM_HEADER_SIZE);
+    if (pymem_slots[header->slot].generation.load(std::memory_order_relaxed) == header->generation)
+    {
+        pymem_count(header->slot, header->generation, -(int64_t)header->size, -1);
+    }
+    original->free(original->ctx, header);
+}
+
+// Python初始化之前调用; free-threaded的Python返回false
+bool install_pymem_hooks()
+{
+#ifdef Py_GIL_DISABLED
+    return false;
+#else
+    PyMemAllocatorDomain domains[2] = {PYMEM_DOMAIN_MEM, PYMEM_DOMAIN_OBJ};
+    PyMemAllocatorEx hook;
+    int i;
+
+    if (pymem_accounting)
+    {
+        return true;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        PyMem_GetAllocator(domains[i], &pymem_original[i]);
+        hook.ctx = &pymem_original[i];
+        hook.malloc = pymem_malloc;
+        hook.calloc = pymem_calloc;
+        hook.realloc = pymem_realloc;
+        hook.free = pymem_free;
+        PyMem_SetAllocator(domains[i], &hook);
+    }
+    pymem_accounting = true;
+    return true;
+#endif
+}
+
+// Py_Initialize以后调用: 设置了PYTHONMALLOC的话Python初始化的时候会换掉分配器, 这时候什么都统计不到
+void check_pymem_hooks()
+{
+    PyMemAllocatorEx current;
+
+    if (pymem_accounting)
+    {
+        PyMem_GetAllocator(PYMEM_DOMAIN_OBJ, &current);
+        if (current.malloc != pymem_malloc)
+        {
+            pymem_accounting = false;
+        }
+    }
+}
+
+// 解释器销毁以后调用, 需要持有GIL; interp为NULL的时候清掉全部(Python销毁以后)
+void drop_pymem_slots(PyInterpreterState *interp)
+{
+    uint32_t i;
+    for (i = 1; i < MAX_PYMEM_SLOTS; i++)
+    {
+        if (pymem_slots[i].interp.load() == NULL || (interp != NULL && pymem_slots[i].interp.load() != interp))
+        {
+            continue;
+        }
+        pymem_slots[i].generation++;
+        pymem_slots[i].live = 0;
+        pymem_slots[i].peak = 0;
+        pymem_slots[i].blocks = 0;
+        pymem_slots[i].limit = 0;
+        pymem_slots[i].denied = 0;
+        pymem_slots[i].interp = NULL;
+    }
+}
+
+// Python销毁以后, 这个JS环境里所有的PyWrapper和context都指向已经释放的内存, 全部作废
+void forget_pywrappers(const Napi::Env &env)
+{
+    AddonData *data = addon_data(env);
+    Napi::Object objects = data->objects.Value();
+    Napi::Array references = data->references.Value().As<Napi::Array>();
+    Napi::Array contexts = data->contexts.Value().As<Napi::Array>();
+    Napi::Array keys = objects.GetPropertyNames();
+    uint32_t i;
+
+    for (i = 0; i < keys.Length(); i++)
+    {
+        objects.Delete(keys.Get(i));
+    }
+    for (i = 0; i < references.Length(); i++)
+    {
+        references.Set(i, env.Null());
+    }
+    for (i = 0; i < contexts.Length(); i++)
+    {
+        contexts.Set(i, env.Null());
+    }
+}
 
 // 回收Python环境
 Napi::Boolean __destroy_python(const Napi::Env &env)
 {
+    if (gil_session > 0)
+    {
+        Napi::Error::New(env, "Cannot destroy python inside `withGIL`").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
+    if (py_program && bound_workers > 0)
+    {
+        // worker的sub-interpreter还在用, 要等worker都退出
+        Napi::Error::New(env, "Cannot destroy python while worker threads are bound to it").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
     if (py_program)
     {
         mutex.lock();
-        PyEval_RestoreThread(py_mainstate);
+        py_ready = false;
+        PyEval_RestoreThread(thread_main_state());
         if (Py_FinalizeEx() < 0)
         {
             mutex.unlock();
@@ -40,7 +501,14 @@ Napi::Boolean __destroy_python(const Napi::Env &env)
         PyMem_RawFree(py_program);
         py_program = NULL;
         py_mainstate = NULL;
+        thread_mainstate = NULL;
+        drop_pool_states(NULL, false);
+        drop_pycaches(NULL, false);
+        drop_record_types(NULL, false);
+        drop_native_types(NULL, false);
+        drop_pymem_slots(NULL);
         mutex.unlock();
+        forget_pywrappers(env);
     }
     return Napi::Boolean::New(env, true);
 }
@@ -97,24 +565,33 @@ provide valid directory via `python-ts._set_runtime_path`!")
 Napi::Boolean __init_python(const Napi::Env &env)
 {
 
+    if (py_ready)
+    {
+        // 每个同步调用都会走到这里, 初始化过以后不能再拿全局的锁
+        return Napi::Boolean::New(env, true);
+    }
+    // 多个JS线程可能同时走到这里, 先拿锁再检查
+    mutex.lock();
     if (!py_program)
     {
-        mutex.lock();
-
         Py_Initialize(); // Python3.7以后隐含着调用PyEval_InitThreads; 3.7以前的话要手动调用PyEval_InitThreads
+        check_pymem_hooks();
 
         py_program = Py_GetProgramName();
         py_main = PyImport_AddModule("__main__"); // 添加一下__main__, 以后exec和eval的globals/locals都挂靠在这里
 
         if (!__prepare_python_env(env, true))
         {
+            mutex.unlock();
             return Napi::Boolean::New(env, false);
         }
 
         // 初始化以后就可以各种RestoreThread来拿权限了
+        py_main_thread = std::this_thread::get_id();
         py_mainstate = PyEval_SaveThread();
-        mutex.unlock();
+        py_ready = true;
     }
+    mutex.unlock();
     return Napi::Boolean::New(env, true);
 }
 
@@ -164,50 +641,169 @@ inline bool is_pycontext(const Napi::Value &value)
     return type.As<Napi::String>().Utf8Value() == PYTHREADSTATE_WRAPPER;
 }
 
-Napi::Object serialize_pyobject(const Napi::Env &env, PyObject *object, PyThreadState *state)
+PyObject *deserialize_pyobject(const Napi::Env &env, const Napi::Object &object);
+PyThreadState *EnterPython(PyThreadState *state);
+void LeavePython(PyThreadState *previous);
+
+/* PyWrapper的repr/pytype/time是getter, 用到的时候才算
+repr可能很慢(比如DataFrame或者很大的list), 而且绝大多数wrapper从来不看它; 只有repr需要拿GIL,
+     第一次算出来以后换成普通的属性, console.log/JSON.stringify之类反复读的时候不再拿GIL, 之后对象变了repr也不跟着变
+time: 每一秒记一次(第一个index, 时间), 按wrapper的index查出创建的时间, 创建wrapper的时候不用写这个属性;
+      只在有创建wrapper的那一秒记一条, 一天最多86400条, 不用删
+*/
+
+// wrapper背后的对象和它所在的context, 对象已经被回收或者context已经被删除的返回false
+bool pywrapper_target(const Napi::Env &env, const Napi::Object &wrapper, PyObject *&object, PyThreadState *&state)
 {
-    Napi::Object result, objects = env.Global().Get(OBJECTS).As<Napi::Object>();
-    Napi::Array references = env.Global().Get(REFERENCES).As<Napi::Array>();
-    PyObject *repr;
-    std::string value = uintptr_to_str((uintptr_t)object);
+    Napi::Object objects = addon_data(env)->objects.Value();
+    Napi::Value jstate = wrapper.Get("state");
 
-    if (objects.Has(value))
+    if (!py_ready)
     {
-        return objects.Get(value).As<Napi::Object>();
+        // Python已经销毁了, 或者正在重新初始化
+        return false;
+    }
+    object = deserialize_pyobject(env, wrapper);
+    if (object == NULL || (jstate.IsString() && !objects.Has(jstate)))
+    {
+        return false;
     }
+    state = jstate.IsString() ? (PyThreadState *)str_to_uintptr(jstate.As<Napi::String>().Utf8Value()) : NULL;
+    return true;
+}
 
-    result = Napi::Object::New(env);
-    repr = PyObject_Repr(object);
+Napi::Object pywrapper_this(napi_env env, napi_callback_info info)
+{
+    napi_value self;
+    napi_get_cb_info(env, info, NULL, NULL, &self, NULL);
+    return Napi::Object(env, self);
+}
 
-    result.Set("type", PYOBJECT_WRAPPER);
-    result.Set("value", value);
-    Py_INCREF(object); // 已经序列化过的对象手动加一个reference，避免被回收
-    if (repr != NULL)
+napi_value pywrapper_repr(napi_env env, napi_callback_info info)
+{
+    Napi::Object wrapper = pywrapper_this(env, info);
+    Napi::Value result = Napi::Env(env).Null();
+    PyObject *object, *repr;
+    PyThreadState *state, *previous;
+    napi_property_descriptor prop;
+    const char *data;
+    Py_ssize_t length;
+
+    if (!pywrapper_target(env, wrapper, object, state))
     {
-        result.Set("repr", PyUnicode_AsUTF8(repr));
+        return result;
     }
-    else
+    previous = EnterPython(state);
+    repr = PyObject_Repr(object);
+    data = repr == NULL ? NULL : PyUnicode_AsUTF8AndSize(repr, &length);
+    if (data != NULL)
     {
-        result.Set("repr", env.Null());
+        result = Napi::String::New(env, data, (size_t)length);
     }
+    PyErr_Clear();
     Py_XDECREF(repr);
-    result.Set("pytype", Py_TYPE(object)->tp_name);
-    result.Set("time", Napi::Number::New(env, (double)std::time(0)));
-    if (state == NULL)
+    LeavePython(previous);
+    if (result.IsString())
     {
-        result.Set("state", env.Undefined());
+        // 出错的下次还可以再试
+        memset(&prop, 0, sizeof(prop));
+        prop.utf8name = "repr";
+        prop.value = result;
+        prop.attributes = (napi_property_attributes)(napi_writable | napi_enumerable | napi_configurable);
+        napi_define_properties(env, wrapper, 1, &prop);
     }
-    else
+    return result;
+}
+
+// wrapper持有对象的引用, 类型对象不会变, 不用拿GIL
+napi_value pywrapper_pytype(napi_env env, napi_callback_info info)
+{
+    Napi::Object wrapper = pywrapper_this(env, info);
+    PyObject *object;
+    PyThreadState *state;
+
+    if (!pywrapper_target(env, wrapper, object, state))
+    {
+        return Napi::Env(env).Null();
+    }
+    return Napi::String::New(env, Py_TYPE(object)->tp_name);
+}
+
+napi_value pywrapper_time(napi_env env, napi_callback_info info)
+{
+    Napi::Object wrapper = pywrapper_this(env, info);
+    Napi::Value index = wrapper.Get("index");
+    std::deque<std::pair<uint32_t, double>> &times = addon_data(env)->wrapper_times;
+    std::deque<std::pair<uint32_t, double>>::iterator it;
+    double time = 0;
+
+    if (index.IsNumber())
+    {
+        // 最后一个第一个index不大于它的
+        it = std::upper_bound(times.begin(), times.end(),
+                              std::make_pair(index.As<Napi::Number>().Uint32Value(), (double)INFINITY));
+        if (it != times.begin())
+        {
+            time = (it - 1)->second;
+        }
+    }
+    return Napi::Number::New(env, time);
+}
+
+Napi::Object serialize_pyobject(const Napi::Env &env, PyObject *object, PyThreadState *state)
+{
+    AddonData *data = addon_data(env);
+    Napi::Object result, objects = data->objects.Value();
+    Napi::Array references = data->references.Value().As<Napi::Array>();
+    std::string value = uintptr_to_str((uintptr_t)object);
+    napi_property_descriptor props[7];
+    napi_property_attributes attributes;
+    double now;
+    uint32_t index;
+    size_t i;
+
+    if (objects.Has(value))
     {
-        result.Set("state", uintptr_to_str((uintptr_t)state));
+        return objects.Get(value).As<Napi::Object>();
     }
+    TraceSpan span("wrap", "handle");
+
+    Py_INCREF(object); // 已经序列化过的对象手动加一个reference，避免被回收
 
     // 把新鲜热乎的不安全的没被Py_DECREF的指针放到references里面，供后续使用
-    smutex.lock();
-    result.Set("index", rtop);
-    references.Set(rtop, result);
-    rtop++;
-    smutex.unlock();
+    now = (double)std::time(0);
+    index = data->rtop++;
+    if (data->wrapper_times.empty() || data->wrapper_times.back().second != now)
+    {
+        data->wrapper_times.push_back(std::make_pair(index, now));
+    }
+
+    // 所有属性一次定义好
+    result = Napi::Object::New(env);
+    memset(props, 0, sizeof(props));
+    attributes = (napi_property_attributes)(napi_writable | napi_enumerable | napi_configurable);
+    props[0].utf8name = "type";
+    props[0].value = Napi::String::New(env, PYOBJECT_WRAPPER);
+    props[1].utf8name = "value";
+    props[1].value = Napi::String::New(env, value);
+    props[2].utf8name = "state";
+    props[2].value = state == NULL ? env.Undefined() : Napi::String::New(env, uintptr_to_str((uintptr_t)state));
+    props[3].utf8name = "index";
+    props[3].value = Napi::Number::New(env, index);
+    props[4].utf8name = "repr";
+    props[4].getter = pywrapper_repr;
+    props[5].utf8name = "pytype";
+    props[5].getter = pywrapper_pytype;
+    props[6].utf8name = "time";
+    props[6].getter = pywrapper_time;
+    for (i = 0; i < 7; i++)
+    {
+        props[i].attributes = props[i].getter == NULL
+                                  ? attributes
+                                  : (napi_property_attributes)(napi_enumerable | napi_configurable);
+    }
+    napi_define_properties(env, result, 7, props);
+    references.Set(index, result);
 
     // 跟踪对象以便于复用
     objects.Set(value, result);
@@ -217,7 +813,7 @@ Napi::Object serialize_pyobject(const Napi::Env &env, PyObject *object, PyThread
 PyObject *deserialize_pyobject(const Napi::Env &env, const Napi::Object &object)
 {
     Napi::String value;
-    Napi::Object objects = env.Global().Get(OBJECTS).As<Napi::Array>();
+    Napi::Object objects = addon_data(env)->objects.Value();
 
     if (!is_pyobject(object))
     {
@@ -242,10 +838,54 @@ PyObject *deserialize_pyobject(const Napi::Env &env, const Napi::Object &object)
     return (PyObject *)str_to_uintptr(value.Utf8Value());
 }
 
+// 异步调用不拿GIL就要借用PyWrapper背后的对象, 借用期间_delete_pyobject只做个标记,
+// 由最后一个借用者在持有GIL的时候负责Py_DECREF
+std::map<PyObject *, int> pinned;
+std::set<PyObject *> zombies;
+
+void pin_pyobject(PyObject *object)
+{
+    smutex.lock();
+    pinned[object]++;
+    smutex.unlock();
+}
+
+// 需要持有GIL
+void unpin_pyobject(PyObject *object)
+{
+    std::map<PyObject *, int>::iterator it;
+    bool release = false;
+
+    smutex.lock();
+    it = pinned.find(object);
+    if (it != pinned.end() && --it->second == 0)
+    {
+        pinned.erase(it);
+        release = zombies.erase(object) > 0;
+    }
+    smutex.unlock();
+
+    if (release)
+        Py_DECREF(object);
+}
+
+// _delete_pyobject专用, 正在被借用的对象返回true, Py_DECREF交给unpin_pyobject
+bool defer_pyobject_release(PyObject *object)
+{
+    bool deferred;
+    smutex.lock();
+    deferred = pinned.find(object) != pinned.end();
+    if (deferred)
+        zombies.insert(object);
+    smutex.unlock();
+    return deferred;
+}
+
 Napi::Object serialize_pycontext(const Napi::Env &env, PyThreadState *state)
 {
-    Napi::Object result, objects = env.Global().Get(OBJECTS).As<Napi::Object>();
-    Napi::Array contexts = env.Global().Get(CONTEXTS).As<Napi::Array>();
+    AddonData *data = addon_data(env);
+    Napi::Object result, objects = data->objects.Value();
+    Napi::Array contexts = data->contexts.Value().As<Napi::Array>();
     PyObject *main;
     std::string jstate = uintptr_to_str((uintptr_t)state);
 
@@ -263,22 +903,23 @@ Napi::Object serialize_pycontext(const Napi::Env &env, PyThreadState *state)
     result.Set("main", uintptr_to_str((uintptr_t)main));
     result.Set("time", Napi::Number::New(env, (double)std::time(0)));
 
-    smutex.lock();
-    result.Set("index", ctop);
-    contexts.Set(ctop, result);
-    ctop++;
-    smutex.unlock();
+    result.Set("index", data->ctop);
+    contexts.Set(data->ctop, result);
+    data->ctop++;
 
     // 跟踪对象以便于复用
     objects.Set(jstate, result);
     return result;
 }
 
+// 不是context的(比如{})代表默认context: 主线程是主解释器, 绑定过的worker是它自己的sub-interpreter
 PyThreadState *pycontext_get(const Napi::Object &object, const char *key)
 {
+    AddonData *data;
     if (!is_pycontext(object))
     {
-        return NULL;
+        data = addon_data(object.Env());
+        return data->worker_context.IsEmpty() ? NULL : pycontext_get(data->worker_context.Value(), key);
     }
 
     return (PyThreadState *)str_to_uintptr(object.Get(key).As<Napi::String>().Utf8Value());
@@ -323,655 +964,4775 @@ bool napi_object_is_empty(Napi::Env &env, const Napi::Object &obj)
     return keys.Length() == 0;
 }
 
-bool __in_same_context(const Napi::Env &env, const Napi::Value &value, Napi::Object &context, std::set<Napi::Value *> &cref)
+/* 转换用的临时状态
+每个线程有一组反复使用的ConvertScratch, 用完reset, 稳定以后转换过程中不再为识别循环引用分配内存:
+pyobjects: PyObject* => 编号, 开放寻址的哈希表, reset只是把代数加一
+path: 当前路径上的JS容器, 用napi_strict_equals识别循环引用, N-API拿不到JS对象的identity hash, 只能比较路径上的祖先
+转换过程中有可能重入(比如Python回调了JS函数, JS函数的参数又要转换), 所以按栈的方式借还
+*/
+class IdentityMap
 {
-    Napi::Value item;
-    Napi::Object obj;
-    Napi::Array arr, keys;
-    uint32_t i;
+public:
+    IdentityMap() : generation(1), count(0) {}
 
-    if (value.IsBuffer()) {
-        // 有些类型需要单独处理一下，否则会FATAL ERROR
-        return true;
-    }
-    else if (value.IsArray())
+    void reset()
     {
-        arr = value.As<Napi::Array>();
-        if (cref.insert(&arr).second)
+        if (count == 0)
         {
-            for (i = 0; i < arr.Length(); i++)
-            {
-                if (!__in_same_context(env, arr.Get(i), context, cref))
-                    return false;
-            }
+            return;
+        }
+        count = 0;
+        if (++generation == 0)
+        {
+            // 代数绕回来了, 真正清空一次
+            std::fill(slots.begin(), slots.end(), Slot());
+            generation = 1;
         }
     }
-    else if (value.IsObject())
+
+    bool find(const void *key, uint32_t &value) const
     {
-        obj = value.As<Napi::Object>();
-        if (obj.Has("__wrapper__"))
+        size_t mask, i;
+        if (count == 0)
         {
-            obj = obj.Get("__wrapper__").As<Napi::Object>();
+            return false;
         }
-        if (cref.insert(&obj).second)
+        mask = slots.size() - 1;
+        for (i = hash(key) & mask; slots[i].generation == generation; i = (i + 1) & mask)
         {
-
-            if (debug)
-                printf("obj.state %s, context.state %s\n",
-                       obj.Get("state").ToString().Utf8Value().c_str(),
-                       context.Get("state").ToString().Utf8Value().c_str());
-            if (obj.Has("state"))
-                return obj.Get("state") == context.Get("state");
-
-            for (i = 0; i < keys.Length(); i++)
+            if (slots[i].key == key)
             {
-                if (obj.HasOwnProperty(keys.Get(i)))
-                {
-                    if (!__in_same_context(env, obj.Get(keys.Get(i)), context, cref))
-                        return false;
-                }
+                value = slots[i].value;
+                return true;
             }
         }
+        return false;
     }
 
-    return true;
-}
-
-bool in_same_context(const Napi::Env &env, Napi::Value &value, Napi::Object &context)
-{
-    std::set<Napi::Value *> cref = std::set<Napi::Value *>();
-    return __in_same_context(env, value, context, cref);
-}
-
-// cref这个参数是为了消解循环引用, 循环引用的对象将不在展开
-PyObject *__napi_value_to_pyobject(Napi::Env &env, Napi::Value &value,
-                                   std::map<Napi::Value *, PyObject *> &cref)
-{
-    PyObject *pResult, *pItem;
-    Py_ssize_t i;
-    Napi::Array arr, keys;
-    Napi::Object obj;
-    Napi::Value item;
-
-    if (value.IsBoolean())
-    {
-        // boolean
-        return Py_BuildValue("p", value.As<Napi::Boolean>().Value());
-    }
-    else if (value.IsNull() || value.IsUndefined())
+    void insert(const void *key, uint32_t value)
     {
-        // null or undefined => None
-        return Py_BuildValue("s", NULL);
-    }
-    else if (value.IsNumber())
-    {
-        // number => (int, float)
-        if (debug)
-            printf("Napi::Number! %s\n", value.ToString().Utf8Value().c_str());
-        if (napi_number_is_int(env, value))
+        size_t mask, i;
+        if ((count + 1) * 2 > slots.size())
         {
-            pResult = PyLong_FromDouble(value.As<Napi::Number>().DoubleValue());
+            grow();
         }
-        else
+        mask = slots.size() - 1;
+        for (i = hash(key) & mask; slots[i].generation == generation && slots[i].key != key; i = (i + 1) & mask)
         {
-            pResult = Py_BuildValue("d", value.As<Napi::Number>().DoubleValue());
         }
-        return pResult;
+        if (slots[i].generation != generation)
+        {
+            count++;
+        }
+        slots[i].key = key;
+        slots[i].value = value;
+        slots[i].generation = generation;
     }
-    else if (value.IsString())
+
+private:
+    struct Slot
     {
-        // string => string
-        if (debug)
-            printf("String! %s\n", value.As<Napi::String>().Utf8Value().c_str());
-        return Py_BuildValue("s", value.As<Napi::String>().Utf8Value().c_str());
-    }
-    else if (value.IsBuffer())
+        const void *key;
+        uint32_t value;
+        uint32_t generation; // 和当前代数相同的才是有效的
+        Slot() : key(NULL), value(0), generation(0) {}
+    };
+    std::vector<Slot> slots; // 大小是2的幂, 装载率不超过一半
+    uint32_t generation;
+    size_t count;
+
+    static size_t hash(const void *key)
     {
-        // buffer => bytes
-        Napi::Buffer<char> buffer = value.As<Napi::Buffer<char>>();
-        if (debug)
-            printf("Buffer! %s\n", value.As<Napi::String>().Utf8Value().c_str());
-        return Py_BuildValue("y#", (char*)(buffer.Data()), buffer.Length());
+        // 对象地址的低几位都是0, 乘一个奇数把高位的变化带下来
+        uint64_t h = (uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h >> 32);
     }
-    else if (value.IsArray())
+
+    void grow()
     {
-        if (debug)
-            printf("Napi::Array! Length=%d\n", arr.Length());
-        if (cref.find(&value) == cref.end())
+        std::vector<Slot> old;
+        size_t i;
+        old.swap(slots);
+        slots.resize(old.empty() ? 64 : old.size() * 2);
+        count = 0;
+        for (i = 0; i < old.size(); i++)
         {
-            // 第一次遇到, 正常展开
-            arr = value.As<Napi::Array>();
-            pResult = PyList_New(0);
-            cref[&value] = pResult;
-            for (i = 0; i < arr.Length(); i++)
+            if (old[i].generation == generation)
             {
-                item = arr.Get(i);
-                pItem = __napi_value_to_pyobject(env, item, cref);
-                PyList_Append(pResult, pItem);
+                insert(old[i].key, old[i].value);
             }
-            return pResult;
         }
-        else
+    }
+};
+
+struct ConvertScratch
+{
+    IdentityMap pyobjects;
+    std::vector<napi_value> values;                            // pyobject_to_napi_value: 编号 => 生成的JS值
+    std::vector<napi_property_descriptor> props;               // 按栈使用, 每个对象的属性攒齐以后一次定义
+    std::vector<std::pair<napi_value, PyObject *>> ancestors;  // napi_value_to_pyobject的路径
+    std::vector<std::pair<napi_value, uint32_t>> flat_ancestors; // flatten_napi_value的路径
+    std::vector<napi_value> path;                              // in_same_context的路径
+    std::vector<napi_value> built, keys;                       // flat_to_napi_value
+    std::vector<PyObject *> objects;                           // flat_to_pyobject
+    std::vector<std::pair<const char *, size_t>> names;        // flatten_pyobject: dict的键, 按栈使用
+    std::vector<PyObject *> items;                             // flatten_pyobject: dict的值, 按栈使用
+
+    void reset()
+    {
+        pyobjects.reset();
+        values.clear();
+        props.clear();
+        ancestors.clear();
+        flat_ancestors.clear();
+        path.clear();
+        built.clear();
+        keys.clear();
+        objects.clear();
+        names.clear();
+        items.clear();
+    }
+};
+
+thread_local std::vector<ConvertScratch *> scratch_pool;
+
+// 第一次用到的时候才借一个ConvertScratch, 没有容器的转换完全不碰它
+class ScratchLease
+{
+public:
+    ScratchLease() : scratch(NULL) {}
+    ~ScratchLease()
+    {
+        if (scratch != NULL)
         {
-            // 第二次遇到, 返回之前保存的引用, 展开会死循环
-            pResult = cref.find(&value)->second;
-            return pResult;
+            scratch->reset();
+            scratch_pool.push_back(scratch);
         }
     }
-    else if (value.IsObject())
+
+    ConvertScratch *operator->()
     {
-        if (debug)
-            printf("Napi::Object!\n");
-        if (cref.find(&value) == cref.end())
+        if (scratch == NULL)
         {
-            // 第一次遇到, 展开
-            obj = value.As<Napi::Object>();
-            if (is_pyobject(obj))
+            if (scratch_pool.empty())
             {
-                // 无法deserialize的时候，返回相应信息, 至少别出Fatal Error
-                pResult = deserialize_pyobject(env, obj);
-                if (pResult == NULL)
-                {
-                    pResult = Py_BuildValue("s", "RuntimeError('object has been recycled')");
-                }
+                scratch = new ConvertScratch();
             }
             else
             {
-                pResult = PyDict_New();
-                cref[&value] = pResult;
-                if (!napi_object_is_empty(env, obj))
-                {
-                    keys = obj.GetPropertyNames();
-                    for (i = 0; i < keys.Length(); i++)
-                    {
-                        if (obj.HasOwnProperty(keys.Get(i)))
-                        {
-                            item = obj.Get(keys.Get(i));
-                            pItem = __napi_value_to_pyobject(env, item, cref);
-                            PyDict_SetItemString(pResult, keys.Get(i).As<Napi::String>().Utf8Value().c_str(), pItem);
-                        }
-                    }
-                }
+                scratch = scratch_pool.back();
+                scratch_pool.pop_back();
             }
-            return pResult;
-        }
-        else
-        {
-            // 第二次遇到, 返回保存的引用, 展开会死循环
-            pResult = cref.find(&value)->second;
-            return pResult;
         }
+        return scratch;
     }
-    else
-    {
-        // 不支持转换的类型
-        // IsEmpty, IsExternal
-        // IsDate, IsFunction, IsPromise, IsSymbol
-        // IsBuffer, IsArrayBuffer, IsDataView, IsTypedArray
-        // 其实也可以实现一下，但是好像也不是特别有必要干这事
-        return Py_BuildValue("s", value.ToString().Utf8Value().c_str());
-    }
-}
 
-PyObject *napi_value_to_pyobject(Napi::Env &env, Napi::Value &value)
-{
-    std::map<Napi::Value *, PyObject *> cref = std::map<Napi::Value *, PyObject *>();
-    return __napi_value_to_pyobject(env, value, cref);
-}
+private:
+    ConvertScratch *scratch;
+    ScratchLease(const ScratchLease &);
+    ScratchLease &operator=(const ScratchLease &);
+};
 
-// cref这个参数是为了消解循环引用, 循环引用的对象将不在展开
-Napi::Value __pyobject_to_napi_value(const Napi::Env &env, PyObject *object, PyThreadState *state,
-                                     std::map<PyObject *, Napi::Value *> &cref)
+// path是当前路径上的容器, 用来跳过循环引用
+bool __in_same_context(const Napi::Env &env, const Napi::Value &value, Napi::Object &context, ScratchLease &scratch)
 {
-    Py_ssize_t i, length;
-    PyObject *keys, *values, *pIterator, *pItem;
-    Napi::Value item, result, key;
     Napi::Object obj;
-    Napi::Array arr;
+    Napi::Array arr, keys;
+    uint32_t i;
+    size_t j;
+    bool same = true;
 
-    if (object == NULL || object == Py_None)
-    {
-        result = env.Null();
-    }
-    else if (PyLong_Check(object))
-    {
-        result = Napi::Number::New(env, PyLong_AsDouble(object));
-    }
-    else if (PyBool_Check(object))
-    {
-        result = object == Py_True ? Napi::Boolean::New(env, true) : Napi::Boolean::New(env, false);
-    }
-    else if (PyFloat_Check(object))
-    {
-        result = Napi::Number::New(env, PyFloat_AsDouble(object));
+    if (value.IsBuffer()) {
+        // 有些类型需要单独处理一下，否则会FATAL ERROR
+        return true;
     }
-    else if (PyUnicode_Check(object))
+    if (!value.IsObject())
     {
-        if (debug)
-            printf("PyUnicode, %s\n", PyUnicode_AsUTF8(object));
-        result = Napi::String::New(env, PyUnicode_AsUTF8(object));
+        return true;
     }
-    else if (PyBytes_Check(object))
+
+    obj = value.As<Napi::Object>();
+    if (!value.IsArray())
     {
+        if (obj.Has("__wrapper__"))
+        {
+            obj = obj.Get("__wrapper__").As<Napi::Object>();
+        }
         if (debug)
-            printf("PyBytes, %s\n", PyBytes_AsString(object));
-        result = Napi::Buffer<char>::Copy(env, PyBytes_AsString(object), PyBytes_Size(object));
+            printf("obj.state %s, context.state %s\n",
+                   obj.Get("state").ToString().Utf8Value().c_str(),
+                   context.Get("state").ToString().Utf8Value().c_str());
+        if (obj.Has("state"))
+            return obj.Get("state") == context.Get("state");
     }
-    else if (PyTuple_Check(object))
+    for (j = 0; j < scratch->path.size(); j++)
     {
-        length = PyTuple_Size(object);
-        arr = Napi::Array::New(env, size_t(length));
-        for (i = 0; i < length; i++)
+        if (obj.StrictEquals(Napi::Value(env, scratch->path[j])))
         {
-            item = __pyobject_to_napi_value(env, PyTuple_GetItem(object, i), state, cref);
-            arr.Set(uint32_t(i), item);
+            // 正在检查的祖先, 不用再看一遍
+            return true;
         }
-        result = arr;
     }
-    else if (PyList_Check(object))
+
+    scratch->path.push_back(obj);
+    if (value.IsArray())
     {
-        if (debug)
-            printf("PyList\n");
-        if (cref.find(object) == cref.end())
-        {
-            // 第一次遇到的对象，展开
-            length = PyList_Size(object);
-            arr = Napi::Array::New(env, size_t(length));
-            cref[object] = (Napi::Array *)&arr;
-            for (i = 0; i < length; i++)
-            {
-                item = __pyobject_to_napi_value(env, PyList_GetItem(object, i), state, cref);
-                arr.Set(uint32_t(i), item);
-            }
-            result = arr;
-        }
-        else
+        arr = value.As<Napi::Array>();
+        for (i = 0; i < arr.Length() && same; i++)
         {
-            // 第二次遇到的对象, 返回之前保存的引用, 如果展开那就死循环了
-            result = *cref.find(object)->second;
+            same = __in_same_context(env, arr.Get(i), context, scratch);
         }
     }
-    else if (PyDict_Check(object))
+    else
     {
-        if (cref.find(object) == cref.end())
+        keys = obj.GetPropertyNames();
+        for (i = 0; i < keys.Length() && same; i++)
         {
-            // 第一次遇到的对象，展开
-            length = PyDict_Size(object);
-            obj = Napi::Object::New(env);
-            cref[object] = (Napi::Array *)&obj;
-            keys = PyDict_Keys(object);
-            values = PyDict_Values(object);
-            for (i = 0; i < length; i++)
+            if (obj.HasOwnProperty(keys.Get(i)))
             {
-                key = __pyobject_to_napi_value(env, PyList_GetItem(keys, i), state, cref);
-                if (!key.IsString())
-                {
-                    // Python的dict可以接受非string类的key, 遇到这种情况就放弃展开, 返回PyWrapper
-                    Py_DECREF(keys);
-                    Py_DECREF(values);
-                    result = serialize_pyobject(env, object, state);
-                    return result;
-                }
-                else
-                {
-                    obj.Set(key, __pyobject_to_napi_value(env, PyList_GetItem(values, i), state, cref));
-                }
+                same = __in_same_context(env, obj.Get(keys.Get(i)), context, scratch);
             }
-            Py_DECREF(keys);
-            Py_DECREF(values);
-            result = obj;
-        }
-        else
-        {
-            // 第二次遇到的对象, 返回之前保存的引用, 如果展开那就死循环了
-            result = *cref.find(object)->second;
         }
     }
-    else if (PySet_Check(object))
+    scratch->path.pop_back();
+    return same;
+}
+
+bool in_same_context(const Napi::Env &env, Napi::Value &value, Napi::Object &context)
+{
+    ScratchLease scratch;
+    return __in_same_context(env, value, context, scratch);
+}
+
+/* JS和Python之间有直接对应关系的内置类型
+Date <=> datetime.datetime(本地时间), BigInt <=> 超出Number安全范围的int, TypedArray <=> array.array,
+Map => dict, Set => set, ArrayBuffer/DataView => bytes, Decimal => 字符串(不丢精度);
+反过来key不全是str的dict转成Map
+Python这边的类型只在对应模块已经import过的时候才检查, 没import过的模块也不可能有它的实例
+*/
+enum NativeKind
+{
+    NATIVE_NONE,
+    NATIVE_DATETIME,
+    NATIVE_DECIMAL,
+    NATIVE_ARRAY
+};
+
+const double MAX_SAFE_INTEGER = 9007199254740991.0; // 2^53 - 1
+
+// 已经import过的模块的属性, 返回新的引用, 没有的话返回NULL; 需要持有GIL
+PyObject *loaded_module_attr(const char *module, const char *name)
+{
+    PyObject *pModule = PyDict_GetItemString(PyImport_GetModuleDict(), module);
+    PyObject *pAttr;
+    if (pModule == NULL)
     {
-        pIterator = PyObject_GetIter(object);
-        arr = Napi::Array::New(env);
-        i = 0;
-        while ((pItem = PyIter_Next(pIterator)))
-        {
-            arr.Set(i++, __pyobject_to_napi_value(env, pItem, state, cref));
-            Py_DECREF(pItem);
-        }
-        Py_DECREF(pIterator);
-        result = arr;
+        return NULL;
     }
-    else
+    pAttr = PyObject_GetAttrString(pModule, name);
+    if (pAttr == NULL)
     {
-        // 找不到任何序列化方式了，只好存个指针
-        // 这个指针对象永远不会被Py_DECREF, 除非由JS发起_delete_pyobject
-        result = serialize_pyobject(env, object, state);
+        PyErr_Clear();
     }
-
-    return result;
+    return pAttr;
 }
 
-Napi::Value pyobject_to_napi_value(const Napi::Env &env, PyObject *object, PyThreadState *state)
+/* 每个解释器里datetime.datetime/decimal.Decimal/array.array的类型对象, 持有引用, 下标是NativeKind
+模块还没import的是NULL, 等sys.modules的大小变了再去找一次, 不认识的对象不用每次都查sys.modules
+*/
+const int NATIVE_COUNT = NATIVE_ARRAY + 1;
+const char *NATIVE_MODULES[NATIVE_COUNT][2] = {{NULL, NULL}, {"datetime", "datetime"}, {"decimal", "Decimal"}, {"array", "array"}};
+
+struct NativeTypes
 {
-    std::map<PyObject *, Napi::Value *> cref = std::map<PyObject *, Napi::Value *>();
-    return __pyobject_to_napi_value(env, object, state, cref);
-}
+    PyObject *types[NATIVE_COUNT];
+    Py_ssize_t modules; // 上一次找的时候sys.modules的大小
+};
 
-std::string get_pyexception(const Napi::Env &env, const char *error_title)
+std::map<PyInterpreterState *, NativeTypes> native_types;
+std::mutex native_mutex; // getattr可能执行Python代码, 拿着锁的时候不能去找类型
+
+// 当前解释器的类型对象, 借用的引用, 在解释器销毁之前一直有效; 需要持有GIL
+void load_native_types(PyObject *types[NATIVE_COUNT])
 {
-    PyObject *type, *value, *traceback, *tracebackModule, *output, *concat;
-    PyObject *func, *args;
-    std::string error = "";
+    PyInterpreterState *interp = PyThreadState_Get()->interp;
+    Py_ssize_t modules = PyDict_GET_SIZE(PyImport_GetModuleDict());
+    PyObject *found[NATIVE_COUNT] = {NULL};
+    bool stale;
+    int i;
+
+    native_mutex.lock();
+    NativeTypes &cached = native_types[interp];
+    stale = cached.modules != modules;
+    memcpy(types, cached.types, sizeof(cached.types));
+    native_mutex.unlock();
+    if (!stale)
+    {
+        return;
+    }
 
-    // 以防python还没初始化
-    __init_python(env);
+    for (i = 1; i < NATIVE_COUNT; i++)
+    {
+        if (types[i] == NULL)
+            found[i] = loaded_module_attr(NATIVE_MODULES[i][0], NATIVE_MODULES[i][1]);
+    }
+    native_mutex.lock();
+    NativeTypes &entry = native_types[interp];
+    for (i = 1; i < NATIVE_COUNT; i++)
+    {
+        if (entry.types[i] == NULL && found[i] != NULL && PyType_Check(found[i]))
+        {
+            entry.types[i] = found[i];
+            found[i] = NULL;
+        }
+    }
+    entry.modules = modules;
+    memcpy(types, entry.types, sizeof(entry.types));
+    native_mutex.unlock();
+    for (i = 1; i < NATIVE_COUNT; i++)
+    {
+        // 别的线程已经找到了, 或者不是类型
+        Py_XDECREF(found[i]);
+    }
+}
 
-    if (error_title != NULL)
-        error = error_title;
+// interp为NULL的时候清掉全部; release为false表示Python已经销毁了, 只能丢掉指针
+void drop_native_types(PyInterpreterState *interp, bool release)
+{
+    std::map<PyInterpreterState *, NativeTypes>::iterator it;
+    int i;
 
-    PyErr_Fetch(&type, &value, &traceback);
-    if (type != NULL)
+    native_mutex.lock();
+    it = native_types.begin();
+    while (it != native_types.end())
     {
-        // 如果确实存在Python的错误信息
-        tracebackModule = PyImport_ImportModule("traceback");
-        PyErr_NormalizeException(&type, &value, &traceback);
-        if (traceback != NULL)
+        if (interp == NULL || it->first == interp)
         {
-            PyException_SetTraceback(value, traceback);
-            args = PyTuple_Pack(3, type, value, traceback);
-            func = PyObject_GetAttrString(tracebackModule, "format_exception");
+            for (i = 1; i < NATIVE_COUNT && release; i++)
+                Py_XDECREF(it->second.types[i]);
+            it = native_types.erase(it);
         }
         else
         {
-            args = PyTuple_Pack(2, type, value);
-            func = PyObject_GetAttrString(tracebackModule, "format_exception_only");
+            it++;
         }
-        output = PyObject_Call(func, args, NULL);
-        concat = PyObject_CallMethod(Py_BuildValue("s", "  "), "join", "O", output);
-        error += "\n  ";
-        error += PyUnicode_AsUTF8(concat);
-
-        PyErr_Clear();
-
-        Py_XDECREF(type);
-        Py_XDECREF(value);
-        Py_XDECREF(traceback);
-        Py_XDECREF(tracebackModule);
-        Py_XDECREF(output);
-        Py_XDECREF(concat);
-        Py_XDECREF(func);
-        Py_XDECREF(args);
     }
-
-    return error;
+    native_mutex.unlock();
 }
 
-// 把python当前的traceback作为js的错误扔出去
-void throw_pyexception_in_javascript(const Napi::Env &env, const char *error_title)
+// 直接比较类型, 子类也算, 不走__instancecheck__
+NativeKind pyobject_native_kind(PyObject *object)
 {
-    std::string error = get_pyexception(env, error_title);
-    if (error.length() == 0)
+    PyObject *types[NATIVE_COUNT];
+    int i;
+    load_native_types(types);
+    for (i = 1; i < NATIVE_COUNT; i++)
     {
-        error = "UnknownError";
+        if (types[i] != NULL && PyObject_TypeCheck(object, (PyTypeObject *)types[i]))
+            return (NativeKind)i;
     }
-
-    Napi::Error::New(env, error).ThrowAsJavaScriptException();
+    return NATIVE_NONE;
 }
 
-void AcquireGIL(PyThreadState *state, PyThreadState **ts)
+// int能不能用Number精确表示
+bool pylong_is_safe(PyObject *object)
 {
-    if (state == NULL)
-        *ts = PyThreadState_New(py_mainstate->interp);
-    else
+    int overflow;
+    long long value = PyLong_AsLongLongAndOverflow(object, &overflow);
+    if (value == -1 && PyErr_Occurred())
     {
-        *ts = PyThreadState_New(state->interp);
+        PyErr_Clear();
+        return false;
     }
-    PyEval_RestoreThread(*ts);
-}
-
-void ReleaseGIL(PyThreadState *state, PyThreadState **ts)
-{
-    PyThreadState_Clear(*ts);
-    PyThreadState_DeleteCurrent();
+    return overflow == 0 && (double)value <= MAX_SAFE_INTEGER && (double)value >= -MAX_SAFE_INTEGER;
 }
 
-// _call_python专用
-class PyCallWorker : public Napi::AsyncWorker
+// Python对象的str(), 失败的时候返回false
+bool pyobject_to_string(PyObject *object, std::string &text)
 {
-public:
-    PyCallWorker(Napi::Function &callback,
-                 PyObject *pCallable, PyObject *pArgs, PyObject *pKwargs, PyThreadState *state)
-        : Napi::AsyncWorker(callback), _pCallable(pCallable), _pArgs(pArgs), _pKwargs(pKwargs), _state(state) {}
-
-    ~PyCallWorker()
+    PyObject *pStr = PyObject_Str(object);
+    const char *data = NULL;
+    Py_ssize_t length;
+    if (pStr != NULL)
     {
-        AcquireGIL(_state, &ts);
-        Py_DECREF(_pCallable);
-        Py_XDECREF(_pArgs);
-        Py_XDECREF(_pKwargs);
-        Py_XDECREF(pRet);
-        ReleaseGIL(_state, &ts);
+        data = PyUnicode_AsUTF8AndSize(pStr, &length);
+        if (data != NULL)
+        {
+            text.assign(data, (size_t)length);
+        }
+        Py_DECREF(pStr);
     }
+    PyErr_Clear();
+    return data != NULL;
+}
 
-    // This code will be executed on the worker thread
-    void Execute() override
+// datetime => 毫秒时间戳, naive的datetime按本地时间算, 和JS的Date一致
+double pydatetime_to_ms(PyObject *object)
+{
+    PyObject *pStamp = PyObject_CallMethod(object, "timestamp", NULL);
+    double ms = NAN;
+    if (pStamp != NULL)
     {
-        AcquireGIL(_state, &ts);
-        pRet = PyObject_Call(_pCallable, _pArgs, _pKwargs);
-        ReleaseGIL(_state, &ts);
+        ms = PyFloat_AsDouble(pStamp) * 1000;
+        Py_DECREF(pStamp);
     }
+    PyErr_Clear();
+    return ms;
+}
 
-    void OnOK() override
+// 毫秒时间戳 => datetime, Invalid Date或者超出datetime范围的返回None
+PyObject *pydatetime_from_ms(double ms)
+{
+    PyObject *types[NATIVE_COUNT], *pModule, *pResult = NULL;
+    if (std::isfinite(ms))
     {
-        Napi::HandleScope scope(Env());
-        AcquireGIL(_state, &ts);
-        if (pRet == NULL)
+        load_native_types(types);
+        if (types[NATIVE_DATETIME] == NULL)
         {
-            result = Napi::String::New(Env(), get_pyexception(Env(), "python-ts.PyCallWorker failed"));
+            // import以后sys.modules变大了, 下一次load_native_types会找到它
+            pModule = PyImport_ImportModule("datetime");
+            Py_XDECREF(pModule);
+            load_native_types(types);
         }
-        else
+        if (types[NATIVE_DATETIME] != NULL)
         {
-            result = pyobject_to_napi_value(Env(), pRet, _state);
+            pResult = PyObject_CallMethod(types[NATIVE_DATETIME], "fromtimestamp", "d", ms / 1000);
         }
-        ReleaseGIL(_state, &ts);
-        Callback().Call({result});
     }
+    if (pResult == NULL)
+    {
+        PyErr_Clear();
+        Py_INCREF(Py_None);
+        pResult = Py_None;
+    }
+    return pResult;
+}
 
-private:
-    PyObject *_pCallable, *_pArgs, *_pKwargs, *pRet;
-    PyThreadState *_state, *ts;
-    Napi::Value result;
-};
-
-// _exec/_eval专用
-class PyRunWorker : public Napi::AsyncWorker
+// TypedArray的类型 => array.array的typecode, 按C的int是4字节算
+char typed_array_pycode(napi_typedarray_type type)
 {
-public:
-    PyRunWorker(Napi::Function &callback,
-                const char *code, int start, PyObject *pGlobals, PyObject *pLocals, PyThreadState *state)
-        : Napi::AsyncWorker(callback), _pGlobals(pGlobals), _pLocals(pLocals), _state(state),
-          _code(code), _start(start) {}
-
-    ~PyRunWorker()
+    switch (type)
     {
-        AcquireGIL(_state, &ts);
-        Py_XDECREF(pRet);
-        ReleaseGIL(_state, &ts);
+    case napi_int8_array:
+        return 'b';
+    case napi_int16_array:
+        return 'h';
+    case napi_uint16_array:
+        return 'H';
+    case napi_int32_array:
+        return 'i';
+    case napi_uint32_array:
+        return 'I';
+    case napi_float32_array:
+        return 'f';
+    case napi_float64_array:
+        return 'd';
+    case napi_bigint64_array:
+        return 'q';
+    case napi_biguint64_array:
+        return 'Q';
+    default:
+        return 'B';
     }
+}
 
-    // This code will be executed on the worker thread
-    void Execute() override
+size_t typed_array_element_size(napi_typedarray_type type)
+{
+    switch (type)
     {
-        AcquireGIL(_state, &ts);
-        pRet = PyRun_String(_code.c_str(), _start, _pGlobals, _pLocals);
-        ReleaseGIL(_state, &ts);
+    case napi_int16_array:
+    case napi_uint16_array:
+        return 2;
+    case napi_int32_array:
+    case napi_uint32_array:
+    case napi_float32_array:
+        return 4;
+    case napi_float64_array:
+    case napi_bigint64_array:
+    case napi_biguint64_array:
+        return 8;
+    default:
+        return 1;
     }
+}
 
-    void OnOK() override
+// array.array => TypedArray的类型和内容, 'u'之类没有对应TypedArray的返回false
+bool pyarray_to_bytes(PyObject *object, napi_typedarray_type &type, std::string &bytes)
+{
+    static const napi_typedarray_type SIGNED[] = {napi_int8_array, napi_int16_array, napi_int32_array,
+                                                  napi_bigint64_array};
+    static const napi_typedarray_type UNSIGNED[] = {napi_uint8_array, napi_uint16_array, napi_uint32_array,
+                                                    napi_biguint64_array};
+    Py_buffer view;
+    char code;
+    int rank;
+    bool ok = true;
+
+    if (PyObject_GetBuffer(object, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0)
     {
-        Napi::HandleScope scope(Env());
-        AcquireGIL(_state, &ts);
-        if (pRet == NULL)
-        {
-            result = Napi::String::New(Env(), get_pyexception(Env(), "python-ts.PyRunWorker failed"));
-        }
-        else
-        {
-            result = pyobject_to_napi_value(Env(), pRet, _state);
-        }
-        ReleaseGIL(_state, &ts);
-        Callback().Call({result});
+        PyErr_Clear();
+        return false;
+    }
+    code = view.format == NULL ? 'B' : view.format[0];
+    rank = view.itemsize == 1 ? 0 : view.itemsize == 2 ? 1 : view.itemsize == 4 ? 2 : view.itemsize == 8 ? 3 : -1;
+    if (code == 'f' && view.itemsize == 4)
+        type = napi_float32_array;
+    else if (code == 'd' && view.itemsize == 8)
+        type = napi_float64_array;
+    else if (rank >= 0 && (code == 'b' || code == 'h' || code == 'i' || code == 'l' || code == 'q'))
+        type = SIGNED[rank];
+    else if (rank >= 0 && (code == 'B' || code == 'H' || code == 'I' || code == 'L' || code == 'Q'))
+        type = UNSIGNED[rank];
+    else
+        ok = false;
+    if (ok)
+    {
+        bytes.assign((const char *)view.buf, (size_t)view.len);
     }
+    PyBuffer_Release(&view);
+    return ok;
+}
 
-private:
-    PyObject *_pGlobals, *_pLocals, *pRet;
-    PyThreadState *_state, *ts;
-    Napi::Value result;
-    std::string _code;
-    int _start;
-};
+// 字节 => array.array, 需要持有GIL, 返回新的引用
+PyObject *new_pyarray(char code, const char *data, size_t size)
+{
+    PyObject *pModule, *pBytes, *pResult = NULL;
+    pModule = PyImport_ImportModule("array");
+    pBytes = PyBytes_FromStringAndSize(data, (Py_ssize_t)size);
+    if (pModule != NULL && pBytes != NULL)
+    {
+        pResult = PyObject_CallMethod(pModule, "array", "CO", (int)code, pBytes);
+    }
+    Py_XDECREF(pModule);
+    Py_XDECREF(pBytes);
+    return pResult;
+}
 
-/* 设置python的runtime路径
-_set_runtime(path)
-参数:
-    path: runtime目录, 就是有python38._pth, python3.dll, python38.dll的那个文件夹的目录
-          不设置的话默认为当前目录的相对路径`x64/runtime`下。
-          需要在_init_python之前设置。
-返回
-    true代表成功, false代表失败
-*/
-Napi::Boolean _set_runtime_path(const Napi::CallbackInfo &info)
+// JS的TypedArray => array.array
+PyObject *napi_typed_array_to_pyobject(const Napi::Value &value)
 {
-    Napi::String path;
-    Napi::Env env = info.Env();
-    Napi::Boolean succeeded = Napi::Boolean::New(env, true), failed = Napi::Boolean::New(env, false);
+    Napi::TypedArray arr = value.As<Napi::TypedArray>();
+    return new_pyarray(typed_array_pycode(arr.TypedArrayType()),
+                       (const char *)arr.ArrayBuffer().Data() + arr.ByteOffset(), arr.ByteLength());
+}
 
-    if (info.Length() < 1)
+// ArrayBuffer/DataView的内容
+void napi_buffer_view(const Napi::Value &value, const char *&data, size_t &size)
+{
+    Napi::ArrayBuffer buffer;
+    Napi::DataView view;
+    if (value.IsArrayBuffer())
     {
-        Napi::TypeError::New(env, "Please call with (path)").ThrowAsJavaScriptException();
-        return failed;
+        buffer = value.As<Napi::ArrayBuffer>();
+        data = (const char *)buffer.Data();
+        size = buffer.ByteLength();
     }
-    if (!info[0].IsString())
+    else
     {
-        Napi::TypeError::New(env, "Argument `path` should be a String").ThrowAsJavaScriptException();
-        return failed;
+        view = value.As<Napi::DataView>();
+        data = (const char *)view.Data();
+        size = view.ByteLength();
     }
+}
 
-    path = info[0].As<Napi::String>();
-    runtime_path = path.Utf8Value();
-    if (debug)
-        printf("runtime_path = %s\n", runtime_path.c_str());
-    return succeeded;
+Napi::Value new_typed_array(const Napi::Env &env, napi_typedarray_type type, const char *data, size_t size)
+{
+    Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(env, size);
+    napi_value result;
+    memcpy(buffer.Data(), data, size);
+    napi_create_typedarray(env, type, size / typed_array_element_size(type), buffer, 0, &result);
+    return Napi::Value(env, result);
 }
 
-Napi::Value _set_debug(const Napi::CallbackInfo &info)
+// 全局的构造函数, Map/Set/BigInt/Array之类
+Napi::Function napi_global_function(const Napi::Env &env, const char *name)
 {
-    Napi::Env env = info.Env();
-    Napi::Boolean value = Napi::Boolean::New(env, false);
-    if (info.Length() >= 1 && info[0].IsBoolean())
-    {
-        value = info[0].As<Napi::Boolean>();
-    }
-    debug = value.Value();
-    if (debug)
-        printf("debug is on\n");
-    return env.Null();
+    return env.Global().Get(name).As<Napi::Function>();
 }
 
-/*  载入模块，接受两个参数,
-_import_module(module_name, context)
-参数
-    module_name: 模块名称, 可以有.在中间，比如"urllib.parse"
-    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
-返回值
-    如果成功, 返回JSON.stringify({"type": PYOBJECT_WRAPPER, "value": PyObject指针地址})
-    如果失败, raise错误信息
-*/
-Napi::Object _import_module(const Napi::CallbackInfo &info)
+bool napi_is_instance(const Napi::Env &env, const Napi::Object &object, const char *name)
 {
-    PyObject *pModule;
-    Napi::String module_name;
-    Napi::Env env = info.Env();
-    Napi::Object result = Napi::Object::New(env), context = Napi::Object::New(env);
-    PyThreadState *substate;
+    return object.InstanceOf(napi_global_function(env, name));
+}
 
-    // 参数检查并赋值给module_name
-    if (info.Length() < 1)
+// Map => [[key, value], ...], Set => [item, ...]
+Napi::Array napi_collection_items(const Napi::Env &env, const Napi::Object &object)
+{
+    return napi_global_function(env, "Array").Get("from").As<Napi::Function>().Call({object}).As<Napi::Array>();
+}
+
+// 十进制数字 => BigInt
+Napi::Value new_napi_bigint(const Napi::Env &env, const std::string &digits)
+{
+    return napi_global_function(env, "BigInt").Call({Napi::String::New(env, digits)});
+}
+
+// Symbol不能直接ToString, 用String(symbol)得到"Symbol(description)"
+std::string napi_symbol_string(const Napi::Env &env, const Napi::Value &value)
+{
+    return napi_global_function(env, "String").Call({value}).As<Napi::String>().Utf8Value();
+}
+
+// 返回新的引用; scratch->ancestors是当前路径上的容器, 遇到循环引用的时候返回路径上已经建好的对象
+PyObject *__napi_value_to_pyobject(Napi::Env &env, const Napi::Value &value, ScratchLease &scratch)
+{
+    PyObject *pResult, *pItem, *pKey;
+    uint32_t i;
+    Napi::Array arr, keys;
+    Napi::Object obj;
+    Napi::Value item, key;
+    const char *data;
+    size_t size, j;
+
+    if (value.IsBoolean())
     {
-        Napi::TypeError::New(env, "Please call with (module_name, context)").ThrowAsJavaScriptException();
-        return result;
+        // boolean
+        return Py_BuildValue("p", value.As<Napi::Boolean>().Value());
     }
-    if (!info[0].IsString())
+    else if (value.IsNull() || value.IsUndefined())
     {
-        Napi::TypeError::New(env, "Argument `module_name` should be a String").ThrowAsJavaScriptException();
-        return result;
+        // null or undefined => None
+        return Py_BuildValue("s", NULL);
     }
-    if (info.Length() >= 2)
+    else if (value.IsNumber())
     {
-        if (!info[1].IsObject())
+        // number => (int, float)
+        if (debug)
+            printf("Napi::Number! %s\n", value.ToString().Utf8Value().c_str());
+        if (napi_number_is_int(env, value))
         {
-            Napi::TypeError::New(env, "Argument `context` should be an Object")
-                .ThrowAsJavaScriptException();
-            return result;
+            pResult = PyLong_FromDouble(value.As<Napi::Number>().DoubleValue());
         }
-        context = info[1].As<Napi::Object>();
+        else
+        {
+            pResult = Py_BuildValue("d", value.As<Napi::Number>().DoubleValue());
+        }
+        return pResult;
     }
-    module_name = info[0].As<Napi::String>();
-
-    // 以防大家不手动init python, 不管怎样都init一下
-    __init_python(env);
-
-    substate = pycontext_get(context, "state");
-    if (substate != NULL)
+    else if (value.IsString())
     {
-        PyEval_RestoreThread(substate);
+        // string => string
+        if (debug)
+            printf("String! %s\n", value.As<Napi::String>().Utf8Value().c_str());
+        return Py_BuildValue("s", value.As<Napi::String>().Utf8Value().c_str());
     }
-    else
+    else if (value.IsBuffer())
     {
-        PyEval_RestoreThread(py_mainstate);
+        // buffer => bytes
+        Napi::Buffer<char> buffer = value.As<Napi::Buffer<char>>();
+        if (debug)
+            printf("Buffer! %s\n", value.As<Napi::String>().Utf8Value().c_str());
+        return Py_BuildValue("y#", (char*)(buffer.Data()), buffer.Length());
     }
-
-    // 真正的import部分
-    pModule = PyImport_ImportModule(module_name.Utf8Value().c_str());
-    if (pModule == NULL)
+    else if (value.IsBigInt())
     {
-        throw_pyexception_in_javascript(env, "python-ts._import_module failed");
+        // BigInt => int, 经过十进制字符串转换
+        return PyLong_FromString(value.ToString().Utf8Value().c_str(), NULL, 10);
     }
-    else
+    else if (value.IsDate())
     {
-        result = serialize_pyobject(env, pModule, substate);
+        // Date => datetime
+        return pydatetime_from_ms(value.As<Napi::Date>().ValueOf());
     }
-    Py_XDECREF(pModule);
-
-    PyEval_SaveThread();
-    return result;
-}
-
-/* 重载模块
-_reload_module(module_name, context)
-参数
-    module_name: 模块名称, 可以有.在中间，比如"urllib.parse"
-    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
-返回值
-    如果成功, 返回JSON.stringify({"type": PYOBJECT_WRAPPER, "value": PyObject指针地址})
-    如果失败, raise错误信息
-*/
-Napi::Boolean _reload_module(const Napi::CallbackInfo &info)
-{
-    char single_code[MAX_CODE_SIZE];
-    Napi::String module_name, module_path;
-    Napi::Env env = info.Env();
-    Napi::Boolean result, failed = Napi::Boolean::New(env, false), succeeded = Napi::Boolean::New(env, true);
-    Napi::Object context = Napi::Object::New(env);
-    PyThreadState *substate;
-    int ret;
-
-    // 参数检查并赋值给module_name
-    if (info.Length() < 1)
+    else if (value.IsTypedArray())
     {
-        Napi::TypeError::New(env, "Please call with (module_name, context)").ThrowAsJavaScriptException();
-        return failed;
+        // TypedArray => array.array
+        return napi_typed_array_to_pyobject(value);
     }
-    if (!info[0].IsString())
+    else if (value.IsArrayBuffer() || value.IsDataView())
+    {
+        // ArrayBuffer/DataView => bytes
+        napi_buffer_view(value, data, size);
+        return PyBytes_FromStringAndSize(data, (Py_ssize_t)size);
+    }
+    else if (value.IsSymbol())
+    {
+        return PyUnicode_FromString(napi_symbol_string(env, value).c_str());
+    }
+    else if (value.IsFunction())
+    {
+        // function => callable, 新建时的那一份引用交给Python对象
+        // 调用过程中Python自己开的线程也可能调用它, 所以同步调用也要建ThreadSafeFunction
+        JsCallable *callable = new_js_callable(env, value.As<Napi::Function>());
+        pResult = js_callable_to_pyobject(callable);
+        release_js_callable(callable);
+        return pResult;
+    }
+    else if (value.IsObject())
+    {
+        obj = value.As<Napi::Object>();
+        if (!value.IsArray() && is_pyobject(obj))
+        {
+            // 无法deserialize的时候，返回相应信息, 至少别出Fatal Error
+            pResult = deserialize_pyobject(env, obj);
+            if (pResult == NULL)
+            {
+                return Py_BuildValue("s", "RuntimeError('object has been recycled')");
+            }
+            Py_INCREF(pResult);
+            return pResult;
+        }
+        for (j = 0; j < scratch->ancestors.size(); j++)
+        {
+            if (obj.StrictEquals(Napi::Value(env, scratch->ancestors[j].first)))
+            {
+                // 循环引用, 展开会死循环
+                Py_XINCREF(scratch->ancestors[j].second);
+                return scratch->ancestors[j].second;
+            }
+        }
+
+        if (value.IsArray())
+        {
+            arr = value.As<Napi::Array>();
+            if (debug)
+                printf("Napi::Array! Length=%d\n", arr.Length());
+            pResult = PyList_New(arr.Length());
+            scratch->ancestors.push_back(std::make_pair((napi_value)value, pResult));
+            for (i = 0; i < arr.Length(); i++)
+            {
+                pItem = __napi_value_to_pyobject(env, arr.Get(i), scratch);
+                if (pItem == NULL)
+                {
+                    PyErr_Clear();
+                    Py_INCREF(Py_None);
+                    pItem = Py_None;
+                }
+                PyList_SET_ITEM(pResult, i, pItem);
+            }
+        }
+        else if (napi_is_instance(env, obj, "Map"))
+        {
+            // Map => dict, 不能hash的key跳过
+            pResult = PyDict_New();
+            scratch->ancestors.push_back(std::make_pair((napi_value)value, pResult));
+            arr = napi_collection_items(env, obj);
+            for (i = 0; i < arr.Length(); i++)
+            {
+                pKey = __napi_value_to_pyobject(env, arr.Get(i).As<Napi::Array>().Get((uint32_t)0), scratch);
+                pItem = __napi_value_to_pyobject(env, arr.Get(i).As<Napi::Array>().Get((uint32_t)1), scratch);
+                if (pKey == NULL || pItem == NULL || PyDict_SetItem(pResult, pKey, pItem) != 0)
+                {
+                    PyErr_Clear();
+                }
+                Py_XDECREF(pKey);
+                Py_XDECREF(pItem);
+            }
+        }
+        else if (napi_is_instance(env, obj, "Set"))
+        {
+            // Set => set, 元素不能hash的话退回到list
+            arr = napi_collection_items(env, obj);
+            pItem = PyList_New(arr.Length());
+            scratch->ancestors.push_back(std::make_pair((napi_value)value, pItem));
+            for (i = 0; i < arr.Length(); i++)
+            {
+                pKey = __napi_value_to_pyobject(env, arr.Get(i), scratch);
+                if (pKey == NULL)
+                {
+                    PyErr_Clear();
+                    Py_INCREF(Py_None);
+                    pKey = Py_None;
+                }
+                PyList_SET_ITEM(pItem, i, pKey);
+            }
+            pResult = PySet_New(pItem);
+            if (pResult == NULL)
+            {
+                PyErr_Clear();
+                pResult = pItem;
+            }
+            else
+            {
+                Py_DECREF(pItem);
+            }
+        }
+        else
+        {
+            if (debug)
+                printf("Napi::Object!\n");
+            pResult = PyDict_New();
+            scratch->ancestors.push_back(std::make_pair((napi_value)value, pResult));
+            if (!napi_object_is_empty(env, obj))
+            {
+                keys = obj.GetPropertyNames();
+                for (i = 0; i < keys.Length(); i++)
+                {
+                    if (obj.HasOwnProperty(keys.Get(i)))
+                    {
+                        pItem = __napi_value_to_pyobject(env, obj.Get(keys.Get(i)), scratch);
+                        if (pItem == NULL)
+                        {
+                            PyErr_Clear();
+                            continue;
+                        }
+                        PyDict_SetItemString(pResult, keys.Get(i).As<Napi::String>().Utf8Value().c_str(), pItem);
+                        Py_DECREF(pItem);
+                    }
+                }
+            }
+        }
+        scratch->ancestors.pop_back();
+        return pResult;
+    }
+    else
+    {
+        // 不支持转换的类型
+        // IsEmpty, IsExternal
+        return Py_BuildValue("s", value.ToString().Utf8Value().c_str());
+    }
+}
+
+// 返回新的引用
+PyObject *napi_value_to_pyobject(Napi::Env &env, const Napi::Value &value)
+{
+    ScratchLease scratch;
+    return __napi_value_to_pyobject(env, value, scratch);
+}
+
+// JS的args数组 => Python的tuple, 空的或者不是数组的话返回空tuple
+PyObject *napi_args_to_pytuple(Napi::Env &env, Napi::Value value)
+{
+    PyObject *pList, *pTuple;
+    if (!value.IsArray() || value.As<Napi::Array>().Length() == 0)
+    {
+        return PyTuple_New(0);
+    }
+    pList = napi_value_to_pyobject(env, value);
+    if (pList == NULL)
+    {
+        return NULL;
+    }
+    pTuple = PyList_AsTuple(pList);
+    Py_DECREF(pList);
+    return pTuple;
+}
+
+// JS的kwargs对象 => Python的dict, 空的或者不是对象的话返回空dict
+PyObject *napi_kwargs_to_pydict(Napi::Env &env, Napi::Value value)
+{
+    if (!value.IsObject() || value.IsArray() || napi_object_is_empty(env, value.As<Napi::Object>()))
+    {
+        return PyDict_New();
+    }
+    return napi_value_to_pyobject(env, value);
+}
+
+// pyobject_to_napi_value的转换模式
+enum ConvertMode
+{
+    CONVERT_DEEP,    // 全部展开, 默认行为
+    CONVERT_SHALLOW, // 只展开最外面一层, 里面的容器都返回PyWrapper
+    CONVERT_HANDLE,  // 除了None/bool/int/float之外一律返回PyWrapper
+    CONVERT_AUTO     // 按预算展开, 超出max_items/max_bytes的子树返回PyWrapper
+};
+
+struct ConvertOptions
+{
+    ConvertMode mode;
+    size_t max_items; // CONVERT_AUTO: 容器元素个数的总预算
+    size_t max_bytes; // CONVERT_AUTO: str/bytes长度的总预算
+    size_t items;     // 转换过程中已经用掉的预算
+    size_t bytes;
+    bool records;     // dataclass/namedtuple/__slots__对象按字段展开成JS对象
+};
+
+const ConvertOptions DEFAULT_CONVERT = {CONVERT_DEEP, 10000, 1 << 20, 0, 0, false};
+
+/* 解析JS传进来的转换选项
+{convert: 'deep' | 'shallow' | 'handle' | 'auto', max_items?: number, max_bytes?: number, records?: boolean}
+undefined/null就是默认的deep, 参数不对的话抛JS错误并返回false
+*/
+bool parse_convert_options(const Napi::Env &env, const Napi::Value &value, ConvertOptions &options)
+{
+    const char *budgets[] = {"max_items", "max_bytes"};
+    Napi::Object obj;
+    Napi::Value item;
+    std::string mode;
+    double budget;
+    int i;
+
+    options = DEFAULT_CONVERT;
+    if (value.IsUndefined() || value.IsNull())
+    {
+        return true;
+    }
+    if (!value.IsObject())
+    {
+        Napi::TypeError::New(env, "Argument `options` should be an Object").ThrowAsJavaScriptException();
+        return false;
+    }
+    obj = value.As<Napi::Object>();
+
+    item = obj.Get("convert");
+    if (item.IsString())
+    {
+        mode = item.As<Napi::String>().Utf8Value();
+        if (mode == "deep")
+            options.mode = CONVERT_DEEP;
+        else if (mode == "shallow")
+            options.mode = CONVERT_SHALLOW;
+        else if (mode == "handle")
+            options.mode = CONVERT_HANDLE;
+        else if (mode == "auto")
+            options.mode = CONVERT_AUTO;
+        else
+        {
+            Napi::TypeError::New(env, "Option `convert` should be one of deep/shallow/handle/auto")
+                .ThrowAsJavaScriptException();
+            return false;
+        }
+    }
+    else if (!item.IsUndefined())
+    {
+        Napi::TypeError::New(env, "Option `convert` should be a String").ThrowAsJavaScriptException();
+        return false;
+    }
+
+    // 负数或者NaN转成size_t就成了一个很大的数或者0, 不能直接转
+    for (i = 0; i < 2; i++)
+    {
+        item = obj.Get(budgets[i]);
+        if (item.IsUndefined())
+            continue;
+        budget = item.IsNumber() ? item.As<Napi::Number>().DoubleValue() : -1;
+        if (!std::isfinite(budget) || budget < 0)
+        {
+            Napi::TypeError::New(env, std::string("Option `") + budgets[i] + "` should be a non-negative Number")
+                .ThrowAsJavaScriptException();
+            return false;
+        }
+        *(i == 0 ? &options.max_items : &options.max_bytes) = (size_t)budget;
+    }
+    item = obj.Get("records");
+    if (item.IsBoolean())
+        options.records = item.As<Napi::Boolean>().Value();
+    return true;
+}
+
+// 按转换模式判断str/bytes/容器是否要展开, 不展开的就作为PyWrapper返回
+bool convert_should_expand(PyObject *object, ConvertOptions &options, int depth)
+{
+    size_t size;
+
+    if (options.mode == CONVERT_DEEP)
+        return true;
+    if (options.mode == CONVERT_HANDLE)
+        return false;
+
+    if (PyUnicode_Check(object) || PyBytes_Check(object))
+    {
+        if (options.mode == CONVERT_SHALLOW)
+            return true;
+        size = PyUnicode_Check(object) ? (size_t)PyUnicode_GET_LENGTH(object) : (size_t)PyBytes_GET_SIZE(object);
+        if (options.bytes + size > options.max_bytes)
+            return false;
+        options.bytes += size;
+        return true;
+    }
+
+    // 剩下的都是tuple/list/dict/set
+    if (options.mode == CONVERT_SHALLOW)
+        return depth == 0;
+    size = PyDict_Check(object) ? (size_t)PyDict_GET_SIZE(object)
+                                : PyAnySet_Check(object) ? (size_t)PySet_GET_SIZE(object) : (size_t)Py_SIZE(object);
+    if (options.items + size > options.max_items)
+        return false;
+    options.items += size;
+    return true;
+}
+
+/* records选项: dataclass, namedtuple和定义了__slots__的对象按字段直接转成JS对象
+每个类型的字段列表只算一次, 缓存在record_types里, 不是记录类型的也缓存, 下次直接跳过
+缓存持有类型对象的引用, 防止类型被回收以后地址被复用
+*/
+enum RecordKind
+{
+    RECORD_NONE,
+    RECORD_TUPLE, // namedtuple: 字段按位置从tuple里取
+    RECORD_ATTRS  // dataclass/__slots__: 字段用getattr取
+};
+
+struct RecordType
+{
+    RecordKind kind;
+    PyInterpreterState *interp;
+    std::vector<PyObject *> names; // str, 持有引用
+};
+
+std::map<PyTypeObject *, RecordType> record_types;
+std::mutex record_mutex;
+
+// 按顺序把可迭代对象里的str加到names里, 跳过重复的和__dict__/__weakref__
+void collect_record_names(PyObject *iterable, RecordType &record)
+{
+    PyObject *pIterator, *pItem;
+    size_t i;
+    bool skip;
+
+    if (PyUnicode_Check(iterable))
+    {
+        // __slots__ = 'name'
+        pIterator = PyTuple_Pack(1, iterable);
+        collect_record_names(pIterator, record);
+        Py_DECREF(pIterator);
+        return;
+    }
+    pIterator = PyObject_GetIter(iterable);
+    if (pIterator == NULL)
+    {
+        PyErr_Clear();
+        return;
+    }
+    while ((pItem = PyIter_Next(pIterator)))
+    {
+        skip = !PyUnicode_Check(pItem) || PyUnicode_CompareWithASCIIString(pItem, "__dict__") == 0 ||
+               PyUnicode_CompareWithASCIIString(pItem, "__weakref__") == 0;
+        for (i = 0; i < record.names.size() && !skip; i++)
+        {
+            skip = PyUnicode_Compare(record.names[i], pItem) == 0;
+        }
+        if (skip)
+        {
+            Py_DECREF(pItem);
+        }
+        else
+        {
+            record.names.push_back(pItem);
+        }
+    }
+    Py_DECREF(pIterator);
+    PyErr_Clear();
+}
+
+// 第一次遇到一个类型的时候算出它的字段
+void inspect_record_type(PyTypeObject *type, RecordType &record)
+{
+    PyObject *pFields, *pFunc, *pList, *pMro, *pSlots, *pName;
+    PyTypeObject *base;
+    Py_ssize_t i;
+
+    record.kind = RECORD_NONE;
+    if (PyType_IsSubtype(type, &PyTuple_Type))
+    {
+        // namedtuple
+        pFields = PyObject_GetAttrString((PyObject *)type, "_fields");
+        if (pFields != NULL && PyTuple_Check(pFields))
+        {
+            collect_record_names(pFields, record);
+            record.kind = RECORD_TUPLE;
+        }
+        Py_XDECREF(pFields);
+        PyErr_Clear();
+        return;
+    }
+
+    if (PyObject_HasAttrString((PyObject *)type, "__dataclass_fields__"))
+    {
+        // dataclass: 用dataclasses.fields()排除ClassVar和InitVar
+        pFunc = loaded_module_attr("dataclasses", "fields");
+        pFields = pFunc == NULL ? NULL : PyObject_CallFunctionObjArgs(pFunc, (PyObject *)type, NULL);
+        if (pFields != NULL)
+        {
+            pList = PyList_New(0);
+            for (i = 0; i < PyTuple_Size(pFields); i++)
+            {
+                pName = PyObject_GetAttrString(PyTuple_GET_ITEM(pFields, i), "name");
+                if (pName != NULL)
+                {
+                    PyList_Append(pList, pName);
+                    Py_DECREF(pName);
+                }
+            }
+            collect_record_names(pList, record);
+            record.kind = RECORD_ATTRS;
+            Py_DECREF(pList);
+            Py_DECREF(pFields);
+        }
+        Py_XDECREF(pFunc);
+        PyErr_Clear();
+        return;
+    }
+
+    // __slots__: 沿着MRO收集, 父类的字段在前面; 实例还有__dict__的话字段不全, 不算
+    pMro = type->tp_mro;
+    if (pMro == NULL || !PyTuple_Check(pMro))
+    {
+        return;
+    }
+    for (i = PyTuple_GET_SIZE(pMro) - 1; i >= 0; i--)
+    {
+        base = (PyTypeObject *)PyTuple_GET_ITEM(pMro, i);
+        if (!(base->tp_flags & Py_TPFLAGS_HEAPTYPE) || base->tp_dict == NULL)
+        {
+            continue;
+        }
+        if (PyDict_GetItemString(base->tp_dict, "__dict__") != NULL)
+        {
+            record.kind = RECORD_NONE;
+            break;
+        }
+        pSlots = PyDict_GetItemString(base->tp_dict, "__slots__");
+        if (pSlots != NULL)
+        {
+            collect_record_names(pSlots, record);
+            record.kind = RECORD_ATTRS;
+        }
+    }
+}
+
+// 需要持有GIL; 不是记录类型的返回NULL
+// 查看类型的时候会执行Python代码, 可能放开GIL, 所以不能在持有record_mutex的时候做
+RecordType *find_record_type(PyObject *object)
+{
+    std::map<PyTypeObject *, RecordType>::iterator it;
+    PyTypeObject *type = Py_TYPE(object);
+    RecordType record;
+    size_t i;
+    bool inserted;
+
+    if (type->tp_flags & (Py_TPFLAGS_TYPE_SUBCLASS | Py_TPFLAGS_LONG_SUBCLASS | Py_TPFLAGS_UNICODE_SUBCLASS |
+                          Py_TPFLAGS_BYTES_SUBCLASS | Py_TPFLAGS_DICT_SUBCLASS | Py_TPFLAGS_LIST_SUBCLASS) ||
+        !(type->tp_flags & Py_TPFLAGS_HEAPTYPE))
+    {
+        // 内置类型和它们的子类(namedtuple除外)都不算
+        return NULL;
+    }
+
+    record_mutex.lock();
+    it = record_types.find(type);
+    inserted = it != record_types.end();
+    record_mutex.unlock();
+
+    if (!inserted)
+    {
+        record.interp = PyThreadState_Get()->interp;
+        inspect_record_type(type, record);
+        record_mutex.lock();
+        it = record_types.find(type);
+        if (it == record_types.end())
+        {
+            Py_INCREF(type);
+            it = record_types.insert(std::make_pair(type, record)).first;
+            record.names.clear();
+        }
+        record_mutex.unlock();
+        for (i = 0; i < record.names.size(); i++)
+        {
+            // 别的线程已经登记过了
+            Py_DECREF(record.names[i]);
+        }
+    }
+    // 只有销毁context的时候才删除条目, 那时候不会有转换在进行, 指针可以放心返回
+    return it->second.kind == RECORD_NONE ? NULL : &it->second;
+}
+
+// 记录类型的字段算作容器元素, 预算规则和convert_should_expand一样
+bool record_should_expand(RecordType *record, ConvertOptions &options, int depth)
+{
+    if (options.mode == CONVERT_SHALLOW)
+        return depth == 0;
+    if (options.mode == CONVERT_AUTO)
+    {
+        if (options.items + record->names.size() > options.max_items)
+            return false;
+        options.items += record->names.size();
+    }
+    return true;
+}
+
+// 字段的值, 返回新的引用; 没有赋值的__slots__字段返回NULL
+PyObject *record_field(PyObject *object, RecordType *record, size_t i)
+{
+    PyObject *pItem;
+    if (record->kind == RECORD_TUPLE)
+    {
+        pItem = i < (size_t)PyTuple_GET_SIZE(object) ? PyTuple_GET_ITEM(object, i) : NULL;
+        Py_XINCREF(pItem);
+        return pItem;
+    }
+    pItem = PyObject_GetAttr(object, record->names[i]);
+    if (pItem == NULL)
+    {
+        PyErr_Clear();
+    }
+    return pItem;
+}
+
+// interp为NULL的时候清掉全部; release为false表示Python已经销毁了, 只能丢掉指针
+void drop_record_types(PyInterpreterState *interp, bool release)
+{
+    std::map<PyTypeObject *, RecordType>::iterator it;
+    size_t i;
+
+    record_mutex.lock();
+    it = record_types.begin();
+    while (it != record_types.end())
+    {
+        if (interp == NULL || it->second.interp == interp)
+        {
+            if (release)
+            {
+                for (i = 0; i < it->second.names.size(); i++)
+                    Py_DECREF(it->second.names[i]);
+                Py_DECREF(it->first);
+            }
+            it = record_types.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+    record_mutex.unlock();
+}
+
+// 记下Python容器对应的JS值, 之后再遇到同一个对象直接复用
+void remember_napi_value(ScratchLease &scratch, PyObject *object, const Napi::Value &value)
+{
+    scratch->pyobjects.insert(object, (uint32_t)scratch->values.size());
+    scratch->values.push_back(value);
+}
+
+// scratch->pyobjects记录已经转换过的容器, 同一个Python对象只生成一个JS值, 也用来消解循环引用
+// options是本次转换的模式和预算, depth是当前的嵌套层数
+Napi::Value __pyobject_to_napi_value(const Napi::Env &env, PyObject *object, PyThreadState *state,
+                                     ScratchLease &scratch, ConvertOptions &options, int depth)
+{
+    Py_ssize_t i, length, pos;
+    PyObject *pKey, *pValue, *pIterator, *pItem;
+    Napi::Value item, result, key;
+    Napi::Object obj;
+    Napi::Array arr;
+    Napi::Function setter;
+    NativeKind kind;
+    napi_typedarray_type type;
+    std::string text;
+    RecordType *record;
+    napi_property_descriptor prop;
+    const char *data;
+    size_t field, base;
+    uint32_t found;
+    bool map;
+
+    if (object == NULL || object == Py_None)
+    {
+        result = env.Null();
+    }
+    else if (PyBool_Check(object))
+    {
+        // bool是int的子类, 要先判断
+        result = object == Py_True ? Napi::Boolean::New(env, true) : Napi::Boolean::New(env, false);
+    }
+    else if (PyLong_Check(object) && !pylong_is_safe(object) && pyobject_to_string(object, text))
+    {
+        // 超出Number安全范围的int => BigInt
+        result = new_napi_bigint(env, text);
+    }
+    else if (PyLong_Check(object))
+    {
+        result = Napi::Number::New(env, PyLong_AsDouble(object));
+    }
+    else if (PyFloat_Check(object))
+    {
+        result = Napi::Number::New(env, PyFloat_AsDouble(object));
+    }
+    else if (options.records && options.mode != CONVERT_HANDLE && (record = find_record_type(object)) != NULL)
+    {
+        if (scratch->pyobjects.find(object, found))
+        {
+            result = Napi::Value(env, scratch->values[found]);
+        }
+        else if (!record_should_expand(record, options, depth))
+        {
+            result = serialize_pyobject(env, object, state);
+        }
+        else
+        {
+            // 记录类型按字段展开, 没赋值的字段跳过
+            obj = Napi::Object::New(env);
+            remember_napi_value(scratch, object, obj);
+            for (field = 0; field < record->names.size(); field++)
+            {
+                pItem = record_field(object, record, field);
+                if (pItem != NULL)
+                {
+                    obj.Set(PyUnicode_AsUTF8(record->names[field]),
+                            __pyobject_to_napi_value(env, pItem, state, scratch, options, depth + 1));
+                    Py_DECREF(pItem);
+                }
+            }
+            result = obj;
+        }
+    }
+    else if ((PyUnicode_Check(object) || PyBytes_Check(object) || PyTuple_Check(object) ||
+              PyList_Check(object) || PyDict_Check(object) || PySet_Check(object)) &&
+             !convert_should_expand(object, options, depth))
+    {
+        // 超出预算或者不要求展开的, 留在Python里
+        result = serialize_pyobject(env, object, state);
+    }
+    else if (PyUnicode_Check(object))
+    {
+        if (debug)
+            printf("PyUnicode, %s\n", PyUnicode_AsUTF8(object));
+        result = Napi::String::New(env, PyUnicode_AsUTF8(object));
+    }
+    else if (PyBytes_Check(object))
+    {
+        if (debug)
+            printf("PyBytes, %s\n", PyBytes_AsString(object));
+        result = Napi::Buffer<char>::Copy(env, PyBytes_AsString(object), PyBytes_Size(object));
+    }
+    else if (PyTuple_Check(object))
+    {
+        length = PyTuple_GET_SIZE(object);
+        arr = Napi::Array::New(env, size_t(length));
+        for (i = 0; i < length; i++)
+        {
+            item = __pyobject_to_napi_value(env, PyTuple_GET_ITEM(object, i), state, scratch, options, depth + 1);
+            arr.Set(uint32_t(i), item);
+        }
+        result = arr;
+    }
+    else if (PyList_Check(object))
+    {
+        if (debug)
+            printf("PyList\n");
+        if (!scratch->pyobjects.find(object, found))
+        {
+            // 第一次遇到的对象，展开
+            // 元素个数每次重新取, 转换过程中执行的Python代码(比如records的property)有可能改动list
+            arr = Napi::Array::New(env, size_t(PyList_GET_SIZE(object)));
+            remember_napi_value(scratch, object, arr);
+            for (i = 0; i < PyList_GET_SIZE(object); i++)
+            {
+                // 元素也有可能在转换过程中被拿掉, 先拿住
+                pItem = PyList_GET_ITEM(object, i);
+                Py_INCREF(pItem);
+                item = __pyobject_to_napi_value(env, pItem, state, scratch, options, depth + 1);
+                Py_DECREF(pItem);
+                arr.Set(uint32_t(i), item);
+            }
+            result = arr;
+        }
+        else
+        {
+            // 第二次遇到的对象, 返回之前保存的引用, 如果展开那就死循环了
+            result = Napi::Value(env, scratch->values[found]);
+        }
+    }
+    else if (PyDict_Check(object))
+    {
+        if (!scratch->pyobjects.find(object, found))
+        {
+            // 第一次遇到的对象，展开
+            // 用PyDict_Next直接遍历, 不生成临时的keys/values列表; 属性攒齐以后一次定义好
+            // key直接生成JS字符串, 不占用auto模式的max_bytes预算
+            found = (uint32_t)scratch->values.size();
+            obj = Napi::Object::New(env);
+            remember_napi_value(scratch, object, obj);
+            // props按栈使用, 里面的对象用完会退回到它们的base, 只能用下标访问
+            base = scratch->props.size();
+            memset(&prop, 0, sizeof(prop));
+            prop.attributes = (napi_property_attributes)(napi_writable | napi_enumerable | napi_configurable);
+            pos = 0;
+            map = false;
+            while (PyDict_Next(object, &pos, &pKey, &pValue))
+            {
+                if (!PyUnicode_Check(pKey))
+                {
+                    // key不全是str的dict => Map, 不用先把整个dict扫一遍; 一般第一个key就能看出来
+                    map = true;
+                    break;
+                }
+                data = PyUnicode_AsUTF8AndSize(pKey, &length);
+                if (data == NULL)
+                {
+                    // 带surrogate之类没法转utf8的key, 跳过
+                    PyErr_Clear();
+                    continue;
+                }
+                // 转换过程中value有可能被别的代码从dict里拿掉, 先拿住
+                Py_INCREF(pValue);
+                prop.name = Napi::String::New(env, data, size_t(length));
+                prop.value = __pyobject_to_napi_value(env, pValue, state, scratch, options, depth + 1);
+                scratch->props.push_back(prop);
+                Py_DECREF(pValue);
+            }
+            if (map)
+            {
+                // 已经转换的属性丢掉, 从头按Map转换; 之前的值里引用了这个dict的话, 指向的还是丢掉的那个对象
+                scratch->props.resize(base);
+                obj = napi_global_function(env, "Map").New({});
+                scratch->values[found] = obj;
+                setter = obj.Get("set").As<Napi::Function>();
+                pos = 0;
+                while (PyDict_Next(object, &pos, &pKey, &pValue))
+                {
+                    // 转换过程中key/value有可能被别的代码从dict里拿掉, 先拿住
+                    Py_INCREF(pKey);
+                    Py_INCREF(pValue);
+                    key = __pyobject_to_napi_value(env, pKey, state, scratch, options, depth + 1);
+                    item = __pyobject_to_napi_value(env, pValue, state, scratch, options, depth + 1);
+                    setter.Call(obj, {key, item});
+                    Py_DECREF(pKey);
+                    Py_DECREF(pValue);
+                }
+            }
+            if (scratch->props.size() > base)
+            {
+                napi_define_properties(env, obj, scratch->props.size() - base, &scratch->props[base]);
+            }
+            scratch->props.resize(base);
+            result = obj;
+        }
+        else
+        {
+            // 第二次遇到的对象, 返回之前保存的引用, 如果展开那就死循环了
+            result = Napi::Value(env, scratch->values[found]);
+        }
+    }
+    else if (PySet_Check(object))
+    {
+        // 先拷贝成list: 转换过程中set被改动的话迭代器会报错, 元素个数也对不上
+        pIterator = PySequence_List(object);
+        if (pIterator == NULL)
+        {
+            // 拷贝失败, 留在Python里
+            PyErr_Clear();
+            result = serialize_pyobject(env, object, state);
+        }
+        else
+        {
+            length = PyList_GET_SIZE(pIterator);
+            arr = Napi::Array::New(env, size_t(length));
+            for (i = 0; i < length; i++)
+            {
+                arr.Set(uint32_t(i), __pyobject_to_napi_value(env, PyList_GET_ITEM(pIterator, i), state, scratch, options, depth + 1));
+            }
+            Py_DECREF(pIterator);
+            result = arr;
+        }
+    }
+    else if (options.mode != CONVERT_HANDLE && (kind = pyobject_native_kind(object)) != NATIVE_NONE &&
+             (kind != NATIVE_ARRAY || pyarray_to_bytes(object, type, text)))
+    {
+        if (kind == NATIVE_DATETIME)
+            result = Napi::Date::New(env, pydatetime_to_ms(object));
+        else if (kind == NATIVE_DECIMAL && pyobject_to_string(object, text))
+            result = Napi::String::New(env, text);
+        else if (kind == NATIVE_ARRAY)
+            result = new_typed_array(env, type, text.data(), text.size());
+        else
+            result = serialize_pyobject(env, object, state);
+    }
+    else
+    {
+        // 找不到任何序列化方式了，只好存个指针
+        // 这个指针对象永远不会被Py_DECREF, 除非由JS发起_delete_pyobject
+        result = serialize_pyobject(env, object, state);
+    }
+
+    return result;
+}
+
+Napi::Value pyobject_to_napi_value(const Napi::Env &env, PyObject *object, PyThreadState *state,
+                                   const ConvertOptions &options = DEFAULT_CONVERT)
+{
+    ScratchLease scratch;
+    ConvertOptions budget = options;
+    return __pyobject_to_napi_value(env, object, state, scratch, budget, 0);
+}
+
+// 把当前的Python错误连同traceback格式化成字符串并清掉, 需要持有GIL
+std::string format_pyexception(const char *error_title)
+{
+    PyObject *type, *value, *traceback, *tracebackModule, *output, *concat;
+    PyObject *func, *args;
+    std::string error = "";
+
+    if (error_title != NULL)
+        error = error_title;
+
+    PyErr_Fetch(&type, &value, &traceback);
+    if (type != NULL)
+    {
+        // 如果确实存在Python的错误信息
+        PyErr_NormalizeException(&type, &value, &traceback);
+        tracebackModule = PyImport_ImportModule("traceback");
+        if (traceback != NULL)
+        {
+            PyException_SetTraceback(value, traceback);
+            args = PyTuple_Pack(3, type, value, traceback);
+            func = tracebackModule == NULL ? NULL : PyObject_GetAttrString(tracebackModule, "format_exception");
+        }
+        else
+        {
+            args = PyTuple_Pack(2, type, value);
+            func = tracebackModule == NULL ? NULL : PyObject_GetAttrString(tracebackModule, "format_exception_only");
+        }
+        output = func == NULL || args == NULL ? NULL : PyObject_Call(func, args, NULL);
+        concat = output == NULL ? NULL : PyObject_CallMethod(Py_BuildValue("s", "  "), "join", "O", output);
+        error += "\n  ";
+        if (concat != NULL)
+        {
+            error += PyUnicode_AsUTF8(concat);
+        }
+        else
+        {
+            // 比如超过了内存上限, 连traceback都格式化不了, 至少带上异常的类型
+            error += ((PyTypeObject *)type)->tp_name;
+        }
+
+        PyErr_Clear();
+
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+        Py_XDECREF(tracebackModule);
+        Py_XDECREF(output);
+        Py_XDECREF(concat);
+        Py_XDECREF(func);
+        Py_XDECREF(args);
+    }
+
+    return error;
+}
+
+std::string get_pyexception(const Napi::Env &env, const char *error_title)
+{
+    // 以防python还没初始化
+    __init_python(env);
+    return format_pyexception(error_title);
+}
+
+// 把python当前的traceback作为js的错误扔出去
+void throw_pyexception_in_javascript(const Napi::Env &env, const char *error_title)
+{
+    std::string error = get_pyexception(env, error_title);
+    if (error.length() == 0)
+    {
+        error = "UnknownError";
+    }
+
+    Napi::Error::New(env, error).ThrowAsJavaScriptException();
+}
+
+// error为NULL的时候扔成JS错误, 否则格式化到error里, 留给回调
+void report_pyexception(const Napi::Env &env, const char *error_title, std::string *error)
+{
+    if (error == NULL)
+    {
+        throw_pyexception_in_javascript(env, error_title);
+        return;
+    }
+    *error = get_pyexception(env, error_title);
+    if (error->length() == 0)
+    {
+        *error = "UnknownError";
+    }
+}
+
+/* 异步调用在libuv线程上用的PyThreadState
+每个线程在每个解释器上只建一个, 用完不删, 下一个调用接着用: 省掉每次的PyThreadState_New/Delete,
+free-threaded的Python(3.13t)里这两个都要拿解释器的全局锁; 而且那里的PyThreadState带着线程自己的内存分配器, 不能换线程用
+删除context和销毁Python的时候由drop_pool_states清掉
+*/
+std::map<PyInterpreterState *, std::map<std::thread::id, PyThreadState *>> pool_states; // 需要持有smutex
+
+// interp为NULL的时候清掉全部; release为true的时候需要持有这个解释器的GIL, false表示Python已经销毁了
+void drop_pool_states(PyInterpreterState *interp, bool release)
+{
+    std::map<PyInterpreterState *, std::map<std::thread::id, PyThreadState *>>::iterator it;
+    std::map<std::thread::id, PyThreadState *>::iterator ts;
+
+    smutex.lock();
+    it = pool_states.begin();
+    while (it != pool_states.end())
+    {
+        if (interp == NULL || it->first == interp)
+        {
+            for (ts = it->second.begin(); release && ts != it->second.end(); ts++)
+            {
+                PyThreadState_Clear(ts->second);
+                PyThreadState_Delete(ts->second);
+            }
+            it = pool_states.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+    smutex.unlock();
+}
+
+void AcquireGIL(PyThreadState *state, PyThreadState **ts)
+{
+    TraceSpan span("gil", "gil");
+    PyInterpreterState *interp = state == NULL ? py_mainstate->interp : state->interp;
+    std::thread::id self = std::this_thread::get_id();
+    std::map<std::thread::id, PyThreadState *>::iterator it;
+
+    smutex.lock();
+    it = pool_states[interp].find(self);
+    *ts = it == pool_states[interp].end() ? NULL : it->second;
+    smutex.unlock();
+
+    if (*ts == NULL)
+    {
+        *ts = PyThreadState_New(interp);
+        smutex.lock();
+        pool_states[interp][self] = *ts;
+        smutex.unlock();
+    }
+    PyEval_RestoreThread(*ts);
+    // 上一个调用没来得及触发的async exception不能留给这个调用
+    PyThreadState_SetAsyncExc(PyThread_get_thread_ident(), NULL);
+}
+
+void ReleaseGIL(PyThreadState *state, PyThreadState **ts)
+{
+    PyThreadState_SetAsyncExc(PyThread_get_thread_ident(), NULL);
+    PyErr_Clear();
+    PyEval_SaveThread();
+}
+
+// 主解释器在当前线程上的PyThreadState; 一个PyThreadState不能给多个线程用,
+// 所以初始化Python的线程用py_mainstate, 其他线程第一次用的时候新建一个
+PyThreadState *thread_main_state()
+{
+    if (std::this_thread::get_id() == py_main_thread)
+    {
+        return py_mainstate;
+    }
+    if (thread_mainstate == NULL)
+    {
+        thread_mainstate = PyThreadState_New(py_mainstate->interp);
+    }
+    return thread_mainstate;
+}
+
+// 同步调用进入Python, 返回值交给LeavePython用来恢复现场
+// withGIL会话中GIL本来就拿着, 只需要在不同的context之间切换PyThreadState
+PyThreadState *EnterPython(PyThreadState *state)
+{
+    PyThreadState *target = state == NULL ? thread_main_state() : state;
+    if (gil_session > 0)
+    {
+        return PyThreadState_Swap(target);
+    }
+    TraceSpan span("gil", "gil");
+    PyEval_RestoreThread(target);
+    return NULL;
+}
+
+void LeavePython(PyThreadState *previous)
+{
+    if (gil_session > 0)
+    {
+        PyThreadState_Swap(previous);
+        return;
+    }
+    PyEval_SaveThread();
+}
+
+/* 异步调用用的中间格式
+worker线程在持有GIL的时候把返回值摊平成FlatValue, OnOK在JS主线程上直接从FlatValue生成JS值, 不用再拿GIL;
+反过来, 异步调用的参数在JS主线程上摊平, 到了worker线程再生成Python对象
+nodes按先序排列, 容器节点后面紧跟着它的子节点; 字符串都放在arena里; dict/object的键放在shapes里, 结构相同的共用一个
+*/
+enum FlatTag
+{
+    FLAT_NULL,
+    FLAT_BOOL,   // number: 0/1
+    FLAT_INT,    // number: JS这边是整数的Number, 转成Python的int
+    FLAT_FLOAT,  // number
+    FLAT_STRING, // offset/size: arena里的utf8字节
+    FLAT_BUFFER, // offset/size: arena里的字节
+    FLAT_ARRAY,  // size: 元素个数
+    FLAT_OBJECT, // shape: 键的列表, 子节点是按shape顺序排好的值
+    FLAT_REF,    // size: 之前出现过的容器节点的编号, 用来还原循环引用
+    FLAT_HANDLE,   // object: Python对象, 结果里的是自己持有的引用, 参数里的是pin_pyobject借来的
+    FLAT_FUNCTION, // callable: JS函数, 参数里才会有, 到了worker线程变成Python的callable
+    FLAT_DATE,     // number: 毫秒时间戳, Date <=> datetime
+    FLAT_BIGINT,   // offset/size: arena里的十进制数字, BigInt <=> int
+    FLAT_TYPED,    // offset/size: arena里的字节, kind: napi_typedarray_type, TypedArray <=> array.array
+    FLAT_MAP,      // size: 键值对的个数, 子节点是key, value交替排列
+    FLAT_SET       // size: 元素个数
+};
+
+struct FlatNode
+{
+    uint8_t tag;
+    uint8_t kind;
+    uint32_t size;
+    union
+    {
+        double number;
+        size_t offset;
+        uint32_t shape;
+        PyObject *object;
+        JsCallable *callable;
+    };
+};
+
+struct FlatKey
+{
+    size_t offset;
+    uint32_t size;
+};
+
+struct FlatShape
+{
+    uint32_t first, count; // 在keys里的范围
+};
+
+class FlatValue
+{
+public:
+    std::vector<FlatNode> nodes;
+    std::string arena;
+    std::vector<FlatKey> keys;
+    std::vector<FlatShape> shapes;
+    std::map<std::string, uint32_t> shape_index; // 构建的时候用来合并相同的shape
+    uint32_t handles, functions;
+
+    FlatValue() : handles(0), functions(0) {}
+
+    uint32_t push(uint8_t tag, uint32_t size)
+    {
+        FlatNode node;
+        node.tag = tag;
+        node.kind = 0;
+        node.size = size;
+        node.offset = 0;
+        nodes.push_back(node);
+        return (uint32_t)(nodes.size() - 1);
+    }
+
+    void push_number(uint8_t tag, double number)
+    {
+        nodes[push(tag, 0)].number = number;
+    }
+
+    void push_bytes(uint8_t tag, const char *data, size_t size)
+    {
+        nodes[push(tag, (uint32_t)size)].offset = arena.size();
+        arena.append(data, size);
+    }
+
+    void push_handle(PyObject *object)
+    {
+        nodes[push(FLAT_HANDLE, 0)].object = object;
+        handles++;
+    }
+
+    // 按顺序登记一组键, 返回shape编号
+    uint32_t add_shape(const std::pair<const char *, size_t> *names, size_t count)
+    {
+        std::string signature;
+        std::map<std::string, uint32_t>::iterator it;
+        FlatShape shape;
+        FlatKey key;
+        size_t i;
+        uint32_t size;
+
+        for (i = 0; i < count; i++)
+        {
+            size = (uint32_t)names[i].second;
+            signature.append((const char *)&size, sizeof(size));
+            signature.append(names[i].first, names[i].second);
+        }
+        it = shape_index.find(signature);
+        if (it != shape_index.end())
+        {
+            return it->second;
+        }
+
+        shape.first = (uint32_t)keys.size();
+        shape.count = (uint32_t)count;
+        for (i = 0; i < count; i++)
+        {
+            key.offset = arena.size();
+            key.size = (uint32_t)names[i].second;
+            arena.append(names[i].first, names[i].second);
+            keys.push_back(key);
+        }
+        shapes.push_back(shape);
+        shape_index[signature] = (uint32_t)(shapes.size() - 1);
+        return (uint32_t)(shapes.size() - 1);
+    }
+};
+
+inline bool double_is_int(double value)
+{
+    return std::isfinite(value) && std::trunc(value) == value;
+}
+
+// 把Python对象摊平, 规则和__pyobject_to_napi_value一致; 需要持有GIL
+// scratch->pyobjects: 已经摊平的容器 => 节点编号; scratch->names/items按栈使用, 用下标访问
+void __flatten_pyobject(FlatValue &flat, PyObject *object, ScratchLease &scratch, ConvertOptions &options, int depth)
+{
+    PyObject *key, *value, *pCopy, *pItem;
+    Py_ssize_t length, pos;
+    const char *data;
+    uint32_t index, found;
+    NativeKind kind;
+    napi_typedarray_type type;
+    std::string text;
+    RecordType *record;
+    size_t field, base, i, count;
+    bool map;
+
+    if (object == NULL || object == Py_None)
+    {
+        flat.push(FLAT_NULL, 0);
+    }
+    else if (PyBool_Check(object))
+    {
+        flat.push_number(FLAT_BOOL, object == Py_True ? 1 : 0);
+    }
+    else if (PyLong_Check(object) && !pylong_is_safe(object) && pyobject_to_string(object, text))
+    {
+        flat.push_bytes(FLAT_BIGINT, text.data(), text.size());
+    }
+    else if (PyLong_Check(object))
+    {
+        flat.push_number(FLAT_INT, PyLong_AsDouble(object));
+    }
+    else if (PyFloat_Check(object))
+    {
+        flat.push_number(FLAT_FLOAT, PyFloat_AsDouble(object));
+    }
+    else if (options.records && options.mode != CONVERT_HANDLE && (record = find_record_type(object)) != NULL)
+    {
+        if (scratch->pyobjects.find(object, found))
+        {
+            flat.push(FLAT_REF, found);
+            return;
+        }
+        if (!record_should_expand(record, options, depth))
+        {
+            Py_INCREF(object);
+            flat.push_handle(object);
+            return;
+        }
+        // 同一个类型的对象字段相同, 共用一个shape
+        base = scratch->items.size();
+        for (field = 0; field < record->names.size(); field++)
+        {
+            value = record_field(object, record, field);
+            if (value != NULL)
+            {
+                data = PyUnicode_AsUTF8AndSize(record->names[field], &length);
+                scratch->names.push_back(std::make_pair(data, (size_t)length));
+                scratch->items.push_back(value);
+            }
+        }
+        count = scratch->items.size() - base;
+        index = flat.push(FLAT_OBJECT, (uint32_t)count);
+        flat.nodes[index].shape = flat.add_shape(count == 0 ? NULL : &scratch->names[base], count);
+        scratch->names.resize(base);
+        scratch->pyobjects.insert(object, index);
+        for (i = 0; i < count; i++)
+        {
+            __flatten_pyobject(flat, scratch->items[base + i], scratch, options, depth + 1);
+            Py_DECREF(scratch->items[base + i]);
+        }
+        scratch->items.resize(base);
+    }
+    else if ((PyUnicode_Check(object) || PyBytes_Check(object) || PyTuple_Check(object) ||
+              PyList_Check(object) || PyDict_Check(object) || PySet_Check(object)) &&
+             !convert_should_expand(object, options, depth))
+    {
+        Py_INCREF(object);
+        flat.push_handle(object);
+    }
+    else if (PyUnicode_Check(object))
+    {
+        data = PyUnicode_AsUTF8AndSize(object, &length);
+        if (data == NULL)
+        {
+            // 带surrogate之类没法转utf8的字符串, 留在Python里
+            PyErr_Clear();
+            Py_INCREF(object);
+            flat.push_handle(object);
+        }
+        else
+        {
+            flat.push_bytes(FLAT_STRING, data, (size_t)length);
+        }
+    }
+    else if (PyBytes_Check(object))
+    {
+        flat.push_bytes(FLAT_BUFFER, PyBytes_AS_STRING(object), (size_t)PyBytes_GET_SIZE(object));
+    }
+    else if ((PyTuple_Check(object) || PyList_Check(object) || PyDict_Check(object) || PySet_Check(object)) &&
+             scratch->pyobjects.find(object, found))
+    {
+        // 第二次遇到的容器, 记一个引用, 展开就死循环了
+        flat.push(FLAT_REF, found);
+    }
+    else if (PyTuple_Check(object))
+    {
+        // tuple不可变, 自己拿着元素的引用
+        length = PyTuple_GET_SIZE(object);
+        scratch->pyobjects.insert(object, flat.push(FLAT_ARRAY, (uint32_t)length));
+        for (i = 0; i < (size_t)length; i++)
+        {
+            __flatten_pyobject(flat, PyTuple_GET_ITEM(object, i), scratch, options, depth + 1);
+        }
+    }
+    else if (PyList_Check(object))
+    {
+        // 先把元素拿住再展开, 展开过程中执行的Python代码(比如records的property)或者别的线程有可能改动list,
+        // 节点的元素个数和实际摊平的个数要一致
+        base = scratch->items.size();
+        for (i = 0; i < (size_t)PyList_GET_SIZE(object); i++)
+        {
+            pItem = PyList_GET_ITEM(object, i);
+            Py_INCREF(pItem);
+            scratch->items.push_back(pItem);
+        }
+        count = scratch->items.size() - base;
+        scratch->pyobjects.insert(object, flat.push(FLAT_ARRAY, (uint32_t)count));
+        for (i = 0; i < count; i++)
+        {
+            __flatten_pyobject(flat, scratch->items[base + i], scratch, options, depth + 1);
+            Py_DECREF(scratch->items[base + i]);
+        }
+        scratch->items.resize(base);
+    }
+    else if (PyDict_Check(object))
+    {
+        base = scratch->items.size();
+        pos = 0;
+        map = false;
+        while (PyDict_Next(object, &pos, &key, &value))
+        {
+            if (!PyUnicode_Check(key))
+            {
+                // key不全是str的dict => Map, 不用先把整个dict扫一遍
+                map = true;
+                break;
+            }
+            data = PyUnicode_AsUTF8AndSize(key, &length);
+            if (data == NULL)
+            {
+                // 带surrogate之类没法转utf8的key, 留在Python里
+                PyErr_Clear();
+                for (i = base; i < scratch->items.size(); i++)
+                    Py_DECREF(scratch->items[i]);
+                scratch->names.resize(base);
+                scratch->items.resize(base);
+                Py_INCREF(object);
+                flat.push_handle(object);
+                return;
+            }
+            // 展开过程中value有可能被别的代码从dict里拿掉, 先拿住
+            Py_INCREF(value);
+            scratch->names.push_back(std::make_pair(data, (size_t)length));
+            scratch->items.push_back(value);
+        }
+        if (map)
+        {
+            // 还没有展开任何东西, 攒下的值放掉, 从头按Map摊平
+            for (i = base; i < scratch->items.size(); i++)
+                Py_DECREF(scratch->items[i]);
+            scratch->names.resize(base);
+            scratch->items.resize(base);
+            // 先把key/value拿住再展开, 展开过程中执行的Python代码有可能改动dict
+            pos = 0;
+            while (PyDict_Next(object, &pos, &key, &value))
+            {
+                Py_INCREF(key);
+                Py_INCREF(value);
+                scratch->items.push_back(key);
+                scratch->items.push_back(value);
+            }
+            count = scratch->items.size() - base;
+            scratch->pyobjects.insert(object, flat.push(FLAT_MAP, (uint32_t)(count / 2)));
+            for (i = 0; i < count; i++)
+            {
+                __flatten_pyobject(flat, scratch->items[base + i], scratch, options, depth + 1);
+                Py_DECREF(scratch->items[base + i]);
+            }
+            scratch->items.resize(base);
+            return;
+        }
+        count = scratch->items.size() - base;
+        index = flat.push(FLAT_OBJECT, (uint32_t)count);
+        flat.nodes[index].shape = flat.add_shape(count == 0 ? NULL : &scratch->names[base], count);
+        scratch->names.resize(base);
+        scratch->pyobjects.insert(object, index);
+        for (i = 0; i < count; i++)
+        {
+            __flatten_pyobject(flat, scratch->items[base + i], scratch, options, depth + 1);
+            Py_DECREF(scratch->items[base + i]);
+        }
+        scratch->items.resize(base);
+    }
+    else if (PySet_Check(object))
+    {
+        // 先拷贝成list再展开: 展开过程中set被改动的话迭代器会报错, 节点的元素个数也对不上
+        pCopy = PySequence_List(object);
+        if (pCopy == NULL)
+        {
+            // 拷贝失败, 留在Python里
+            PyErr_Clear();
+            Py_INCREF(object);
+            flat.push_handle(object);
+            return;
+        }
+        count = (size_t)PyList_GET_SIZE(pCopy);
+        scratch->pyobjects.insert(object, flat.push(FLAT_ARRAY, (uint32_t)count));
+        for (i = 0; i < count; i++)
+        {
+            // 拷贝出来的list只有这里用, 不会被改动
+            __flatten_pyobject(flat, PyList_GET_ITEM(pCopy, i), scratch, options, depth + 1);
+        }
+        Py_DECREF(pCopy);
+    }
+    else if (options.mode != CONVERT_HANDLE && (kind = pyobject_native_kind(object)) != NATIVE_NONE &&
+             (kind != NATIVE_ARRAY || pyarray_to_bytes(object, type, text)))
+    {
+        if (kind == NATIVE_DATETIME)
+        {
+            flat.push_number(FLAT_DATE, pydatetime_to_ms(object));
+        }
+        else if (kind == NATIVE_DECIMAL && pyobject_to_string(object, text))
+        {
+            flat.push_bytes(FLAT_STRING, text.data(), text.size());
+        }
+        else if (kind == NATIVE_ARRAY)
+        {
+            flat.push_bytes(FLAT_TYPED, text.data(), text.size());
+            flat.nodes.back().kind = (uint8_t)type;
+        }
+        else
+        {
+            Py_INCREF(object);
+            flat.push_handle(object);
+        }
+    }
+    else
+    {
+        // 找不到任何序列化方式了，只好存个指针
+        Py_INCREF(object);
+        flat.push_handle(object);
+    }
+}
+
+void flatten_pyobject(FlatValue &flat, PyObject *object, const ConvertOptions &options)
+{
+    ScratchLease scratch;
+    ConvertOptions budget = options;
+    __flatten_pyobject(flat, object, scratch, budget, 0);
+}
+
+// 结果里的PyWrapper在生成JS值以后就用不着了, 需要持有GIL
+void release_flat_handles(FlatValue &flat)
+{
+    size_t i;
+    for (i = 0; i < flat.nodes.size() && flat.handles > 0; i++)
+    {
+        if (flat.nodes[i].tag == FLAT_HANDLE)
+        {
+            Py_DECREF(flat.nodes[i].object);
+            flat.handles--;
+        }
+    }
+}
+
+// 参数里借来的PyWrapper, 用完以后归还, 需要持有GIL
+// 放掉FlatValue对JS函数的那一份引用, 不需要GIL
+void release_flat_functions(FlatValue &flat)
+{
+    size_t i;
+    for (i = 0; i < flat.nodes.size() && flat.functions > 0; i++)
+    {
+        if (flat.nodes[i].tag == FLAT_FUNCTION)
+        {
+            if (flat.nodes[i].callable != NULL)
+                release_js_callable(flat.nodes[i].callable);
+            flat.functions--;
+        }
+    }
+}
+
+// JS函数也在这里放掉FlatValue自己的那一份引用
+void unpin_flat_handles(FlatValue &flat)
+{
+    size_t i;
+    for (i = 0; i < flat.nodes.size() && flat.handles + flat.functions > 0; i++)
+    {
+        if (flat.nodes[i].tag == FLAT_HANDLE)
+        {
+            unpin_pyobject(flat.nodes[i].object);
+            flat.handles--;
+        }
+        else if (flat.nodes[i].tag == FLAT_FUNCTION)
+        {
+            if (flat.nodes[i].callable != NULL)
+                release_js_callable(flat.nodes[i].callable);
+            flat.functions--;
+        }
+    }
+}
+
+// 从FlatValue生成JS值, 只有遇到FLAT_HANDLE才会碰Python
+// scratch->built: 节点编号 => 生成的容器, scratch->keys: shape的键只创建一次
+Napi::Value __flat_to_napi_value(const Napi::Env &env, FlatValue &flat, size_t &index, ScratchLease &scratch,
+                                 PyThreadState *state)
+{
+    FlatNode &node = flat.nodes[index];
+    FlatShape shape;
+    Napi::Array arr;
+    Napi::Object obj;
+    Napi::Function setter;
+    Napi::Value key, item;
+    napi_property_descriptor *prop;
+    size_t self = index++, base;
+    uint32_t i;
+
+    switch (node.tag)
+    {
+    case FLAT_NULL:
+        return env.Null();
+    case FLAT_BOOL:
+        return Napi::Boolean::New(env, node.number != 0);
+    case FLAT_INT:
+    case FLAT_FLOAT:
+        return Napi::Number::New(env, node.number);
+    case FLAT_STRING:
+        return Napi::String::New(env, flat.arena.data() + node.offset, node.size);
+    case FLAT_BUFFER:
+        return Napi::Buffer<char>::Copy(env, flat.arena.data() + node.offset, node.size);
+    case FLAT_REF:
+        return Napi::Value(env, scratch->built[node.size]);
+    case FLAT_HANDLE:
+        return serialize_pyobject(env, node.object, state);
+    case FLAT_FUNCTION:
+        return js_callable_value(node.callable);
+    case FLAT_DATE:
+        return Napi::Date::New(env, node.number);
+    case FLAT_BIGINT:
+        return new_napi_bigint(env, std::string(flat.arena.data() + node.offset, node.size));
+    case FLAT_TYPED:
+        return new_typed_array(env, (napi_typedarray_type)node.kind, flat.arena.data() + node.offset, node.size);
+    case FLAT_MAP:
+        obj = napi_global_function(env, "Map").New({});
+        scratch->built[self] = obj;
+        setter = obj.Get("set").As<Napi::Function>();
+        for (i = 0; i < node.size; i++)
+        {
+            key = __flat_to_napi_value(env, flat, index, scratch, state);
+            item = __flat_to_napi_value(env, flat, index, scratch, state);
+            setter.Call(obj, {key, item});
+        }
+        return obj;
+    case FLAT_SET:
+        obj = napi_global_function(env, "Set").New({});
+        scratch->built[self] = obj;
+        setter = obj.Get("add").As<Napi::Function>();
+        for (i = 0; i < node.size; i++)
+        {
+            setter.Call(obj, {__flat_to_napi_value(env, flat, index, scratch, state)});
+        }
+        return obj;
+    case FLAT_ARRAY:
+        arr = Napi::Array::New(env, node.size);
+        scratch->built[self] = arr;
+        for (i = 0; i < node.size; i++)
+        {
+            arr.Set(i, __flat_to_napi_value(env, flat, index, scratch, state));
+        }
+        return arr;
+    default:
+        obj = Napi::Object::New(env);
+        scratch->built[self] = obj;
+        shape = flat.shapes[node.shape];
+        // props按栈使用, 子对象会在后面压入自己的属性, 所以只能用下标访问
+        base = scratch->props.size();
+        scratch->props.resize(base + shape.count);
+        for (i = 0; i < shape.count; i++)
+        {
+            if (scratch->keys[shape.first + i] == NULL)
+            {
+                // 同一个shape的键只创建一次
+                scratch->keys[shape.first + i] = Napi::String::New(
+                    env, flat.arena.data() + flat.keys[shape.first + i].offset, flat.keys[shape.first + i].size);
+            }
+            item = __flat_to_napi_value(env, flat, index, scratch, state);
+            prop = &scratch->props[base + i];
+            memset(prop, 0, sizeof(*prop));
+            prop->name = scratch->keys[shape.first + i];
+            prop->value = item;
+            prop->attributes = (napi_property_attributes)(napi_writable | napi_enumerable | napi_configurable);
+        }
+        // 属性一次定义好
+        napi_define_properties(env, obj, shape.count, shape.count == 0 ? NULL : &scratch->props[base]);
+        scratch->props.resize(base);
+        return obj;
+    }
+}
+
+// 在JS主线程上调用; 结果里有PyWrapper的时候才需要拿一下GIL
+Napi::Value flat_to_napi_value(const Napi::Env &env, FlatValue &flat, PyThreadState *state)
+{
+    ScratchLease scratch;
+    PyThreadState *previous;
+    Napi::Value result;
+    size_t index = 0;
+
+    if (flat.nodes.empty())
+    {
+        return env.Null();
+    }
+    if (flat.nodes.size() > 1)
+    {
+        // 只有一个节点的是标量, 不用借scratch
+        scratch->built.assign(flat.nodes.size(), NULL);
+        scratch->keys.assign(flat.keys.size(), NULL);
+    }
+    if (flat.handles == 0)
+    {
+        return __flat_to_napi_value(env, flat, index, scratch, state);
+    }
+
+    previous = EnterPython(state);
+    result = __flat_to_napi_value(env, flat, index, scratch, state);
+    release_flat_handles(flat);
+    LeavePython(previous);
+    return result;
+}
+
+// 把JS值摊平, 规则和__napi_value_to_pyobject一致, 不需要GIL
+// scratch->flat_ancestors是当前路径上的容器, 用来发现循环引用
+// pin为false的时候PyWrapper只记指针不借用, 这样的FlatValue只能看不能拿去转成Python对象
+void __flatten_napi_value(FlatValue &flat, const Napi::Env &env, const Napi::Value &value, ScratchLease &scratch,
+                          bool pin)
+{
+    std::vector<std::pair<const char *, size_t>> names;
+    std::vector<std::string> strings;
+    std::vector<Napi::Value> values;
+    Napi::Array arr, keys;
+    Napi::Object obj;
+    Napi::Buffer<char> buffer;
+    Napi::TypedArray typed;
+    PyObject *pObject;
+    std::string text;
+    const char *data;
+    size_t i, length;
+    uint32_t index;
+    double number;
+
+    if (value.IsBoolean())
+    {
+        flat.push_number(FLAT_BOOL, value.As<Napi::Boolean>().Value() ? 1 : 0);
+    }
+    else if (value.IsNull() || value.IsUndefined())
+    {
+        flat.push(FLAT_NULL, 0);
+    }
+    else if (value.IsNumber())
+    {
+        number = value.As<Napi::Number>().DoubleValue();
+        flat.push_number(double_is_int(number) ? FLAT_INT : FLAT_FLOAT, number);
+    }
+    else if (value.IsString())
+    {
+        // 直接写进arena, 省掉一次std::string的拷贝
+        napi_get_value_string_utf8(env, value, NULL, 0, &length);
+        index = flat.push(FLAT_STRING, (uint32_t)length);
+        flat.nodes[index].offset = flat.arena.size();
+        flat.arena.resize(flat.arena.size() + length + 1);
+        napi_get_value_string_utf8(env, value, &flat.arena[flat.nodes[index].offset], length + 1, &length);
+        flat.arena.resize(flat.arena.size() - 1);
+    }
+    else if (value.IsBuffer())
+    {
+        buffer = value.As<Napi::Buffer<char>>();
+        flat.push_bytes(FLAT_BUFFER, buffer.Data(), buffer.Length());
+    }
+    else if (value.IsFunction())
+    {
+        // ThreadSafeFunction只能在JS线程上创建, 所以在这里就准备好; 只看不用的FlatValue(比如算缓存的key)不创建
+        flat.nodes[flat.push(FLAT_FUNCTION, 0)].callable = pin ? new_js_callable(env, value.As<Napi::Function>()) : NULL;
+        flat.functions++;
+    }
+    else if (value.IsBigInt())
+    {
+        text = value.ToString().Utf8Value();
+        flat.push_bytes(FLAT_BIGINT, text.data(), text.size());
+    }
+    else if (value.IsDate())
+    {
+        flat.push_number(FLAT_DATE, value.As<Napi::Date>().ValueOf());
+    }
+    else if (value.IsTypedArray())
+    {
+        typed = value.As<Napi::TypedArray>();
+        flat.push_bytes(FLAT_TYPED, (const char *)typed.ArrayBuffer().Data() + typed.ByteOffset(), typed.ByteLength());
+        flat.nodes.back().kind = (uint8_t)typed.TypedArrayType();
+    }
+    else if (value.IsArrayBuffer() || value.IsDataView())
+    {
+        napi_buffer_view(value, data, length);
+        flat.push_bytes(FLAT_BUFFER, data, length);
+    }
+    else if (value.IsSymbol())
+    {
+        text = napi_symbol_string(env, value);
+        flat.push_bytes(FLAT_STRING, text.data(), text.size());
+    }
+    else if (value.IsArray() || value.IsObject())
+    {
+        for (i = 0; i < scratch->flat_ancestors.size(); i++)
+        {
+            if (value.StrictEquals(Napi::Value(env, scratch->flat_ancestors[i].first)))
+            {
+                flat.push(FLAT_REF, scratch->flat_ancestors[i].second);
+                return;
+            }
+        }
+
+        if (value.IsArray())
+        {
+            arr = value.As<Napi::Array>();
+            index = flat.push(FLAT_ARRAY, arr.Length());
+            scratch->flat_ancestors.push_back(std::make_pair((napi_value)value, index));
+            for (i = 0; i < arr.Length(); i++)
+            {
+                __flatten_napi_value(flat, env, arr.Get((uint32_t)i), scratch, pin);
+            }
+            scratch->flat_ancestors.pop_back();
+            return;
+        }
+
+        obj = value.As<Napi::Object>();
+        if (is_pyobject(obj))
+        {
+            pObject = deserialize_pyobject(env, obj);
+            if (pObject == NULL)
+            {
+                text = "RuntimeError('object has been recycled')";
+                flat.push_bytes(FLAT_STRING, text.data(), text.size());
+            }
+            else
+            {
+                // 先借过来, worker线程里用完再还
+                if (pin)
+                    pin_pyobject(pObject);
+                flat.push_handle(pObject);
+            }
+            return;
+        }
+
+        if (napi_is_instance(env, obj, "Map") || napi_is_instance(env, obj, "Set"))
+        {
+            // Map的元素是[key, value], 摊平的时候key和value交替排列
+            arr = napi_collection_items(env, obj);
+            if (napi_is_instance(env, obj, "Map"))
+            {
+                index = flat.push(FLAT_MAP, arr.Length());
+                scratch->flat_ancestors.push_back(std::make_pair((napi_value)value, index));
+                for (i = 0; i < arr.Length(); i++)
+                {
+                    __flatten_napi_value(flat, env, arr.Get((uint32_t)i).As<Napi::Array>().Get((uint32_t)0), scratch, pin);
+                    __flatten_napi_value(flat, env, arr.Get((uint32_t)i).As<Napi::Array>().Get((uint32_t)1), scratch, pin);
+                }
+            }
+            else
+            {
+                index = flat.push(FLAT_SET, arr.Length());
+                scratch->flat_ancestors.push_back(std::make_pair((napi_value)value, index));
+                for (i = 0; i < arr.Length(); i++)
+                {
+                    __flatten_napi_value(flat, env, arr.Get((uint32_t)i), scratch, pin);
+                }
+            }
+            scratch->flat_ancestors.pop_back();
+            return;
+        }
+
+        keys = obj.GetPropertyNames();
+        for (i = 0; i < keys.Length(); i++)
+        {
+            if (obj.HasOwnProperty(keys.Get((uint32_t)i)))
+            {
+                strings.push_back(keys.Get((uint32_t)i).ToString().Utf8Value());
+                values.push_back(obj.Get(keys.Get((uint32_t)i)));
+            }
+        }
+        for (i = 0; i < strings.size(); i++)
+        {
+            names.push_back(std::make_pair(strings[i].data(), strings[i].size()));
+        }
+        index = flat.push(FLAT_OBJECT, (uint32_t)values.size());
+        flat.nodes[index].shape = flat.add_shape(names.empty() ? NULL : names.data(), names.size());
+        scratch->flat_ancestors.push_back(std::make_pair((napi_value)value, index));
+        for (i = 0; i < values.size(); i++)
+        {
+            __flatten_napi_value(flat, env, values[i], scratch, pin);
+        }
+        scratch->flat_ancestors.pop_back();
+    }
+    else
+    {
+        // 不支持转换的类型, 同__napi_value_to_pyobject
+        text = value.ToString().Utf8Value();
+        flat.push_bytes(FLAT_STRING, text.data(), text.size());
+    }
+}
+
+void flatten_napi_value(FlatValue &flat, const Napi::Env &env, const Napi::Value &value, bool pin = true)
+{
+    ScratchLease scratch;
+    __flatten_napi_value(flat, env, value, scratch, pin);
+}
+
+// 从FlatValue生成Python对象, 需要持有GIL
+// scratch->objects: 节点编号 => 生成的容器, 是借用的引用
+PyObject *__flat_to_pyobject(FlatValue &flat, size_t &index, ScratchLease &scratch)
+{
+    FlatNode &node = flat.nodes[index];
+    FlatShape shape;
+    PyObject *pResult, *pKey, *pItem;
+    size_t self = index++;
+    uint32_t i;
+
+    switch (node.tag)
+    {
+    case FLAT_NULL:
+        Py_INCREF(Py_None);
+        return Py_None;
+    case FLAT_BOOL:
+        return PyBool_FromLong(node.number != 0);
+    case FLAT_INT:
+        return PyLong_FromDouble(node.number);
+    case FLAT_FLOAT:
+        return PyFloat_FromDouble(node.number);
+    case FLAT_STRING:
+        return PyUnicode_FromStringAndSize(flat.arena.data() + node.offset, node.size);
+    case FLAT_BUFFER:
+        return PyBytes_FromStringAndSize(flat.arena.data() + node.offset, node.size);
+    case FLAT_REF:
+        Py_XINCREF(scratch->objects[node.size]);
+        return scratch->objects[node.size];
+    case FLAT_HANDLE:
+        Py_INCREF(node.object);
+        return node.object;
+    case FLAT_FUNCTION:
+        return js_callable_to_pyobject(node.callable);
+    case FLAT_DATE:
+        return pydatetime_from_ms(node.number);
+    case FLAT_BIGINT:
+        return PyLong_FromString(std::string(flat.arena.data() + node.offset, node.size).c_str(), NULL, 10);
+    case FLAT_TYPED:
+        return new_pyarray(typed_array_pycode((napi_typedarray_type)node.kind), flat.arena.data() + node.offset,
+                           node.size);
+    case FLAT_MAP:
+        // 不能hash的key跳过
+        pResult = PyDict_New();
+        scratch->objects[self] = pResult;
+        for (i = 0; i < node.size; i++)
+        {
+            pKey = __flat_to_pyobject(flat, index, scratch);
+            pItem = __flat_to_pyobject(flat, index, scratch);
+            if (pKey != NULL && pItem != NULL)
+            {
+                PyDict_SetItem(pResult, pKey, pItem);
+            }
+            PyErr_Clear();
+            Py_XDECREF(pKey);
+            Py_XDECREF(pItem);
+        }
+        return pResult;
+    case FLAT_SET:
+        // 先攒成list, 元素不能hash的话就用这个list
+        pKey = PyList_New(node.size);
+        for (i = 0; i < node.size; i++)
+        {
+            pItem = __flat_to_pyobject(flat, index, scratch);
+            if (pItem == NULL)
+            {
+                PyErr_Clear();
+                Py_INCREF(Py_None);
+                pItem = Py_None;
+            }
+            PyList_SET_ITEM(pKey, i, pItem);
+        }
+        pResult = PySet_New(pKey);
+        if (pResult == NULL)
+        {
+            PyErr_Clear();
+            return pKey;
+        }
+        Py_DECREF(pKey);
+        return pResult;
+    case FLAT_ARRAY:
+        pResult = PyList_New(node.size);
+        scratch->objects[self] = pResult;
+        for (i = 0; i < node.size; i++)
+        {
+            pItem = __flat_to_pyobject(flat, index, scratch);
+            if (pItem == NULL)
+            {
+                PyErr_Clear();
+                Py_INCREF(Py_None);
+                pItem = Py_None;
+            }
+            PyList_SET_ITEM(pResult, i, pItem);
+        }
+        return pResult;
+    default:
+        pResult = PyDict_New();
+        scratch->objects[self] = pResult;
+        shape = flat.shapes[node.shape];
+        for (i = 0; i < shape.count; i++)
+        {
+            pKey = PyUnicode_FromStringAndSize(flat.arena.data() + flat.keys[shape.first + i].offset,
+                                               flat.keys[shape.first + i].size);
+            pItem = __flat_to_pyobject(flat, index, scratch);
+            if (pKey != NULL && pItem != NULL)
+            {
+                PyDict_SetItem(pResult, pKey, pItem);
+            }
+            PyErr_Clear();
+            Py_XDECREF(pKey);
+            Py_XDECREF(pItem);
+        }
+        return pResult;
+    }
+}
+
+PyObject *flat_to_pyobject(FlatValue &flat)
+{
+    ScratchLease scratch;
+    size_t index = 0;
+    if (flat.nodes.empty())
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (flat.nodes.size() > 1)
+    {
+        scratch->objects.assign(flat.nodes.size(), NULL);
+    }
+    return __flat_to_pyobject(flat, index, scratch);
+}
+
+// 摊平的args数组 => tuple, 摊平的kwargs对象 => dict
+PyObject *flat_to_pyargs(FlatValue &flat)
+{
+    PyObject *pList, *pTuple;
+    if (flat.nodes.empty() || flat.nodes[0].tag != FLAT_ARRAY)
+    {
+        return PyTuple_New(0);
+    }
+    pList = flat_to_pyobject(flat);
+    pTuple = PyList_AsTuple(pList);
+    Py_DECREF(pList);
+    return pTuple;
+}
+
+PyObject *flat_to_pykwargs(FlatValue &flat)
+{
+    if (flat.nodes.empty() || flat.nodes[0].tag != FLAT_OBJECT)
+    {
+        return PyDict_New();
+    }
+    return flat_to_pyobject(flat);
+}
+
+/* 从Python里调用JS函数
+JS函数传给Python以后变成一个callable, 背后是JsCallable:
+在JS线程上(同步调用的过程中)被调用的时候直接调用JS函数, 参数和返回值当场转换;
+在worker线程上被调用的时候, 参数摊平以后放进events, 直接返回None, 攒下来的events由ThreadSafeFunction
+一次性送到JS线程上挨个回调, 这样进度/日志之类的事件不会每个都切一次线程;
+events满了的时候worker线程放开GIL等着JS线程消化; 排队的调用在JS里抛的错误记下来, 下一次在Python里调用的时候抛出来
+JsCallable用refs计数, Python对象、参数里的FlatValue和送往JS线程的路上各持有一份, 全部放掉以后Release掉ThreadSafeFunction,
+由ThreadSafeFunction的finalizer(JS线程上)删除; JS环境先销毁(比如worker_threads退出)的话, finalizer只标记dead,
+等最后一份引用放掉的时候再删, 这之后Python里再调用会抛RuntimeError
+*/
+struct JsEvent
+{
+    FlatValue args;
+    PyThreadState *state; // 参数里有PyWrapper的时候要用到
+};
+
+struct JsCallable
+{
+    Napi::FunctionReference function; // 只能在JS线程上用
+    Napi::ThreadSafeFunction tsfn;
+    napi_env env;
+    std::thread::id js_thread;
+    std::atomic<int> refs;
+    std::mutex mutex; // 保护events, scheduled, dead, error和refs归零的判断, 持有mutex的时候不能去拿GIL
+    std::condition_variable drained;
+    std::vector<JsEvent> events;
+    bool scheduled;    // 是否已经有一次送往JS线程的调用在路上了
+    bool dead;         // ThreadSafeFunction已经finalize了, 不能再往JS线程送
+    std::string error; // 排队的调用在JS里抛出的第一个错误
+};
+
+size_t js_event_queue_max = 1024; // 每个JS函数最多攒多少个没送到的events
+
+// context的解释器 => context的PyThreadState, worker线程上调用JS函数的时候用来找到context
+std::map<PyInterpreterState *, PyThreadState *> pycontext_states;
+
+// 当前线程所在的context, 主解释器返回NULL; 需要持有GIL
+PyThreadState *current_pycontext()
+{
+    std::map<PyInterpreterState *, PyThreadState *>::iterator it;
+    PyThreadState *state = NULL;
+    smutex.lock();
+    it = pycontext_states.find(PyThreadState_Get()->interp);
+    if (it != pycontext_states.end())
+        state = it->second;
+    smutex.unlock();
+    return state;
+}
+
+JsCallable *new_js_callable(const Napi::Env &env, const Napi::Function &function)
+{
+    JsCallable *callable = new JsCallable();
+    callable->function = Napi::Persistent(function);
+    callable->env = env;
+    callable->js_thread = std::this_thread::get_id();
+    callable->refs = 1;
+    callable->scheduled = false;
+    callable->dead = false;
+    callable->tsfn = Napi::ThreadSafeFunction::New(
+        env, function, "python-ts/JsCallable", 0, 1, callable,
+        [](Napi::Env, JsCallable *callable) {
+            bool last;
+            callable->mutex.lock();
+            callable->dead = true;
+            callable->function.Reset();
+            last = callable->refs == 0;
+            callable->mutex.unlock();
+            // 等着队列空出来的worker线程不会再等到了
+            callable->drained.notify_all();
+            if (last)
+            {
+                delete callable;
+            }
+        });
+    // 不要因为Python手里还攥着JS函数就让进程退不出去
+    callable->tsfn.Unref(env);
+    return callable;
+}
+
+void release_js_callable(JsCallable *callable)
+{
+    bool last, dead;
+    callable->mutex.lock();
+    last = --callable->refs == 0;
+    dead = callable->dead;
+    if (last && !dead)
+    {
+        // finalizer会删掉它
+        callable->tsfn.Release();
+    }
+    callable->mutex.unlock();
+    if (last && dead)
+    {
+        delete callable;
+    }
+}
+
+Napi::Value js_callable_value(JsCallable *callable)
+{
+    return callable->function.Value();
+}
+
+void js_capsule_destructor(PyObject *capsule)
+{
+    release_js_callable((JsCallable *)PyCapsule_GetPointer(capsule, "python_ts.JsCallable"));
+}
+
+// 在JS线程上把攒下来的events一次送完, 由ThreadSafeFunction调用, 这时候没有持有GIL
+// JS函数抛的错误不能再往外抛, 那样就成了uncaught exception; 记下第一个, 交给Python那边
+void drain_js_callable(Napi::Env env, JsCallable *callable)
+{
+    std::vector<JsEvent> batch;
+    std::vector<napi_value> argv;
+    Napi::Value args;
+    Napi::Array arr;
+    std::string error;
+    size_t i;
+    uint32_t j;
+
+    callable->mutex.lock();
+    batch.swap(callable->events);
+    callable->scheduled = false;
+    callable->mutex.unlock();
+    callable->drained.notify_all();
+
+    for (i = 0; i < batch.size(); i++)
+    {
+        Napi::HandleScope scope(env);
+        args = flat_to_napi_value(env, batch[i].args, batch[i].state);
+        arr = args.As<Napi::Array>();
+        argv.clear();
+        for (j = 0; j < arr.Length(); j++)
+        {
+            argv.push_back(arr.Get(j));
+        }
+        callable->function.Value().Call(argv);
+        if (env.IsExceptionPending())
+        {
+            // 一个回调出错不影响后面的events
+            if (error.empty())
+                error = env.GetAndClearPendingException().Message();
+            else
+                env.GetAndClearPendingException();
+        }
+    }
+    if (!error.empty())
+    {
+        callable->mutex.lock();
+        if (callable->error.empty())
+            callable->error = error;
+        callable->mutex.unlock();
+    }
+    release_js_callable(callable);
+}
+
+// 在JS线程上直接调用, 需要持有GIL
+// 调用期间按withGIL会话处理, JS函数里面再同步调用Python只需要切换PyThreadState
+PyObject *call_js_callable_sync(JsCallable *callable, PyObject *args, PyObject *kwargs)
+{
+    Napi::Env env(callable->env);
+    Napi::HandleScope scope(env);
+    PyThreadState *state = current_pycontext();
+    std::vector<napi_value> argv;
+    Napi::Value ret;
+    Py_ssize_t i;
+
+    for (i = 0; i < PyTuple_GET_SIZE(args); i++)
+    {
+        argv.push_back(pyobject_to_napi_value(env, PyTuple_GET_ITEM(args, i), state));
+    }
+    if (kwargs != NULL && PyDict_GET_SIZE(kwargs) > 0)
+    {
+        // kwargs作为最后一个参数传给JS
+        argv.push_back(pyobject_to_napi_value(env, kwargs, state));
+    }
+
+    gil_session++;
+    ret = callable->function.Value().Call(argv);
+    gil_session--;
+
+    if (env.IsExceptionPending())
+    {
+        PyErr_SetString(PyExc_RuntimeError,
+                        ("JS function threw: " + env.GetAndClearPendingException().Message()).c_str());
+        return NULL;
+    }
+    return napi_value_to_pyobject(env, ret);
+}
+
+// 丢掉没送出去的events, 抛RuntimeError, 需要持有GIL
+PyObject *fail_js_events(std::vector<JsEvent> &dropped, const std::string &message)
+{
+    size_t i;
+    for (i = 0; i < dropped.size(); i++)
+    {
+        release_flat_handles(dropped[i].args);
+    }
+    PyErr_SetString(PyExc_RuntimeError, message.c_str());
+    return NULL;
+}
+
+// 在worker线程上调用, 需要持有GIL; 参数摊平以后排队, 返回None
+// 之前排队的调用在JS里出错了的话, 这次不排队, 直接抛出那个错误
+PyObject *call_js_callable_async(JsCallable *callable, PyObject *args, PyObject *kwargs)
+{
+    JsEvent event;
+    PyObject *pList;
+    std::vector<JsEvent> dropped;
+    std::string error;
+    napi_status status = napi_ok;
+    bool schedule = false, queued = false, dead = false;
+
+    callable->mutex.lock();
+    error.swap(callable->error);
+    dead = callable->dead;
+    callable->mutex.unlock();
+    if (!error.empty())
+    {
+        PyErr_SetString(PyExc_RuntimeError, ("JS function threw: " + error).c_str());
+        return NULL;
+    }
+    if (dead)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "python-ts.JsCallable: the JS environment of this function is gone");
+        return NULL;
+    }
+
+    pList = PySequence_List(args);
+    if (pList == NULL)
+    {
+        return NULL;
+    }
+    if (kwargs != NULL && PyDict_GET_SIZE(kwargs) > 0)
+    {
+        PyList_Append(pList, kwargs);
+    }
+    flatten_pyobject(event.args, pList, DEFAULT_CONVERT);
+    Py_DECREF(pList);
+    event.state = current_pycontext();
+
+    // 队列没满的话直接放进去, 满了就放开GIL等JS线程消化; JS环境没了就不等了
+    callable->mutex.lock();
+    if (callable->events.size() < js_event_queue_max)
+    {
+        callable->events.push_back(std::move(event));
+        schedule = !callable->scheduled;
+        callable->scheduled = true;
+        queued = true;
+    }
+    callable->mutex.unlock();
+
+    if (!queued)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        std::unique_lock<std::mutex> lock(callable->mutex);
+        callable->drained.wait(lock, [callable] { return callable->dead || callable->events.size() < js_event_queue_max; });
+        dead = callable->dead;
+        if (!dead)
+        {
+            callable->events.push_back(std::move(event));
+            schedule = !callable->scheduled;
+            callable->scheduled = true;
+        }
+        Py_END_ALLOW_THREADS
+        if (dead)
+        {
+            dropped.push_back(std::move(event));
+            return fail_js_events(dropped, "python-ts.JsCallable: the JS environment of this function is gone");
+        }
+    }
+
+    if (schedule)
+    {
+        // 送到JS线程的路上也要保证JsCallable活着; 调用者手里还有一份, 这里不会归零
+        callable->refs++;
+        callable->mutex.lock();
+        status = callable->dead ? napi_closing : callable->tsfn.NonBlockingCall([callable](Napi::Env env, Napi::Function) {
+            drain_js_callable(env, callable);
+        });
+        if (status != napi_ok)
+        {
+            // 没送出去, 排着的events永远等不到了
+            callable->scheduled = false;
+            dropped.swap(callable->events);
+        }
+        callable->mutex.unlock();
+        if (status != napi_ok)
+        {
+            callable->refs--;
+            callable->drained.notify_all();
+            return fail_js_events(dropped, "python-ts.JsCallable: the JS thread is no longer accepting calls");
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *call_js_callable(PyObject *capsule, PyObject *args, PyObject *kwargs)
+{
+    JsCallable *callable = (JsCallable *)PyCapsule_GetPointer(capsule, "python_ts.JsCallable");
+    bool dead;
+    if (callable == NULL)
+    {
+        return NULL;
+    }
+    callable->mutex.lock();
+    dead = callable->dead;
+    callable->mutex.unlock();
+    if (dead)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "python-ts.JsCallable: the JS environment of this function is gone");
+        return NULL;
+    }
+    if (std::this_thread::get_id() == callable->js_thread)
+    {
+        return call_js_callable_sync(callable, args, kwargs);
+    }
+    return call_js_callable_async(callable, args, kwargs);
+}
+
+PyMethodDef js_callable_def = {
+    "js_function", (PyCFunction)(void (*)(void))call_js_callable, METH_VARARGS | METH_KEYWORDS,
+    "A JavaScript function. Called from a worker thread it queues the call and returns None."};
+
+// 需要持有GIL, 返回新的引用
+PyObject *js_callable_to_pyobject(JsCallable *callable)
+{
+    PyObject *capsule, *function;
+    capsule = PyCapsule_New(callable, "python_ts.JsCallable", js_capsule_destructor);
+    if (capsule == NULL)
+    {
+        return NULL;
+    }
+    callable->refs++;
+    function = PyCFunction_New(&js_callable_def, capsule);
+    Py_DECREF(capsule);
+    return function;
+}
+
+/* 纯函数调用的结果缓存
+按(object, attr)开启, key是摊平以后的args/kwargs加上转换选项, value是摊平的结果
+只缓存没有PyWrapper的参数和结果, 所以命中的时候完全不用碰Python, 也不用拿GIL
+一个缓存只在它的object所在context的JS线程上用; pycaches本身是各个JS线程共享的, 增删查要拿pycache_mutex
+*/
+struct PyCacheEntry
+{
+    FlatValue value;
+    size_t bytes;
+    std::chrono::steady_clock::time_point expires;
+    std::list<std::string>::iterator lru;
+};
+
+struct PyCache
+{
+    PyThreadState *state; // object所在的context, 删除context的时候一起清掉
+    double ttl_ms;        // 0表示不过期
+    size_t max_entries, max_bytes, bytes;
+    std::map<std::string, PyCacheEntry> entries;
+    std::list<std::string> lru; // 最近用过的在前面
+    double hits, misses, evictions;
+};
+
+typedef std::pair<PyObject *, std::string> PyCacheId;
+
+// 开了缓存的object都多持有一个引用, 保证指针不会被别的对象复用
+std::map<PyCacheId, PyCache> pycaches;
+std::mutex pycache_mutex;
+std::atomic<size_t> pycache_count(0); // 没有开缓存的时候不用拿锁
+
+PyCache *find_pycache(PyObject *object, const std::string &attr)
+{
+    std::map<PyCacheId, PyCache>::iterator it;
+    PyCache *cache;
+    if (pycache_count == 0)
+    {
+        return NULL;
+    }
+    pycache_mutex.lock();
+    it = pycaches.find(std::make_pair(object, attr));
+    cache = it == pycaches.end() ? NULL : &it->second;
+    pycache_mutex.unlock();
+    return cache;
+}
+
+size_t flat_value_bytes(const FlatValue &flat)
+{
+    return flat.nodes.size() * sizeof(FlatNode) + flat.arena.size() +
+           flat.keys.size() * sizeof(FlatKey) + flat.shapes.size() * sizeof(FlatShape);
+}
+
+// 把FlatValue逐个字段写进key, 不能直接拷贝结构体, 对齐用的padding没有初始化
+void append_flat_key(std::string &key, const FlatValue &flat)
+{
+    size_t i, count = flat.nodes.size();
+    key.append((const char *)&count, sizeof(count));
+    for (i = 0; i < flat.nodes.size(); i++)
+    {
+        key.push_back((char)flat.nodes[i].tag);
+        key.push_back((char)flat.nodes[i].kind);
+        key.append((const char *)&flat.nodes[i].size, sizeof(uint32_t));
+        key.append((const char *)&flat.nodes[i].number, sizeof(double));
+    }
+    for (i = 0; i < flat.shapes.size(); i++)
+    {
+        key.append((const char *)&flat.shapes[i].first, sizeof(uint32_t));
+        key.append((const char *)&flat.shapes[i].count, sizeof(uint32_t));
+    }
+    count = flat.arena.size();
+    key.append((const char *)&count, sizeof(count));
+    key.append(flat.arena);
+}
+
+// 转换选项不同结果也不同, 一起放进key
+std::string make_cache_key(const FlatValue &args, const FlatValue &kwargs, const ConvertOptions &options)
+{
+    std::string key;
+    key.push_back((char)options.mode);
+    key.append((const char *)&options.max_items, sizeof(size_t));
+    key.append((const char *)&options.max_bytes, sizeof(size_t));
+    key.push_back((char)options.records);
+    append_flat_key(key, args);
+    append_flat_key(key, kwargs);
+    return key;
+}
+
+// 命中返回缓存的结果, 过期的顺手删掉
+FlatValue *pycache_get(PyCache &cache, const std::string &key)
+{
+    std::map<std::string, PyCacheEntry>::iterator it = cache.entries.find(key);
+    if (it != cache.entries.end() && cache.ttl_ms > 0 && std::chrono::steady_clock::now() >= it->second.expires)
+    {
+        cache.bytes -= it->second.bytes;
+        cache.lru.erase(it->second.lru);
+        cache.entries.erase(it);
+        it = cache.entries.end();
+    }
+    if (it == cache.entries.end())
+    {
+        cache.misses++;
+        return NULL;
+    }
+    cache.hits++;
+    cache.lru.splice(cache.lru.begin(), cache.lru, it->second.lru);
+    return &it->second.value;
+}
+
+// 有PyWrapper的结果不缓存; 超出max_entries/max_bytes的时候从最久没用过的开始淘汰
+void pycache_put(PyCache &cache, const std::string &key, const FlatValue &value)
+{
+    std::map<std::string, PyCacheEntry>::iterator it;
+    PyCacheEntry *entry;
+    size_t bytes = flat_value_bytes(value) + key.size();
+
+    if (value.handles > 0 || (cache.max_bytes > 0 && bytes > cache.max_bytes))
+    {
+        return;
+    }
+    it = cache.entries.find(key);
+    if (it != cache.entries.end())
+    {
+        cache.bytes -= it->second.bytes;
+        cache.lru.erase(it->second.lru);
+        cache.entries.erase(it);
+    }
+    while (!cache.lru.empty() && ((cache.max_entries > 0 && cache.entries.size() >= cache.max_entries) ||
+                                  (cache.max_bytes > 0 && cache.bytes + bytes > cache.max_bytes)))
+    {
+        it = cache.entries.find(cache.lru.back());
+        cache.bytes -= it->second.bytes;
+        cache.entries.erase(it);
+        cache.lru.pop_back();
+        cache.evictions++;
+    }
+    entry = &cache.entries[key];
+    entry->value = value;
+    entry->value.shape_index.clear();
+    entry->bytes = bytes;
+    entry->expires = std::chrono::steady_clock::now() +
+                     std::chrono::microseconds((int64_t)(cache.ttl_ms * 1000));
+    cache.lru.push_front(key);
+    entry->lru = cache.lru.begin();
+    cache.bytes += bytes;
+}
+
+/* 删除缓存
+state为NULL并且release为false: Python已经销毁了, 全部丢掉
+否则只删除属于state这个context的缓存, release为true的时候顺便Py_DECREF, 需要持有那个context的GIL
+*/
+void drop_pycaches(PyThreadState *state, bool release)
+{
+    std::map<PyCacheId, PyCache>::iterator it;
+    std::vector<PyObject *> objects;
+    size_t i;
+
+    pycache_mutex.lock();
+    it = pycaches.begin();
+    while (it != pycaches.end())
+    {
+        if ((state == NULL && !release) || it->second.state == state)
+        {
+            if (release)
+                objects.push_back(it->first.first);
+            it = pycaches.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+    pycache_count = pycaches.size();
+    pycache_mutex.unlock();
+
+    // __del__里可能又会用到缓存, 放开锁以后再Py_DECREF
+    for (i = 0; i < objects.size(); i++)
+        Py_DECREF(objects[i]);
+}
+
+// _pipeline的一步操作, 中间结果一直留在Python里, 不做任何转换
+enum PyStepOp
+{
+    STEP_GET,   // ['get', attr]                  => current = current.attr
+    STEP_ITEM,  // ['item', key]                  => current = current[key]
+    STEP_CALL,  // ['call', attr, args?, kwargs?] => current = current.attr(*args, **kwargs)
+    STEP_INVOKE // ['invoke', args?, kwargs?]     => current = current(*args, **kwargs)
+};
+
+struct PyStep
+{
+    PyStepOp op;
+    PyObject *key, *args, *kwargs;
+};
+
+void free_pysteps(std::vector<PyStep> &steps)
+{
+    size_t i;
+    for (i = 0; i < steps.size(); i++)
+    {
+        Py_XDECREF(steps[i].key);
+        Py_XDECREF(steps[i].args);
+        Py_XDECREF(steps[i].kwargs);
+    }
+    steps.clear();
+}
+
+// 把JS描述的steps转成PyStep, 需要持有GIL; 失败的话抛JS错误并返回false
+bool parse_pysteps(Napi::Env &env, const Napi::Array &steps, std::vector<PyStep> &result)
+{
+    uint32_t i;
+    Napi::Array row;
+    Napi::Value item;
+    std::string op, prefix;
+    PyStep step;
+
+    for (i = 0; i < steps.Length(); i++)
+    {
+        prefix = "Step " + std::to_string(i) + ": ";
+        item = steps.Get(i);
+        if (!item.IsArray() || item.As<Napi::Array>().Length() < 1 || !item.As<Napi::Array>().Get(uint32_t(0)).IsString())
+        {
+            Napi::TypeError::New(env, prefix + "should be an Array like [op, ...]").ThrowAsJavaScriptException();
+            free_pysteps(result);
+            return false;
+        }
+        row = item.As<Napi::Array>();
+        op = row.Get(uint32_t(0)).As<Napi::String>().Utf8Value();
+        step.key = step.args = step.kwargs = NULL;
+
+        if (op == "get" || op == "call")
+        {
+            if (!row.Get(1).IsString())
+            {
+                Napi::TypeError::New(env, prefix + "`attr` should be a String").ThrowAsJavaScriptException();
+                free_pysteps(result);
+                return false;
+            }
+            step.op = op == "get" ? STEP_GET : STEP_CALL;
+            step.key = PyUnicode_FromString(row.Get(1).As<Napi::String>().Utf8Value().c_str());
+            if (step.op == STEP_CALL)
+            {
+                step.args = napi_args_to_pytuple(env, row.Get(2));
+                step.kwargs = napi_kwargs_to_pydict(env, row.Get(3));
+            }
+        }
+        else if (op == "item")
+        {
+            item = row.Get(1);
+            step.op = STEP_ITEM;
+            step.key = napi_value_to_pyobject(env, item);
+        }
+        else if (op == "invoke")
+        {
+            step.op = STEP_INVOKE;
+            step.args = napi_args_to_pytuple(env, row.Get(1));
+            step.kwargs = napi_kwargs_to_pydict(env, row.Get(2));
+        }
+        else
+        {
+            Napi::TypeError::New(env, prefix + "unknown op `" + op + "`, should be get/item/call/invoke")
+                .ThrowAsJavaScriptException();
+            free_pysteps(result);
+            return false;
+        }
+        result.push_back(step);
+        if ((step.op != STEP_INVOKE && step.key == NULL) ||
+            ((step.op == STEP_CALL || step.op == STEP_INVOKE) && (step.args == NULL || step.kwargs == NULL)))
+        {
+            throw_pyexception_in_javascript(env, (std::string("python-ts._pipeline failed to convert arguments of ") + prefix).c_str());
+            free_pysteps(result);
+            return false;
+        }
+    }
+    return true;
+}
+
+// 依次执行steps, 需要持有GIL; 返回新的引用, 出错返回NULL并保留Python的错误信息
+PyObject *run_pysteps(PyObject *object, std::vector<PyStep> &steps)
+{
+    size_t i;
+    PyObject *current = object, *next, *callable;
+
+    Py_INCREF(current);
+    for (i = 0; i < steps.size(); i++)
+    {
+        switch (steps[i].op)
+        {
+        case STEP_GET:
+            next = PyObject_GetAttr(current, steps[i].key);
+            break;
+        case STEP_ITEM:
+            next = PyObject_GetItem(current, steps[i].key);
+            break;
+        case STEP_CALL:
+            callable = PyObject_GetAttr(current, steps[i].key);
+            next = callable == NULL ? NULL : PyObject_Call(callable, steps[i].args, steps[i].kwargs);
+            Py_XDECREF(callable);
+            break;
+        default:
+            next = PyObject_Call(current, steps[i].args, steps[i].kwargs);
+        }
+        Py_DECREF(current);
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        current = next;
+    }
+    return current;
+}
+
+/* 异步调用的调度
+每个context一个PyScheduler, 限制同时在worker线程上跑的调用个数, 排队的调用按优先级分成三条lane,
+有空位的时候先放interactive, 再normal, 最后background; 同一条lane里先进先出
+max_concurrency/max_queue为0表示不限制, 默认都不限制, 这时候行为跟直接Queue()一样
+所有函数都只在JS主线程上调用, 不需要加锁
+*/
+enum PyLane
+{
+    LANE_INTERACTIVE,
+    LANE_NORMAL,
+    LANE_BACKGROUND,
+    LANE_COUNT
+};
+
+const char *LANE_NAMES[LANE_COUNT] = {"interactive", "normal", "background"};
+
+struct PyLaneStats
+{
+    double submitted, rejected, completed, cancelled;
+    double wait_ms, wait_max_ms; // 从提交到开始执行, 包括在lane里和libuv队列里的时间
+    double exec_ms, exec_max_ms; // 在worker线程上执行的时间, 包括等GIL
+};
+
+class PyScheduledWorker;
+struct PyMetrics;
+
+struct PyScheduler
+{
+    size_t max_concurrency, max_queue;
+    size_t running;
+    std::deque<PyScheduledWorker *> lanes[LANE_COUNT];
+    PyLaneStats stats[LANE_COUNT];
+    PyMetrics *metrics; // 这个context的指标, 创建的时候取好, 之后不用再查pymetrics
+    // worker退出的时候还有调用没跑完的话, 由最后跑完的那个调用销毁解释器, 这几个字段会在worker线程上用
+    std::atomic<int> unfinished;   // 已经交给libuv、还没执行完(或者没执行就被丢掉)的调用
+    std::atomic<bool> orphaned;    // JS环境已经没了
+    std::atomic<bool> ended;       // 解释器已经销毁或者正在销毁, 保证只销毁一次
+    PyObject *orphan_main;
+};
+
+// 每个context只在创建它的JS线程上用, 但是map本身是各个JS线程共享的, 增删要加锁; 元素的引用不会失效
+std::map<PyThreadState *, PyScheduler> schedulers;
+// 每删掉一个context加一, 让各个线程缓存的PyScheduler指针失效(PyThreadState的地址可能被新的context复用)
+std::atomic<uint64_t> scheduler_generation(0);
+// 每个线程记住上一次查到的context, 同步调用和创建worker的时候不用拿锁
+thread_local PyThreadState *last_scheduler_state = NULL;
+thread_local PyScheduler *last_scheduler = NULL;
+thread_local uint64_t last_scheduler_generation = 0;
+
+PyMetrics *resolve_pymetrics(PyThreadState *state);
+
+// 第一次用到的时候创建, 所有数值都是0
+PyScheduler &get_pyscheduler(PyThreadState *state)
+{
+    if (last_scheduler != NULL && last_scheduler_state == state &&
+        last_scheduler_generation == scheduler_generation.load(std::memory_order_acquire))
+    {
+        return *last_scheduler;
+    }
+    std::lock_guard<std::mutex> lock(smutex);
+    PyScheduler &scheduler = schedulers[state];
+    if (scheduler.metrics == NULL)
+        scheduler.metrics = resolve_pymetrics(state);
+    last_scheduler_state = state;
+    last_scheduler = &scheduler;
+    last_scheduler_generation = scheduler_generation.load(std::memory_order_acquire);
+    return scheduler;
+}
+
+void drop_pyscheduler(PyThreadState *state)
+{
+    std::lock_guard<std::mutex> lock(smutex);
+    schedulers.erase(state);
+    scheduler_generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
+size_t pyscheduler_queued(PyScheduler &scheduler)
+{
+    size_t i, queued = 0;
+    for (i = 0; i < LANE_COUNT; i++)
+        queued += scheduler.lanes[i].size();
+    return queued;
+}
+
+/* 解析options里的调度选项
+{lane?: 'interactive' | 'normal' | 'background'}
+参数不对的话抛JS错误并返回false
+*/
+bool parse_lane_option(const Napi::Env &env, const Napi::Value &value, PyLane &lane)
+{
+    Napi::Value item;
+    std::string name;
+    int i;
+
+    lane = LANE_NORMAL;
+    if (!value.IsObject())
+    {
+        return true;
+    }
+    item = value.As<Napi::Object>().Get("lane");
+    if (item.IsUndefined())
+    {
+        return true;
+    }
+    name = item.IsString() ? item.As<Napi::String>().Utf8Value() : "";
+    for (i = 0; i < LANE_COUNT; i++)
+    {
+        if (name == LANE_NAMES[i])
+        {
+            lane = (PyLane)i;
+            return true;
+        }
+    }
+    Napi::TypeError::New(env, "Option `lane` should be one of interactive/normal/background")
+        .ThrowAsJavaScriptException();
+    return false;
+}
+
+/* dispatch: 'auto', 由binding决定异步调用是就地执行还是交给worker线程
+每个(对象, 方法)记一个指数衰减的执行时间估计, 就地执行和worker线程上执行的时间都会更新它;
+估计值低于阈值、而且GIL没人用的时候直接在JS线程上执行, 然后同步回调; 其他情况照常排队
+CPython没有公开的try-acquire GIL的接口, 这里看的是worker线程里正在等或者拿着GIL的调用个数,
+看不到Python自己开的线程; free-threaded的Python没有GIL, 只看估计值
+第一次见到的方法没有估计值, 按耗时的算, 先去worker线程上跑一次
+*/
+const double COST_ALPHA = 0.2;          // 新样本的权重
+const double DEFAULT_INLINE_MS = 1;     // 默认的阈值
+const size_t MAX_COST_ENTRIES = 4096;   // 超过以后全部清掉重新学
+
+std::map<std::pair<PyObject *, std::string>, double> pycosts; // 对象地址可能被复用, 估计错了也只是派发得不好
+std::mutex pycost_mutex;
+std::atomic<int> pyworkers_in_python(0); // BeginPython到EndPython之间的worker线程个数
+
+void record_pycost(PyObject *object, const std::string &attr, double ms)
+{
+    std::pair<PyObject *, std::string> key(object, attr);
+    std::map<std::pair<PyObject *, std::string>, double>::iterator it;
+    std::lock_guard<std::mutex> lock(pycost_mutex);
+
+    it = pycosts.find(key);
+    if (it != pycosts.end())
+    {
+        it->second += COST_ALPHA * (ms - it->second);
+        return;
+    }
+    if (pycosts.size() >= MAX_COST_ENTRIES)
+    {
+        pycosts.clear();
+    }
+    pycosts[key] = ms;
+}
+
+// 估计值低于inline_ms, 而且没有worker线程在用GIL
+bool pycall_should_inline(PyObject *object, const std::string &attr, double inline_ms)
+{
+    std::map<std::pair<PyObject *, std::string>, double>::iterator it;
+    std::lock_guard<std::mutex> lock(pycost_mutex);
+
+#ifndef Py_GIL_DISABLED
+    if (pyworkers_in_python.load(std::memory_order_relaxed) > 0)
+    {
+        return false;
+    }
+#endif
+    it = pycosts.find(std::make_pair(object, attr));
+    return it != pycosts.end() && it->second < inline_ms;
+}
+
+/* 解析options里的派发选项
+{dispatch?: 'async' | 'auto', inline_ms?: number}
+参数不对的话抛JS错误并返回false
+*/
+bool parse_dispatch_option(const Napi::Env &env, const Napi::Value &value, bool &dispatch_auto, double &inline_ms)
+{
+    Napi::Value item;
+    dispatch_auto = false;
+    inline_ms = DEFAULT_INLINE_MS;
+    if (!value.IsObject())
+    {
+        return true;
+    }
+    item = value.As<Napi::Object>().Get("dispatch");
+    if (!item.IsUndefined())
+    {
+        if (!item.IsString() || (item.As<Napi::String>().Utf8Value() != "auto" &&
+                                 item.As<Napi::String>().Utf8Value() != "async"))
+        {
+            Napi::TypeError::New(env, "Option `dispatch` should be one of async/auto").ThrowAsJavaScriptException();
+            return false;
+        }
+        dispatch_auto = item.As<Napi::String>().Utf8Value() == "auto";
+    }
+    item = value.As<Napi::Object>().Get("inline_ms");
+    if (!item.IsUndefined())
+    {
+        if (!item.IsNumber() || item.As<Napi::Number>().DoubleValue() < 0)
+        {
+            Napi::TypeError::New(env, "Option `inline_ms` should be a non-negative Number").ThrowAsJavaScriptException();
+            return false;
+        }
+        inline_ms = item.As<Napi::Number>().DoubleValue();
+    }
+    return true;
+}
+
+// 提交之前先问一下能不能排上队, 队列满了就直接拒绝, 抛JS错误并返回false
+bool pyscheduler_admit(const Napi::Env &env, PyThreadState *state, PyLane lane)
+{
+    PyScheduler &scheduler = get_pyscheduler(state);
+    if (scheduler.max_queue > 0 &&
+        (scheduler.max_concurrency == 0 || scheduler.running >= scheduler.max_concurrency) &&
+        pyscheduler_queued(scheduler) >= scheduler.max_queue)
+    {
+        scheduler.stats[lane].rejected++;
+        Napi::Error::New(env, "python-ts.Scheduler queue is full").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+/* 运行时指标, 按context和入口分开, 每个入口再按阶段记延迟直方图
+阶段: args(JS参数转成Python), gil(等GIL), exec(执行Python代码), result(返回值转成JS)
+异步调用的args只算JS线程上摊平参数的时间, 在worker线程上生成Python对象的时间算在exec里;
+result包括worker线程上摊平和OnOK里生成JS值两部分
+计数和直方图只用原子操作, 不加锁; 只有第一次查某个context的时候要拿smutex
+*/
+enum PyEntry
+{
+    ENTRY_CALL,     // _call_python
+    ENTRY_RUN,      // _exec/_eval
+    ENTRY_DIR,      // _dir
+    ENTRY_IMPORT,   // _import_module
+    ENTRY_PIPELINE, // _pipeline
+    ENTRY_BATCH,    // _call_batch, 一批算一次
+    ENTRY_COUNT
+};
+
+const char *ENTRY_NAMES[ENTRY_COUNT] = {"call", "run", "dir", "import", "pipeline", "batch"};
+
+enum PyPhase
+{
+    PHASE_ARGS,
+    PHASE_GIL,
+    PHASE_EXEC,
+    PHASE_RESULT,
+    PHASE_COUNT
+};
+
+const char *PHASE_NAMES[PHASE_COUNT] = {"args", "gil", "exec", "result"};
+
+/* 延迟直方图, HDR风格的对数-线性分桶
+单位是纳秒, 小于8的每个值一个桶, 之后每个2的幂区间分成8个桶, 相对误差不超过12.5%;
+最大到2^40纳秒(约18分钟), 再大的算在最后一个桶里
+*/
+const int HIST_SUB_BITS = 3;
+const int HIST_BUCKETS = (40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+
+inline int highest_bit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        int i;
+        for (i = 0; i < HIST_BUCKETS; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+        sum_ns.store(0, std::memory_order_relaxed);
+        max_ns.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t ns)
+    {
+        uint64_t seen = max_ns.load(std::memory_order_relaxed);
+        buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /* {count, sum_ms, max_ms, p50_ms, p90_ms, p99_ms, buckets: [[上界ms, 个数], ...]}
+    buckets只列出非空的桶, 不是累计值; reset为true的时候读完清零, 读和清是同一个原子操作, 不会丢数
+    */
+    Napi::Object snapshot(const Napi::Env &env, bool reset)
+    {
+        static const double PERCENTILES[] = {0.5, 0.9, 0.99};
+        static const char *PERCENTILE_NAMES[] = {"p50_ms", "p90_ms", "p99_ms"};
+        Napi::Object result = Napi::Object::New(env);
+        Napi::Array list = Napi::Array::New(env), row;
+        uint64_t counts[HIST_BUCKETS], total = 0, seen;
+        uint32_t used = 0;
+        int i, p;
+
+        for (i = 0; i < HIST_BUCKETS; i++)
+        {
+            counts[i] = reset ? buckets[i].exchange(0, std::memory_order_relaxed)
+                              : buckets[i].load(std::memory_order_relaxed);
+            total += counts[i];
+            if (counts[i] > 0)
+            {
+                row = Napi::Array::New(env, 2);
+                row.Set((uint32_t)0, upper_bound(i) / 1e6);
+                row.Set((uint32_t)1, (double)counts[i]);
+                list.Set(used++, row);
+            }
+        }
+        result.Set("count", (double)total);
+        result.Set("sum_ms", (reset ? sum_ns.exchange(0) : sum_ns.load()) / 1e6);
+        result.Set("max_ms", (reset ? max_ns.exchange(0) : max_ns.load()) / 1e6);
+        for (p = 0; p < 3; p++)
+        {
+            seen = 0;
+            for (i = 0; i < HIST_BUCKETS && total > 0; i++)
+            {
+                seen += counts[i];
+                if (seen >= PERCENTILES[p] * total)
+                    break;
+            }
+            result.Set(PERCENTILE_NAMES[p], total == 0 ? 0.0 : upper_bound(i) / 1e6);
+        }
+        result.Set("buckets", list);
+        return result;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[HIST_BUCKETS];
+    std::atomic<uint64_t> sum_ns, max_ns;
+
+    static int bucket(uint64_t ns)
+    {
+        int exponent;
+        if (ns < (1 << HIST_SUB_BITS))
+            return (int)ns;
+        exponent = highest_bit(ns);
+        if (exponent >= 40)
+            return HIST_BUCKETS - 1;
+        return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+               (int)((ns >> (exponent - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    }
+
+    // 桶的上界(不含), 纳秒
+    static double upper_bound(int index)
+    {
+        int exponent, sub;
+        if (index < (1 << HIST_SUB_BITS))
+            return index + 1;
+        exponent = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+        sub = index & ((1 << HIST_SUB_BITS) - 1);
+        return std::ldexp((double)((1 << HIST_SUB_BITS) + sub + 1), exponent - HIST_SUB_BITS);
+    }
+};
+
+struct PyEntryMetrics
+{
+    std::atomic<uint64_t> calls, errors;
+    LatencyHistogram phases[PHASE_COUNT];
+    PyEntryMetrics() : calls(0), errors(0) {}
+};
+
+struct PyMetrics
+{
+    PyEntryMetrics entries[ENTRY_COUNT];
+};
+
+// 和schedulers一样按context的PyThreadState存, 全局Context是NULL; 元素的引用不会失效
+std::map<PyThreadState *, PyMetrics> pymetrics;
+
+// 需要持有smutex
+PyMetrics *resolve_pymetrics(PyThreadState *state)
+{
+    return &pymetrics[state];
+}
+
+// 指针在PyScheduler里, 只在第一次用到这个context的时候拿锁
+PyEntryMetrics &get_pymetrics(PyThreadState *state, PyEntry entry)
+{
+    return get_pyscheduler(state).metrics->entries[entry];
+}
+
+// 在drop_pyscheduler之后调用, 不然PyScheduler里的指针会悬空
+void drop_pymetrics(PyThreadState *state)
+{
+    std::lock_guard<std::mutex> lock(smutex);
+    pymetrics.erase(state);
+}
+
+// 从since到现在的纳秒数, 顺便把since挪到现在, 用来依次记各个阶段
+inline uint64_t lap_ns(std::chrono::steady_clock::time_point &since)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+    since = now;
+    return ns;
+}
+
+/* 同步调用的卡顿检测
+同步调用期间JS主线程一直卡在Python里, 包括等别的Python线程(比如Threader的线程池)放开GIL的时间
+_set_watchdog(threshold_ms)以后, 超过阈值的同步调用记成一个事件: 入口, 总时长, 其中等GIL的时间,
+以及watchdog线程看到它超时那一刻的Python调用栈
+watchdog线程拿GIL的时候, 正在执行的调用会在下一个switch interval把GIL让出来, 这时候它的frame就是当时的栈;
+free-threaded的Python里不能安全地读别的线程的frame, 只记时间
+*/
+struct SyncCall // 采样器也用它登记异步调用
+{
+    uint64_t id;
+    PyEntry entry;
+    std::string detail;      // 方法名/代码/模块名
+    PyThreadState *tstate;   // 执行这个调用的PyThreadState
+    std::chrono::steady_clock::time_point start, acquired;
+    bool has_gil, sampled;
+    std::vector<std::string> stack; // watchdog看到的栈, 最里面的frame在前
+};
+
+struct StallEvent
+{
+    PyEntry entry;
+    std::string detail;
+    double time, duration_ms, gil_wait_ms; // time是开始时间, 毫秒时间戳
+    bool sampled;
+    std::vector<std::string> stack;
+};
+
+const size_t MAX_STALL_EVENTS = 256; // 没被取走的事件最多留这么多, 多了丢最旧的
+const int MAX_STACK_DEPTH = 64;
+
+std::atomic<double> watchdog_ms(0); // 0表示关闭
+std::atomic<uint64_t> stall_count(0), sync_call_top(0);
+std::mutex watchdog_mutex;          // 保护下面几个; 拿着它的时候不能去等GIL
+std::condition_variable watchdog_cv;
+std::set<SyncCall *> sync_calls;    // 正在进行的同步调用
+std::deque<StallEvent> stall_events;
+bool watchdog_running = false;
+
+// 需要持有GIL; 读tstate当前的调用栈, lines为false的时候不带行号
+void capture_pystack(PyThreadState *tstate, std::vector<std::string> &stack, bool lines = true)
+{
+#if !defined(Py_GIL_DISABLED) && PY_VERSION_HEX >= 0x03090000
+    PyFrameObject *frame = PyThreadState_GetFrame(tstate), *back;
+    PyCodeObject *code;
+    std::ostringstream line;
+    int depth = 0;
+
+    while (frame != NULL && depth++ < MAX_STACK_DEPTH)
+    {
+        code = PyFrame_GetCode(frame);
+        line.str("");
+        line << PyUnicode_AsUTF8(code->co_name) << " (" << PyUnicode_AsUTF8(code->co_filename);
+        if (lines)
+            line << ":" << PyFrame_GetLineNumber(frame);
+        line << ")";
+        stack.push_back(line.str());
+        Py_DECREF(code);
+        back = PyFrame_GetBack(frame);
+        Py_DECREF(frame);
+        frame = back;
+    }
+    Py_XDECREF(frame);
+    PyErr_Clear();
+#endif
+}
+
+// 找出刚刚超时的调用, 拿GIL记下它们的栈
+void watchdog_scan()
+{
+    std::vector<std::pair<SyncCall *, uint64_t>> due;
+    std::set<SyncCall *>::iterator it;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    PyThreadState *ts;
+    double threshold = watchdog_ms;
+    size_t i;
+
+    for (it = sync_calls.begin(); it != sync_calls.end(); it++)
+    {
+        if (!(*it)->sampled && (*it)->has_gil &&
+            std::chrono::duration<double, std::milli>(now - (*it)->start).count() >= threshold)
+        {
+            due.push_back(std::make_pair(*it, (*it)->id));
+        }
+    }
+    if (due.empty() || !py_ready || !mutex.try_lock())
+    {
+        // 没有要看的, 或者Python正在初始化/销毁
+        return;
+    }
+
+    watchdog_mutex.unlock();
+    AcquireGIL(NULL, &ts);
+    watchdog_mutex.lock();
+    for (i = 0; i < due.size(); i++)
+    {
+        // 拿GIL的时候调用可能已经结束了, 地址也可能被新的调用复用, 用id确认
+        if (sync_calls.count(due[i].first) && due[i].first->id == due[i].second)
+        {
+            capture_pystack(due[i].first->tstate, due[i].first->stack);
+            due[i].first->sampled = true;
+        }
+    }
+    watchdog_mutex.unlock();
+    ReleaseGIL(NULL, &ts);
+    watchdog_mutex.lock();
+    mutex.unlock();
+}
+
+void watchdog_loop()
+{
+    std::unique_lock<std::mutex> lock(watchdog_mutex);
+    double threshold;
+    while (true)
+    {
+        threshold = watchdog_ms;
+        if (threshold <= 0)
+        {
+            watchdog_cv.wait(lock);
+            continue;
+        }
+        // 阈值的四分之一扫一次, 超时以后最多再过这么久就能看到栈
+        watchdog_cv.wait_for(lock, std::chrono::microseconds((int64_t)std::max(250.0, threshold * 250)));
+        watchdog_scan();
+    }
+}
+
+void start_watchdog(double threshold)
+{
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    watchdog_ms = threshold;
+    if (!watchdog_running && threshold > 0)
+    {
+        watchdog_running = true;
+        std::thread(watchdog_loop).detach();
+    }
+    watchdog_cv.notify_all();
+}
+
+// 调用开始, 在EnterPython之前
+void watch_sync_call(SyncCall &call, PyThreadState *state, PyEntry entry)
+{
+    call.id = ++sync_call_top;
+    call.entry = entry;
+    call.tstate = state == NULL ? thread_main_state() : state;
+    call.has_gil = call.sampled = false;
+    call.start = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    sync_calls.insert(&call);
+}
+
+void watch_sync_acquired(SyncCall &call)
+{
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    call.acquired = std::chrono::steady_clock::now();
+    call.has_gil = true;
+}
+
+// 调用结束, 在LeavePython之后; 超过阈值的(不管watchdog有没有看到)都记成事件
+void unwatch_sync_call(SyncCall &call)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    StallEvent event;
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+
+    sync_calls.erase(&call);
+    event.duration_ms = std::chrono::duration<double, std::milli>(now - call.start).count();
+    if (watchdog_ms <= 0 || event.duration_ms < watchdog_ms)
+    {
+        // 只开了采样器的时候也会登记
+        return;
+    }
+    event.entry = call.entry;
+    event.detail = call.detail;
+    event.time = (double)std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::system_clock::now().time_since_epoch()).count() - event.duration_ms;
+    event.gil_wait_ms = std::chrono::duration<double, std::milli>((call.has_gil ? call.acquired : now) - call.start)
+                            .count();
+    event.sampled = call.sampled;
+    event.stack.swap(call.stack);
+    stall_count++;
+    stall_events.push_back(event);
+    if (stall_events.size() > MAX_STALL_EVENTS)
+    {
+        stall_events.pop_front();
+    }
+}
+
+/* 采样profiler
+_profile_start(interval_ms)以后, 采样线程每隔interval_ms拿一次GIL, 读正在执行的同步调用和异步调用的Python调用栈,
+按"入口;方法名/代码;最外层frame;...;最里层frame"累加次数, 导出成flamegraph.pl/speedscope能直接读的collapsed格式
+不用sys.setprofile, 没开的时候只多一次原子变量的读; 开着的时候每次采样让正在执行的调用在下一个switch interval让一次GIL
+只看binding自己执行的调用(同步调用的线程和worker线程), Python自己开的线程不在里面;
+采到的是墙上时间, 在time.sleep之类放开GIL的C函数里等着的也算; free-threaded的Python里没有栈, 只按入口和方法名统计
+*/
+const size_t MAX_PROFILE_STACKS = 65536; // 不同的栈最多记这么多, 多了的记到"[truncated]"
+
+std::atomic<double> profile_interval_ms(0); // 0表示关闭
+std::set<SyncCall *> worker_calls;           // 正在执行的异步调用, 只在采样的时候登记; 需要持有watchdog_mutex
+std::map<std::string, uint64_t> profile_stacks;
+bool profiler_running = false;
+
+// 拿GIL采一次样, 需要持有watchdog_mutex, 中间会放开
+void profiler_sample()
+{
+    std::vector<std::pair<SyncCall *, uint64_t>> due;
+    std::set<SyncCall *>::iterator it;
+    std::vector<std::string> stack;
+    std::string key;
+    PyThreadState *ts;
+    size_t i, j;
+
+    for (it = sync_calls.begin(); it != sync_calls.end(); it++)
+    {
+        if ((*it)->has_gil)
+            due.push_back(std::make_pair(*it, (*it)->id));
+    }
+    for (it = worker_calls.begin(); it != worker_calls.end(); it++)
+    {
+        due.push_back(std::make_pair(*it, (*it)->id));
+    }
+    if (due.empty() || !py_ready || !mutex.try_lock())
+    {
+        return;
+    }
+
+    watchdog_mutex.unlock();
+    AcquireGIL(NULL, &ts);
+    watchdog_mutex.lock();
+    for (i = 0; i < due.size(); i++)
+    {
+        if ((!sync_calls.count(due[i].first) && !worker_calls.count(due[i].first)) || due[i].first->id != due[i].second)
+        {
+            continue;
+        }
+        stack.clear();
+        capture_pystack(due[i].first->tstate, stack, false);
+        key = ENTRY_NAMES[due[i].first->entry];
+        key += ";";
+        key += due[i].first->detail.empty() ? "?" : due[i].first->detail;
+        for (j = stack.size(); j > 0; j--)
+        {
+            key += ";" + stack[j - 1];
+        }
+        // collapsed格式用分号分隔frame, 换行分隔栈
+        std::replace(key.begin(), key.end(), '\n', ' ');
+        std::replace(key.begin(), key.end(), '\r', ' ');
+        if (profile_stacks.size() >= MAX_PROFILE_STACKS && !profile_stacks.count(key))
+        {
+            key = "[truncated]";
+        }
+        profile_stacks[key]++;
+    }
+    watchdog_mutex.unlock();
+    ReleaseGIL(NULL, &ts);
+    watchdog_mutex.lock();
+    mutex.unlock();
+}
+
+void profiler_loop()
+{
+    std::unique_lock<std::mutex> lock(watchdog_mutex);
+    double interval;
+    while (true)
+    {
+        interval = profile_interval_ms;
+        if (interval <= 0)
+        {
+            watchdog_cv.wait(lock);
+            continue;
+        }
+        // watchdog和采样器共用watchdog_cv, 被对方叫醒的时候也采一次, 无所谓
+        watchdog_cv.wait_for(lock, std::chrono::microseconds((int64_t)(interval * 1000)));
+        if (profile_interval_ms > 0)
+            profiler_sample();
+    }
+}
+
+void start_profiler(double interval)
+{
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    profile_interval_ms = interval;
+    if (!profiler_running && interval > 0)
+    {
+        profiler_running = true;
+        std::thread(profiler_loop).detach();
+    }
+    watchdog_cv.notify_all();
+}
+
+// 异步调用拿到GIL以后登记给采样器, tstate是worker线程的PyThreadState
+void profile_worker_call(SyncCall &call, PyThreadState *tstate, PyEntry entry)
+{
+    call.id = ++sync_call_top;
+    call.entry = entry;
+    call.tstate = tstate;
+    call.has_gil = true;
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    worker_calls.insert(&call);
+}
+
+void unprofile_worker_call(SyncCall &call)
+{
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    worker_calls.erase(&call);
+}
+
+/* 同步调用的计时
+Start以后每过完一个阶段调一次Mark, 出错的时候调Fail, 析构的时候计一次调用; 没有Start过的什么都不记
+开了watchdog或者采样器的话同时登记给它们, 所以Start要在EnterPython之前, 析构要在LeavePython之后
+*/
+class PyMeter
+{
+public:
+    PyMeter() : _metrics(NULL), _failed(false), _watched(false) {}
+    ~PyMeter()
+    {
+        if (_metrics != NULL)
+        {
+            _metrics->calls.fetch_add(1, std::memory_order_relaxed);
+            if (_failed)
+                _metrics->errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (_watched)
+        {
+            unwatch_sync_call(_call);
+        }
+    }
+
+    void Start(PyThreadState *state, PyEntry entry)
+    {
+        _metrics = &get_pymetrics(state, entry);
+        _last = std::chrono::steady_clock::now();
+        if (watchdog_ms.load(std::memory_order_relaxed) > 0 || profile_interval_ms.load(std::memory_order_relaxed) > 0)
+        {
+            _watched = true;
+            watch_sync_call(_call, state, entry);
+        }
+    }
+
+    // 卡顿事件和采样里带上的说明, 只在开了watchdog或者采样器的时候才转换
+    void Describe(const Napi::String &text)
+    {
+        if (_watched)
+            _call.detail = text.Utf8Value().substr(0, 200);
+    }
+
+    void Mark(PyPhase phase)
+    {
+        if (_metrics != NULL)
+            _metrics->phases[phase].record(lap_ns(_last));
+        if (_watched && phase == PHASE_GIL)
+            watch_sync_acquired(_call);
+    }
+
+    void Fail()
+    {
+        _failed = true;
+    }
+
+private:
+    PyEntryMetrics *_metrics;
+    bool _failed, _watched;
+    std::chrono::steady_clock::time_point _last;
+    SyncCall _call;
+};
+
+Napi::Object pymetrics_snapshot(const Napi::Env &env, PyMetrics &metrics, bool reset)
+{
+    Napi::Object result = Napi::Object::New(env), entry, phases;
+    int i, j;
+
+    for (i = 0; i < ENTRY_COUNT; i++)
+    {
+        entry = Napi::Object::New(env);
+        phases = Napi::Object::New(env);
+        entry.Set("calls", (double)(reset ? metrics.entries[i].calls.exchange(0) : metrics.entries[i].calls.load()));
+        entry.Set("errors", (double)(reset ? metrics.entries[i].errors.exchange(0) : metrics.entries[i].errors.load()));
+        for (j = 0; j < PHASE_COUNT; j++)
+        {
+            phases.Set(PHASE_NAMES[j], metrics.entries[i].phases[j].snapshot(env, reset));
+        }
+        entry.Set("phases", phases);
+        result.Set(ENTRY_NAMES[i], entry);
+    }
+    return result;
+}
+
+/* 一个交给libuv的调用执行完了或者不会再执行了; 最后一个跑完的调用发现JS环境已经没了的时候销毁解释器
+不能持有GIL
+*/
+void pyscheduler_retire(PyScheduler *scheduler, PyThreadState *state)
+{
+    if (scheduler->unfinished.fetch_sub(1) == 1 && scheduler->orphaned.load() && !scheduler->ended.exchange(true))
+    {
+        __end_pycontext(state, scheduler->orphan_main);
+        bound_workers--;
+    }
+}
+
+// 调用执行Python的线程, 取消的时候由别的线程读; worker可能先于取消线程被delete, 所以单独分配
+struct PyInterrupt
+{
+    std::mutex mutex;
+    bool in_python;
+    unsigned long thread_id;
+    PyInterrupt() : in_python(false), thread_id(0) {}
+};
+
+/* 在一个临时线程上拿GIL, 往正在执行的调用里抛exception, JS线程不用等GIL
+Cancel()之前已经给unfinished加过一, 这里做完再减掉, 在那之前解释器不会被销毁
+*/
+void interrupt_pycall(std::shared_ptr<PyInterrupt> interrupt, PyScheduler *scheduler, PyThreadState *state,
+                      PyObject *exception)
+{
+    PyInterpreterState *interp = state == NULL ? py_mainstate->interp : state->interp;
+    PyThreadState *ts = PyThreadState_New(interp);
+
+    PyEval_RestoreThread(ts);
+    // EndPython也要拿这个mutex, 所以in_python为true的时候worker线程不可能已经换去跑别的调用了;
+    // free-threaded的Python里拿着"GIL"也挡不住别的线程, 不能只靠GIL
+    interrupt->mutex.lock();
+    if (interrupt->in_python)
+    {
+        PyThreadState_SetAsyncExc(interrupt->thread_id, exception);
+    }
+    interrupt->mutex.unlock();
+    PyThreadState_Clear(ts);
+    PyThreadState_DeleteCurrent();
+    pyscheduler_retire(scheduler, state);
+}
+
+/* 所有异步Worker的基类, 负责调度、计时和取消
+子类实现Work()(worker线程)和Deliver()(JS主线程), 不直接调用Queue(), 而是交给Schedule()
+Work()里用BeginPython()/EndPython()代替AcquireGIL/ReleaseGIL, 这样Cancel()才知道能不能往这个线程里抛异常
+*/
+class PyScheduledWorker : public Napi::AsyncWorker
+{
+public:
+    PyScheduledWorker(Napi::Function &callback, PyThreadState *state, PyEntry entry)
+        : Napi::AsyncWorker(callback), _state(state), _metrics(get_pymetrics(state, entry)), _entry(entry),
+          _lane(LANE_NORMAL), _id(0), _dispatched(false), _discarded(false), _settled(false), _profiled(false),
+          _interrupt(std::make_shared<PyInterrupt>()), _gil_ms(0), _retired(false)
+    {
+        _scheduler = &get_pyscheduler(state);
+    }
+
+    // 没执行就被丢掉的调用(比如JS环境销毁的时候libuv取消了它)在这里交还名额
+    ~PyScheduledWorker()
+    {
+        Retire();
+    }
+
+    // 需要先通过pyscheduler_admit, 返回这个调用的id
+    uint32_t Schedule(PyLane lane)
+    {
+        PyScheduler &scheduler = get_pyscheduler(_state);
+        AddonData *data = addon_data(Env());
+        _lane = lane;
+        _submitted = std::chrono::steady_clock::now();
+        _id = ++data->pytask_top;
+        data->pytasks[_id] = this;
+        scheduler.stats[lane].submitted++;
+        if (scheduler.max_concurrency == 0 || scheduler.running < scheduler.max_concurrency)
+        {
+            Dispatch();
+        }
+        else
+        {
+            scheduler.lanes[lane].push_back(this);
+        }
+        return _id;
+    }
+
+    // 在JS线程上做完的阶段(摊平参数)也记到这个调用的入口上
+    void Measure(PyPhase phase, uint64_t ns)
+    {
+        _metrics.phases[phase].record(ns);
+    }
+
+    /* 取消调用, 马上用message回调, 之后真正跑完的结果直接丢掉; 在JS线程上不碰GIL, 正在执行的调用卡着GIL也不会卡住JS
+    还在lane里排队的: 从队列里拿掉, 不占并发名额直接交给libuv, 在worker线程上释放借来的Python对象
+    已经交给libuv的: 如果正在执行Python, 在临时线程上用PyThreadState_SetAsyncExc往那个线程里抛exception
+    调用者负责从pytasks里拿掉, worker由libuv回收, 调用者不用delete
+    */
+    void Cancel(const std::string &message, PyObject *exception)
+    {
+        PyScheduler &scheduler = get_pyscheduler(_state);
+        std::deque<PyScheduledWorker *> &lane = scheduler.lanes[_lane];
+
+        _settled = true;
+        scheduler.stats[_lane].cancelled++;
+        Callback().Call({Napi::String::New(Env(), message)});
+        if (!_dispatched)
+        {
+            // BeginPython看到已经取消了就只做Cleanup, OnOK看到_discarded不记账
+            lane.erase(std::find(lane.begin(), lane.end(), this));
+            _discarded = true;
+            _dispatched = true;
+            scheduler.unfinished++;
+            Queue();
+        }
+        else
+        {
+            scheduler.unfinished++;
+            std::thread(interrupt_pycall, _interrupt, _scheduler, _state, exception).detach();
+        }
+    }
+
+    // JS环境销毁的时候丢掉还在lane里排队的调用, 已经没法回调JS了, 只释放借来的Python对象; 调用者负责delete
+    void Drop()
+    {
+        PyThreadState *previous;
+        _settled = true;
+        previous = EnterPython(_state);
+        Cleanup();
+        LeavePython(previous);
+    }
+
+protected:
+    // This code will be executed on the worker thread
+    void Execute() override
+    {
+        TraceSpan span("execute", "worker");
+        _started = std::chrono::steady_clock::now();
+        Work();
+        _finished = std::chrono::steady_clock::now();
+        // JS环境可能已经没了, OnOK不一定还会被调用, 在这里交还名额
+        Retire();
+    }
+
+    void OnOK() override
+    {
+        TraceSpan span("on_ok", "worker");
+        Napi::HandleScope scope(Env());
+        Napi::Object timing = Napi::Object::New(Env());
+        double wait_ms = std::chrono::duration<double, std::milli>(_started - _submitted).count();
+        double exec_ms = std::chrono::duration<double, std::milli>(_finished - _started).count();
+
+        addon_data(Env())->pytasks.erase(_id);
+        if (_discarded)
+        {
+            // 排队的时候就取消了, 没占并发名额, 回调过了
+            Abandon();
+            return;
+        }
+        Finish(wait_ms, exec_ms);
+        Measured(exec_ms - _gil_ms);
+        _metrics.calls.fetch_add(1, std::memory_order_relaxed);
+        if (_settled)
+        {
+            // 已经取消了, 回调过了
+            _metrics.errors.fetch_add(1, std::memory_order_relaxed);
+            Abandon();
+            return;
+        }
+        timing.Set("lane", LANE_NAMES[_lane]);
+        timing.Set("wait_ms", wait_ms);
+        timing.Set("exec_ms", exec_ms);
+        timing.Set("gil_ms", _gil_ms);
+        Deliver(timing);
+    }
+
+    // 拿GIL, 返回false表示已经被取消了, 不用再执行Python代码
+    bool BeginPython()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t ns;
+        pyworkers_in_python++;
+        AcquireGIL(_state, &ts);
+        ns = lap_ns(start);
+        _gil_ms += ns / 1e6;
+        _metrics.phases[PHASE_GIL].record(ns);
+        _interrupt->mutex.lock();
+        _interrupt->thread_id = PyThread_get_thread_ident();
+        _interrupt->in_python = true;
+        _interrupt->mutex.unlock();
+        if (profile_interval_ms.load(std::memory_order_relaxed) > 0)
+        {
+            _profiled = true;
+            _call.detail = Detail();
+            profile_worker_call(_call, ts, _entry);
+        }
+        return !_settled;
+    }
+
+    bool Cancelled()
+    {
+        return _settled;
+    }
+
+    void EndPython()
+    {
+        // 没来得及触发的async exception由ReleaseGIL清掉
+        _interrupt->mutex.lock();
+        _interrupt->in_python = false;
+        _interrupt->mutex.unlock();
+        if (_profiled)
+        {
+            _profiled = false;
+            unprofile_worker_call(_call);
+        }
+        ReleaseGIL(_state, &ts);
+        pyworkers_in_python--;
+    }
+
+    virtual void Work() = 0;
+    // 采样器里显示的方法名/代码, 在worker线程上调用
+    virtual std::string Detail() { return ""; }
+    // 执行完了(包括被取消的), run_ms是去掉等GIL以后的执行时间, 在JS主线程上调用
+    virtual void Measured(double run_ms) {}
+    // timing: {lane, wait_ms, exec_ms, gil_ms}, 作为回调的第二个参数; gil_ms是exec_ms里等GIL的时间
+    virtual void Deliver(const Napi::Object &timing) = 0;
+    // 释放借来或者持有的Python对象, 需要持有GIL
+    virtual void Cleanup() {}
+    // 被取消的调用跑完以后丢掉结果, 在JS主线程上调用
+    virtual void Abandon() {}
+
+    PyThreadState *_state, *ts;
+    PyEntryMetrics &_metrics; // 这个context这个入口的指标, context在有异步调用的时候不能删, 引用一直有效
+    PyEntry _entry;
+    SyncCall _call; // 开着采样器的时候登记给它
+
+private:
+    void Dispatch()
+    {
+        _scheduler->running++;
+        _scheduler->unfinished++;
+        _dispatched = true;
+        Queue();
+    }
+
+    // 执行完了或者不会再执行了, 只算一次; 在worker线程(Execute的最后)或者JS线程(析构)上调用, 不能持有GIL
+    void Retire()
+    {
+        if (!_dispatched || _retired.exchange(true))
+        {
+            return;
+        }
+        pyscheduler_retire(_scheduler, _state);
+    }
+
+    // 记账, 然后把空出来的位置让给排队中优先级最高的调用
+    void Finish(double wait_ms, double exec_ms)
+    {
+        PyScheduler &scheduler = get_pyscheduler(_state);
+        PyLaneStats &stats = scheduler.stats[_lane];
+        PyScheduledWorker *next;
+        int i;
+
+        stats.completed++;
+        stats.wait_ms += wait_ms;
+        stats.exec_ms += exec_ms;
+        stats.wait_max_ms = std::max(stats.wait_max_ms, wait_ms);
+        stats.exec_max_ms = std::max(stats.exec_max_ms, exec_ms);
+
+        scheduler.running--;
+        for (i = 0; i < LANE_COUNT; i++)
+        {
+            while (!scheduler.lanes[i].empty() &&
+                   (scheduler.max_concurrency == 0 || scheduler.running < scheduler.max_concurrency))
+            {
+                next = scheduler.lanes[i].front();
+                scheduler.lanes[i].pop_front();
+                next->Dispatch();
+            }
+        }
+    }
+
+    PyLane _lane;
+    uint32_t _id;
+    bool _dispatched, _discarded;
+    std::atomic<bool> _settled;
+    bool _profiled; // 只在worker线程上用
+    std::shared_ptr<PyInterrupt> _interrupt;
+    double _gil_ms; // 只在worker线程上写, OnOK的时候已经写完了
+    std::chrono::steady_clock::time_point _submitted, _started, _finished;
+    PyScheduler *_scheduler; // context在有异步调用的时候不能删, 指针一直有效
+    std::atomic<bool> _retired;
+};
+
+/* 异步调用的公共部分
+Execute在worker线程上持有GIL跑完Run(), 顺便把结果摊平成FlatValue、把该释放的Python对象都释放掉;
+OnOK回到JS主线程以后只从FlatValue生成JS值, 结果里没有PyWrapper的话就不用再拿GIL
+子类实现Run()返回新的引用(出错返回NULL), 以及Cleanup()释放自己持有的Python对象, 两者都在持有GIL的时候调用
+*/
+class PyFlatWorker : public PyScheduledWorker
+{
+public:
+    PyFlatWorker(Napi::Function &callback, PyThreadState *state, PyEntry entry, const ConvertOptions &options,
+                 const char *title)
+        : PyScheduledWorker(callback, state, entry), _options(options), _title(title), _failed(false), _flat_ns(0) {}
+
+protected:
+    void Work() override
+    {
+        std::chrono::steady_clock::time_point since;
+        PyObject *pRet;
+        if (BeginPython())
+        {
+            since = std::chrono::steady_clock::now();
+            pRet = Run();
+            _metrics.phases[PHASE_EXEC].record(lap_ns(since));
+            if (pRet == NULL)
+            {
+                _failed = true;
+                _error = format_pyexception(_title);
+            }
+            else
+            {
+                flatten_pyobject(_flat, pRet, _options);
+                Py_DECREF(pRet);
+                _flat_ns = lap_ns(since);
+            }
+        }
+        Cleanup();
+        EndPython();
+    }
+
+    void Deliver(const Napi::Object &timing) override
+    {
+        std::chrono::steady_clock::time_point since;
+        Napi::Value result;
+        if (_failed)
+        {
+            _metrics.errors.fetch_add(1, std::memory_order_relaxed);
+            Callback().Call({Napi::String::New(Env(), _error), timing});
+        }
+        else
+        {
+            Store(_flat);
+            since = std::chrono::steady_clock::now();
+            result = flat_to_napi_value(Env(), _flat, _state);
+            _metrics.phases[PHASE_RESULT].record(_flat_ns + lap_ns(since));
+            Callback().Call({result, timing});
+        }
+    }
+
+    // 成功的结果在生成JS值之前先给子类看一眼, 在JS主线程上调用
+    virtual void Store(const FlatValue &flat) {}
+
+    void Abandon() override
+    {
+        PyThreadState *previous;
+        if (_flat.handles > 0)
+        {
+            previous = EnterPython(_state);
+            release_flat_handles(_flat);
+            LeavePython(previous);
+        }
+    }
+
+    virtual PyObject *Run() = 0;
+
+    ConvertOptions _options;
+
+private:
+    const char *_title;
+    bool _failed;
+    std::string _error;
+    FlatValue _flat;
+    uint64_t _flat_ns; // worker线程上摊平返回值的时间
+};
+
+// 用摊平的参数调用object.attr(*args, **kwargs), 需要持有GIL; 返回新的引用, 出错返回NULL
+PyObject *call_flat_pyobject(PyObject *object, const std::string &attr, FlatValue &args, FlatValue &kwargs)
+{
+    PyObject *pCallable, *pArgs, *pKwargs, *pRet = NULL;
+    pCallable = PyObject_GetAttrString(object, attr.c_str());
+    if (pCallable == NULL)
+    {
+        return NULL;
+    }
+    pArgs = flat_to_pyargs(args);
+    pKwargs = flat_to_pykwargs(kwargs);
+    if (pArgs != NULL && pKwargs != NULL)
+    {
+        pRet = PyObject_Call(pCallable, pArgs, pKwargs);
+    }
+    Py_DECREF(pCallable);
+    Py_XDECREF(pArgs);
+    Py_XDECREF(pKwargs);
+    return pRet;
+}
+
+// _call_python专用, 参数在JS主线程上摊平, 到worker线程再转成Python对象
+class PyCallWorker : public PyFlatWorker
+{
+public:
+    PyCallWorker(Napi::Function &callback,
+                 PyObject *pObject, const std::string &attr, PyThreadState *state, const ConvertOptions &options)
+        : PyFlatWorker(callback, state, ENTRY_CALL, options, "python-ts.PyCallWorker failed"), cached(false),
+          costed(false), _pObject(pObject),
+          _attr(attr) {}
+
+    FlatValue args, kwargs;
+    std::string cache_key; // cached为true的时候, 结果要放进(object, attr)的缓存
+    bool cached;
+    bool costed; // dispatch: 'auto'的调用, 执行时间要记到估计值里
+
+protected:
+    void Measured(double run_ms) override
+    {
+        if (costed)
+        {
+            record_pycost(_pObject, _attr, run_ms);
+        }
+    }
+
+    PyObject *Run() override
+    {
+        return call_flat_pyobject(_pObject, _attr, args, kwargs);
+    }
+
+    std::string Detail() override
+    {
+        return _attr;
+    }
+
+    void Store(const FlatValue &flat) override
+    {
+        PyCache *cache = cached ? find_pycache(_pObject, _attr) : NULL;
+        if (cache != NULL)
+        {
+            pycache_put(*cache, cache_key, flat);
+        }
+    }
+
+    void Cleanup() override
+    {
+        unpin_flat_handles(args);
+        unpin_flat_handles(kwargs);
+        unpin_pyobject(_pObject);
+    }
+
+private:
+    PyObject *_pObject; // pin_pyobject借来的
+    std::string _attr;
+};
+
+// _exec/_eval专用
+class PyRunWorker : public PyFlatWorker
+{
+public:
+    PyRunWorker(Napi::Function &callback,
+                const std::string &code, int start, PyObject *pMain, PyThreadState *state,
+                const ConvertOptions &options)
+        : PyFlatWorker(callback, state, ENTRY_RUN, options, "python-ts.PyRunWorker failed"), _pMain(pMain),
+          _code(code), _start(start) {}
+
+protected:
+    PyObject *Run() override
+    {
+        PyObject *pDict = PyModule_GetDict(_pMain);
+        return PyRun_String(_code.c_str(), _start, pDict, pDict);
+    }
+
+    std::string Detail() override
+    {
+        return _code.substr(0, 200);
+    }
+
+private:
+    PyObject *_pMain; // __main__模块, 跟context活得一样久
+    std::string _code;
+    int _start;
+};
+
+// _pipeline专用
+class PyPipelineWorker : public PyFlatWorker
+{
+public:
+    PyPipelineWorker(Napi::Function &callback,
+                     PyObject *pObject, std::vector<PyStep> &steps, PyThreadState *state,
+                     const ConvertOptions &options)
+        : PyFlatWorker(callback, state, ENTRY_PIPELINE, options, "python-ts.PyPipelineWorker failed"),
+          _pObject(pObject),
+          _steps(steps) {}
+
+protected:
+    PyObject *Run() override
+    {
+        return run_pysteps(_pObject, _steps);
+    }
+
+    void Cleanup() override
+    {
+        Py_DECREF(_pObject);
+        free_pysteps(_steps);
+    }
+
+private:
+    PyObject *_pObject;
+    std::vector<PyStep> _steps;
+};
+
+// _call_batch的一个调用
+struct PyBatchCall
+{
+    PyObject *object; // pin_pyobject借来的
+    std::string attr;
+    FlatValue args, kwargs, result;
+    ConvertOptions options;
+    bool failed;
+    std::string error;
+};
+
+// _call_batch专用, 一次拿GIL依次执行所有调用, 一次回调把所有结果带回JS
+class PyBatchWorker : public PyScheduledWorker
+{
+public:
+    PyBatchWorker(Napi::Function &callback, PyThreadState *state)
+        : PyScheduledWorker(callback, state, ENTRY_BATCH) {}
+
+    std::vector<PyBatchCall> calls;
+
+protected:
+    void Work() override
+    {
+        std::chrono::steady_clock::time_point since;
+        PyObject *pRet;
+        size_t i;
+
+        // 前面的调用出错不影响后面的, 整批被取消的话剩下的就不跑了
+        BeginPython();
+        since = std::chrono::steady_clock::now();
+        for (i = 0; i < calls.size() && !Cancelled(); i++)
+        {
+            pRet = call_flat_pyobject(calls[i].object, calls[i].attr, calls[i].args, calls[i].kwargs);
+            calls[i].failed = pRet == NULL;
+            if (pRet == NULL)
+            {
+                calls[i].error = format_pyexception("python-ts.PyBatchWorker failed");
+            }
+            else
+            {
+                flatten_pyobject(calls[i].result, pRet, calls[i].options);
+                Py_DECREF(pRet);
+            }
+        }
+        _metrics.phases[PHASE_EXEC].record(lap_ns(since));
+        Cleanup();
+        EndPython();
+    }
+
+    void Cleanup() override
+    {
+        size_t i;
+        for (i = 0; i < calls.size(); i++)
+        {
+            unpin_flat_handles(calls[i].args);
+            unpin_flat_handles(calls[i].kwargs);
+            unpin_pyobject(calls[i].object);
+        }
+    }
+
+    void Abandon() override
+    {
+        PyThreadState *previous = EnterPython(_state);
+        size_t i;
+        for (i = 0; i < calls.size(); i++)
+        {
+            release_flat_handles(calls[i].result);
+        }
+        LeavePython(previous);
+    }
+
+    // 回调参数是跟calls一一对应的数组, 失败的调用对应'python-ts'开头的错误信息
+    void Deliver(const Napi::Object &timing) override
+    {
+        Napi::Array results = Napi::Array::New(Env(), calls.size());
+        std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+        size_t i;
+
+        for (i = 0; i < calls.size(); i++)
+        {
+            if (calls[i].failed)
+            {
+                results.Set((uint32_t)i, Napi::String::New(Env(), calls[i].error));
+            }
+            else
+            {
+                results.Set((uint32_t)i, flat_to_napi_value(Env(), calls[i].result, _state));
+            }
+        }
+        _metrics.phases[PHASE_RESULT].record(lap_ns(since));
+        Callback().Call({results, timing});
+    }
+};
+
+/* 设置python的runtime路径
+_set_runtime(path)
+参数:
+    path: runtime目录, 就是有python38._pth, python3.dll, python38.dll的那个文件夹的目录
+          不设置的话默认为当前目录的相对路径`x64/runtime`下。
+          需要在_init_python之前设置。
+返回
+    true代表成功, false代表失败
+*/
+Napi::Boolean _set_runtime_path(const Napi::CallbackInfo &info)
+{
+    Napi::String path;
+    Napi::Env env = info.Env();
+    Napi::Boolean succeeded = Napi::Boolean::New(env, true), failed = Napi::Boolean::New(env, false);
+
+    if (info.Length() < 1)
+    {
+        Napi::TypeError::New(env, "Please call with (path)").ThrowAsJavaScriptException();
+        return failed;
+    }
+    if (!info[0].IsString())
+    {
+        Napi::TypeError::New(env, "Argument `path` should be a String").ThrowAsJavaScriptException();
+        return failed;
+    }
+
+    path = info[0].As<Napi::String>();
+    runtime_path = path.Utf8Value();
+    if (debug)
+        printf("runtime_path = %s\n", runtime_path.c_str());
+    return succeeded;
+}
+
+Napi::Value _set_debug(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Boolean value = Napi::Boolean::New(env, false);
+    if (info.Length() >= 1 && info[0].IsBoolean())
+    {
+        value = info[0].As<Napi::Boolean>();
+    }
+    debug = value.Value();
+    if (debug)
+        printf("debug is on\n");
+    return env.Null();
+}
+
+/*  载入模块，接受两个参数,
+_import_module(module_name, context)
+参数
+    module_name: 模块名称, 可以有.在中间，比如"urllib.parse"
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
+返回值
+    如果成功, 返回JSON.stringify({"type": PYOBJECT_WRAPPER, "value": PyObject指针地址})
+    如果失败, raise错误信息
+*/
+Napi::Object _import_module(const Napi::CallbackInfo &info)
+{
+    TraceSpan span("import", "entry");
+    PyObject *pModule;
+    Napi::String module_name;
+    Napi::Env env = info.Env();
+    Napi::Object result = Napi::Object::New(env), context = Napi::Object::New(env);
+    PyThreadState *substate, *previous;
+    PyMeter meter;
+
+    // 参数检查并赋值给module_name
+    if (info.Length() < 1)
+    {
+        Napi::TypeError::New(env, "Please call with (module_name, context)").ThrowAsJavaScriptException();
+        return result;
+    }
+    if (!info[0].IsString())
+    {
+        Napi::TypeError::New(env, "Argument `module_name` should be a String").ThrowAsJavaScriptException();
+        return result;
+    }
+    if (info.Length() >= 2)
+    {
+        if (!info[1].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        context = info[1].As<Napi::Object>();
+    }
+    module_name = info[0].As<Napi::String>();
+
+    // 以防大家不手动init python, 不管怎样都init一下
+    __init_python(env);
+
+    substate = pycontext_get(context, "state");
+    meter.Start(substate, ENTRY_IMPORT);
+    meter.Describe(module_name);
+    previous = EnterPython(substate);
+    meter.Mark(PHASE_GIL);
+
+    // 真正的import部分
+    pModule = PyImport_ImportModule(module_name.Utf8Value().c_str());
+    meter.Mark(PHASE_EXEC);
+    if (pModule == NULL)
+    {
+        meter.Fail();
+        throw_pyexception_in_javascript(env, "python-ts._import_module failed");
+    }
+    else
+    {
+        result = serialize_pyobject(env, pModule, substate);
+        meter.Mark(PHASE_RESULT);
+    }
+    Py_XDECREF(pModule);
+
+    LeavePython(previous);
+    return result;
+}
+
+/* 重载模块
+_reload_module(module_name, context)
+参数
+    module_name: 模块名称, 可以有.在中间，比如"urllib.parse"
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
+返回值
+    如果成功, 返回JSON.stringify({"type": PYOBJECT_WRAPPER, "value": PyObject指针地址})
+    如果失败, raise错误信息
+*/
+Napi::Boolean _reload_module(const Napi::CallbackInfo &info)
+{
+    char single_code[MAX_CODE_SIZE];
+    Napi::String module_name, module_path;
+    Napi::Env env = info.Env();
+    Napi::Boolean result, failed = Napi::Boolean::New(env, false), succeeded = Napi::Boolean::New(env, true);
+    Napi::Object context = Napi::Object::New(env);
+    PyThreadState *substate, *previous;
+    int ret;
+
+    // 参数检查并赋值给module_name
+    if (info.Length() < 1)
+    {
+        Napi::TypeError::New(env, "Please call with (module_name, context)").ThrowAsJavaScriptException();
+        return failed;
+    }
+    if (!info[0].IsString())
     {
         Napi::TypeError::New(env, "Argument `module_name` should be a String").ThrowAsJavaScriptException();
         return failed;
@@ -983,626 +5744,1726 @@ Napi::Boolean _reload_module(const Napi::CallbackInfo &info)
         {
             Napi::TypeError::New(env, "Argument `context` should be an Object")
                 .ThrowAsJavaScriptException();
-            return failed;
+            return failed;
+        }
+        context = info[1].As<Napi::Object>();
+    }
+
+    module_name = info[0].As<Napi::String>();
+
+    // 以防大家不手动init python, 不管怎样都init一下
+    __init_python(env);
+
+    substate = pycontext_get(context, "state");
+    previous = EnterPython(substate);
+
+    // Python Code for reload
+    PyRun_SimpleString("import importlib");
+    sprintf(single_code, "importlib.reload(sys.modules['''%s'''])", module_name.Utf8Value().c_str());
+    ret = PyRun_SimpleString(single_code);
+    if (ret != 0)
+    {
+        throw_pyexception_in_javascript(env, "python-ts._reload_module failed");
+        result = failed;
+    }
+    else
+    {
+        result = succeeded;
+    }
+
+    LeavePython(previous);
+    return result;
+}
+
+/* 调用模块下的函数
+_call_python(object, attr, args, kwargs, context, callback)
+参数
+    object: Python对象, {"type": PYOBJECT_WRAPPER, "value": 0x12341234}
+    attr: 函数/类名称, "string"
+    args: 参数列表array, 可选，默认为[]
+    kwargs: 参数字典array, 可选，默认为{}
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
+    callback: 如果提供callback函数，则用AsyncWorker异步回调返回，否则同步返回
+    options: 返回值的转换选项, {convert: 'deep' | 'shallow' | 'handle' | 'auto', max_items?, max_bytes?}
+             异步调用还可以指定排队的优先级{lane: 'interactive' | 'normal' | 'background'}
+             以及派发方式{dispatch: 'async' | 'auto', inline_ms?}, auto的时候便宜的调用直接在当前线程上执行
+返回值
+    如果可以dump成json的话, python dump一下再parse_json一下，最终返回一个Object
+    如果不行的话, 返回{"type": PYOBJECT_WRAPPER, "value": PyObject指针地址}
+    异步调用返回调用的id, 可以用来_cancel; 就地执行的异步调用在返回之前就回调了, 返回null
+    命中结果缓存的异步调用也返回null, 在下一个tick回调, timing里cached为true
+错误处理
+    如果出错, traceback.format_exc将会被napi_throw_error出来
+*/
+Napi::Value _call_python(const Napi::CallbackInfo &info)
+{
+    TraceSpan span("call", "entry");
+    Napi::Env env = info.Env();
+    Napi::String attr;
+    Napi::Array args, keys;
+    Napi::Object object, kwargs, context;
+    Napi::Value result = env.Null();
+    Napi::Function callback;
+    PyObject *pObject, *pCallable, *pRet, *pArgs, *pKwargs;
+    PyThreadState *substate, *previous;
+    PyCallWorker *wk;
+    ConvertOptions options;
+    PyLane lane;
+    PyCache *cache;
+    FlatValue fargs, fkwargs, fret, *cached;
+    std::chrono::steady_clock::time_point since, entered;
+    PyMeter meter;
+    std::string key, error;
+    Napi::Object timing;
+    double inline_ms, exec_ms, gil_ms;
+    bool has_callback = false, dispatch_auto = false, inline_call = false;
+
+    // 初始化参数
+    if (info.Length() < 2)
+    {
+        Napi::TypeError::New(
+            env,
+            "Please call with (object, attr, args?=[], kwargs?={}, context?={}, callback?=()=>{}, options?={})")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    if (!info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Argument `module` should be an Object")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    if (!info[1].IsString())
+    {
+        Napi::TypeError::New(env, "Argument `attr` should be a String")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    object = info[0].As<Napi::Object>();
+    attr = info[1].As<Napi::String>();
+    args = Napi::Array::New(env);
+    kwargs = Napi::Object::New(env);
+    context = Napi::Object::New(env);
+
+    if (info.Length() >= 3)
+    {
+        if (!info[2].IsArray())
+        {
+            Napi::TypeError::New(env, "Argument `args` should be an Array")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        args = info[2].As<Napi::Array>();
+    }
+
+    if (info.Length() >= 4)
+    {
+        if (!info[3].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `kwargs` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        kwargs = info[3].As<Napi::Object>();
+    }
+
+    if (info.Length() >= 5)
+    {
+        if (!info[4].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        context = info[4].As<Napi::Object>();
+    }
+
+    if (info.Length() >= 6 && !info[5].IsUndefined() && !info[5].IsNull())
+    {
+        if (!info[5].IsFunction())
+        {
+            Napi::TypeError::New(env, "Argument `callback` should be an Function")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        has_callback = true;
+        callback = info[5].As<Napi::Function>();
+    }
+
+    if (!parse_convert_options(env, info.Length() >= 7 ? info[6] : env.Undefined(), options) ||
+        !parse_lane_option(env, info.Length() >= 7 ? info[6] : env.Undefined(), lane) ||
+        !parse_dispatch_option(env, info.Length() >= 7 ? info[6] : env.Undefined(), dispatch_auto, inline_ms))
+    {
+        return result;
+    }
+    // 参数初始化完毕 T.T
+
+    pObject = deserialize_pyobject(env, object);
+    if (pObject == NULL)
+    {
+        Napi::TypeError::New(env, "Argument `object` should be a <python-ts/PyObject*> object or `object` recycled!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    if ((object.Get("state") != context.Get("state") && !in_same_context(env, object, context)) || (args.Length() > 0 && !in_same_context(env, args, context)) || (!napi_object_is_empty(env, kwargs) && !in_same_context(env, kwargs, context)))
+    {
+        Napi::TypeError::New(env, "Cannot call object/args/kwargs from different context!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    // 以防Python没有初始化
+    __init_python(env);
+
+    substate = pycontext_get(context, "state");
+
+    // 开了缓存的方法先查缓存, 参数里有PyWrapper的不走缓存
+    cache = find_pycache(pObject, attr.Utf8Value());
+    if (cache != NULL)
+    {
+        flatten_napi_value(fargs, env, args, false);
+        flatten_napi_value(fkwargs, env, kwargs, false);
+        if (fargs.handles + fkwargs.handles + fargs.functions + fkwargs.functions > 0)
+        {
+            // 参数里的JS函数每次都是新的, 放进缓存也不会命中; pin为false的时候没有创建JsCallable
+            release_flat_functions(fargs);
+            release_flat_functions(fkwargs);
+            cache = NULL;
+        }
+        else
+        {
+            key = make_cache_key(fargs, fkwargs, options);
+            cached = pycache_get(*cache, key);
+            if (cached != NULL)
+            {
+                result = flat_to_napi_value(env, *cached, substate);
+                if (has_callback)
+                {
+                    // 命中的异步调用不返回id, 和没命中的一样在之后的tick回调, 不能在返回之前就回调
+                    timing = Napi::Object::New(env);
+                    timing.Set("lane", LANE_NAMES[lane]);
+                    timing.Set("wait_ms", 0);
+                    timing.Set("exec_ms", 0);
+                    timing.Set("gil_ms", 0);
+                    timing.Set("cached", true);
+                    napi_global_function(env, "setImmediate").Call({callback, result, timing});
+                    return env.Null();
+                }
+                return result;
+            }
+        }
+    }
+
+    // 估计很快而且GIL空闲的话, 就地执行, 省掉线程切换
+    inline_call = has_callback && dispatch_auto && pycall_should_inline(pObject, attr.Utf8Value(), inline_ms);
+
+    if (has_callback && !inline_call)
+    {
+        // PyCallWorker异步调用, JS主线程上只摊平参数, 不拿GIL
+        if (!pyscheduler_admit(env, substate, lane))
+        {
+            return result;
+        }
+        pin_pyobject(pObject);
+        wk = new PyCallWorker(callback, pObject, attr.Utf8Value(), substate, options);
+        wk->costed = dispatch_auto;
+        since = std::chrono::steady_clock::now();
+        if (cache != NULL)
+        {
+            // 没有PyWrapper, 不需要借用, 直接拿来用
+            wk->args = fargs;
+            wk->kwargs = fkwargs;
+            wk->cache_key = key;
+            wk->cached = true;
+        }
+        else
+        {
+            flatten_napi_value(wk->args, env, args);
+            flatten_napi_value(wk->kwargs, env, kwargs);
+        }
+        wk->Measure(PHASE_ARGS, lap_ns(since));
+        return Napi::Number::New(env, wk->Schedule(lane));
+    }
+
+    meter.Start(substate, ENTRY_CALL);
+    meter.Describe(attr);
+    since = std::chrono::steady_clock::now();
+    previous = EnterPython(substate);
+    entered = std::chrono::steady_clock::now();
+    meter.Mark(PHASE_GIL);
+
+    // 构造Python对象pArgs和pKwargs
+    pArgs = napi_args_to_pytuple(env, args);
+    pKwargs = napi_kwargs_to_pydict(env, kwargs);
+    meter.Mark(PHASE_ARGS);
+    if (pArgs == NULL || pKwargs == NULL)
+    {
+        Py_XDECREF(pArgs);
+        Py_XDECREF(pKwargs);
+        meter.Fail();
+        report_pyexception(env, "python-ts._call_python failed to convert args/kwargs", inline_call ? &error : NULL);
+        goto cleanup;
+    }
+
+    // 调用Python的函数
+    pCallable = PyObject_GetAttrString(pObject, attr.Utf8Value().c_str());
+    if (pCallable == NULL)
+    {
+        Py_DECREF(pArgs);
+        Py_DECREF(pKwargs);
+        meter.Fail();
+        report_pyexception(env, "python-ts._call_python failed", inline_call ? &error : NULL);
+        goto cleanup;
+    }
+
+    pRet = PyObject_Call(pCallable, pArgs, pKwargs);
+    Py_DECREF(pCallable);
+    Py_DECREF(pArgs);
+    Py_DECREF(pKwargs);
+    meter.Mark(PHASE_EXEC);
+    if (pRet == NULL)
+    {
+        meter.Fail();
+        report_pyexception(env, "python-ts._call_python failed", inline_call ? &error : NULL);
+        goto cleanup;
+    }
+
+    if (cache != NULL)
+    {
+        // 摊平一次, 既用来缓存也用来生成JS值
+        flatten_pyobject(fret, pRet, options);
+        if (fret.handles == 0)
+        {
+            pycache_put(*cache, key, fret);
+            result = flat_to_napi_value(env, fret, substate);
+            Py_DECREF(pRet);
+            meter.Mark(PHASE_RESULT);
+            goto cleanup;
+        }
+        release_flat_handles(fret);
+    }
+
+    result = pyobject_to_napi_value(env, pRet, substate, options);
+    Py_DECREF(pRet);
+    meter.Mark(PHASE_RESULT);
+
+cleanup:
+    LeavePython(previous);
+    if (inline_call && !env.IsExceptionPending())
+    {
+        // 和异步调用一样回调, 执行时间也记到估计值里
+        gil_ms = std::chrono::duration<double, std::milli>(entered - since).count();
+        exec_ms = lap_ns(since) / 1e6;
+        record_pycost(pObject, attr.Utf8Value(), exec_ms - gil_ms);
+        timing = Napi::Object::New(env);
+        timing.Set("lane", "inline");
+        timing.Set("wait_ms", 0);
+        timing.Set("exec_ms", exec_ms);
+        timing.Set("gil_ms", gil_ms);
+        callback.Call({error.empty() ? result : Napi::String::New(env, error), timing});
+        return env.Null();
+    }
+    return result;
+}
+
+/* 把一批异步调用合并成一个AsyncWorker, 一次拿GIL全部执行完再一起回调
+_call_batch(calls, context, callback)
+参数
+    calls: [[object, attr, args?, kwargs?, options?], ...], 每一项的含义同_call_python
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 所有调用都必须属于这个context
+    callback: 回调函数, 参数是跟calls一一对应的结果数组, 失败的调用对应'python-ts'开头的错误信息
+返回值
+    这一批的id, 可以用来_cancel(整批一起取消); 参数不对的话直接抛错, 整批都不会执行
+*/
+Napi::Value _call_batch(const Napi::CallbackInfo &info)
+{
+    TraceSpan span("batch", "entry");
+    Napi::Env env = info.Env();
+    Napi::Value result = env.Null();
+    Napi::Array calls, row;
+    Napi::Object object, context;
+    Napi::Value args, kwargs;
+    Napi::Function callback;
+    PyBatchWorker *wk;
+    PyObject *pObject;
+    std::vector<PyObject *> pObjects;
+    std::vector<ConvertOptions> options;
+    std::string prefix;
+    PyLane lane, batch_lane = LANE_COUNT;
+    uint32_t i;
+
+    if (info.Length() < 3 || !info[0].IsArray() || !info[1].IsObject() || !info[2].IsFunction())
+    {
+        Napi::TypeError::New(env, "Please call with (calls, context, callback), calls should be an Array")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    calls = info[0].As<Napi::Array>();
+    context = info[1].As<Napi::Object>();
+    callback = info[2].As<Napi::Function>();
+
+    // 先把整批参数检查一遍, 有一个不对就整批拒绝
+    for (i = 0; i < calls.Length(); i++)
+    {
+        prefix = "Call " + std::to_string(i) + ": ";
+        if (!calls.Get(i).IsArray() || calls.Get(i).As<Napi::Array>().Length() < 2 ||
+            !calls.Get(i).As<Napi::Array>().Get(uint32_t(0)).IsObject() ||
+            !calls.Get(i).As<Napi::Array>().Get(1).IsString())
+        {
+            Napi::TypeError::New(env, prefix + "should be an Array like [object, attr, args?, kwargs?, options?]")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        row = calls.Get(i).As<Napi::Array>();
+        object = row.Get(uint32_t(0)).As<Napi::Object>();
+        pObject = deserialize_pyobject(env, object);
+        if (pObject == NULL)
+        {
+            Napi::TypeError::New(env, prefix + "`object` should be a <python-ts/PyObject*> object or `object` recycled!")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        args = row.Get(2);
+        kwargs = row.Get(3);
+        if (!(args.IsUndefined() || args.IsArray()) || !(kwargs.IsUndefined() || (kwargs.IsObject() && !kwargs.IsArray())))
+        {
+            Napi::TypeError::New(env, prefix + "`args` should be an Array and `kwargs` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        if ((object.Get("state") != context.Get("state") && !in_same_context(env, object, context)) ||
+            !in_same_context(env, args, context) || !in_same_context(env, kwargs, context))
+        {
+            Napi::TypeError::New(env, prefix + "Cannot call object/args/kwargs from different context!")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        options.push_back(DEFAULT_CONVERT);
+        if (!parse_convert_options(env, row.Get(4), options.back()) || !parse_lane_option(env, row.Get(4), lane))
+        {
+            return result;
+        }
+        // 整批按里面最急的那个调用排队
+        batch_lane = std::min(batch_lane, lane);
+        pObjects.push_back(pObject);
+    }
+    if (batch_lane == LANE_COUNT)
+    {
+        batch_lane = LANE_NORMAL;
+    }
+
+    // 以防Python没有初始化
+    __init_python(env);
+    if (!pyscheduler_admit(env, pycontext_get(context, "state"), batch_lane))
+    {
+        return result;
+    }
+
+    wk = new PyBatchWorker(callback, pycontext_get(context, "state"));
+    wk->calls.resize(calls.Length());
+    for (i = 0; i < calls.Length(); i++)
+    {
+        row = calls.Get(i).As<Napi::Array>();
+        pin_pyobject(pObjects[i]);
+        wk->calls[i].object = pObjects[i];
+        wk->calls[i].attr = row.Get(1).As<Napi::String>().Utf8Value();
+        wk->calls[i].options = options[i];
+        wk->calls[i].failed = false;
+        flatten_napi_value(wk->calls[i].args, env, row.Get(2));
+        flatten_napi_value(wk->calls[i].kwargs, env, row.Get(3));
+    }
+    return Napi::Number::New(env, wk->Schedule(batch_lane));
+}
+
+/* 在一次调用里执行一串属性访问/函数调用, 中间结果不转换成JS
+_pipeline(object, steps, context, callback)
+参数
+    object: Python对象, {"type": PYOBJECT_WRAPPER, "value": 0x12341234}
+    steps: [['get', attr], ['item', key], ['call', attr, args?, kwargs?], ['invoke', args?, kwargs?], ...]
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
+    callback: 如果提供callback函数，则整条pipeline在AsyncWorker里执行
+    options: 最终结果的转换选项, 同_call_python
+返回值
+    只转换最后一步的结果, 规则同_call_python
+*/
+Napi::Value _pipeline(const Napi::CallbackInfo &info)
+{
+    TraceSpan span("pipeline", "entry");
+    Napi::Env env = info.Env();
+    Napi::Array steps;
+    Napi::Object object, context;
+    Napi::Value result = env.Null();
+    Napi::Function callback;
+    PyObject *pObject, *pRet;
+    PyThreadState *substate, *previous;
+    PyPipelineWorker *wk;
+    std::vector<PyStep> pySteps;
+    ConvertOptions options;
+    PyLane lane;
+    std::chrono::steady_clock::time_point since;
+    PyMeter meter;
+    bool has_callback = false;
+
+    if (info.Length() < 2)
+    {
+        Napi::TypeError::New(env, "Please call with (object, steps, context?={}, callback?=()=>{}, options?={})")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    if (!info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Argument `object` should be an Object")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    if (!info[1].IsArray())
+    {
+        Napi::TypeError::New(env, "Argument `steps` should be an Array")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    object = info[0].As<Napi::Object>();
+    steps = info[1].As<Napi::Array>();
+    context = Napi::Object::New(env);
+
+    if (info.Length() >= 3)
+    {
+        if (!info[2].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        context = info[2].As<Napi::Object>();
+    }
+
+    if (info.Length() >= 4 && !info[3].IsUndefined() && !info[3].IsNull())
+    {
+        if (!info[3].IsFunction())
+        {
+            Napi::TypeError::New(env, "Argument `callback` should be an Function")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        has_callback = true;
+        callback = info[3].As<Napi::Function>();
+    }
+
+    if (!parse_convert_options(env, info.Length() >= 5 ? info[4] : env.Undefined(), options) ||
+        !parse_lane_option(env, info.Length() >= 5 ? info[4] : env.Undefined(), lane))
+    {
+        return result;
+    }
+
+    pObject = deserialize_pyobject(env, object);
+    if (pObject == NULL)
+    {
+        Napi::TypeError::New(env, "Argument `object` should be a <python-ts/PyObject*> object or `object` recycled!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    if ((object.Get("state") != context.Get("state") && !in_same_context(env, object, context)) || !in_same_context(env, steps, context))
+    {
+        Napi::TypeError::New(env, "Cannot run pipeline on object/args/kwargs from different context!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    // 以防Python没有初始化
+    __init_python(env);
+
+    substate = pycontext_get(context, "state");
+    if (has_callback && !pyscheduler_admit(env, substate, lane))
+    {
+        return result;
+    }
+    if (!has_callback)
+    {
+        meter.Start(substate, ENTRY_PIPELINE);
+    }
+    previous = EnterPython(substate);
+    meter.Mark(PHASE_GIL);
+
+    since = std::chrono::steady_clock::now();
+    if (!parse_pysteps(env, steps, pySteps))
+    {
+        meter.Fail();
+        goto cleanup;
+    }
+
+    if (has_callback)
+    {
+        // PyPipelineWorker异步调用, 整条pipeline都在worker线程里跑
+        Py_INCREF(pObject);
+        wk = new PyPipelineWorker(callback, pObject, pySteps, substate, options);
+        wk->Measure(PHASE_ARGS, lap_ns(since));
+        result = Napi::Number::New(env, wk->Schedule(lane));
+        goto cleanup;
+    }
+    meter.Mark(PHASE_ARGS);
+
+    pRet = run_pysteps(pObject, pySteps);
+    free_pysteps(pySteps);
+    meter.Mark(PHASE_EXEC);
+    if (pRet == NULL)
+    {
+        meter.Fail();
+        throw_pyexception_in_javascript(env, "python-ts._pipeline failed");
+        goto cleanup;
+    }
+
+    result = pyobject_to_napi_value(env, pRet, substate, options);
+    Py_DECREF(pRet);
+    meter.Mark(PHASE_RESULT);
+
+cleanup:
+    LeavePython(previous);
+    return result;
+}
+
+/* 列表pyobject的可用方法
+_dir(object, context)
+参数
+    object, serialize以后的PyObject*
+    context, 上下文
+返回
+    [[attr1, is_method, value], [attr2, is_method, value], ...]
+*/
+Napi::Array _dir(const Napi::CallbackInfo &info)
+{
+    TraceSpan span("dir", "entry");
+    Napi::Env env = info.Env();
+    Napi::Array result = Napi::Array::New(env), names, row;
+    Napi::Object context = Napi::Object::New(env), object;
+    PyObject *pObject, *dir, *pItem, *pAttr;
+    PyThreadState *substate, *previous;
+    PyMeter meter;
+    std::string name;
+    uint32_t i, j, is_method;
+
+    if (info.Length() < 1 || !info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Please call with (object) and `object` should be of type Object")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    object = info[0].As<Napi::Object>();
+
+    if (info.Length() >= 2)
+    {
+        if (!info[1].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        context = info[1].As<Napi::Object>();
+    }
+
+    pObject = deserialize_pyobject(env, object);
+    if (pObject == NULL)
+    {
+        Napi::TypeError::New(env, "Argument `object` should be a python-ts/PyObject* Object or `object` recycled!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    if (object.Get("state") != context.Get("state") && !in_same_context(env, object, context))
+    {
+        Napi::TypeError::New(env, "Cannot dir object from different context!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    // 防止python环境未初始化
+    __init_python(env);
+
+    substate = pycontext_get(context, "state");
+    meter.Start(substate, ENTRY_DIR);
+    previous = EnterPython(substate);
+    meter.Mark(PHASE_GIL);
+
+    dir = PyObject_Dir(pObject);
+    meter.Mark(PHASE_EXEC);
+    if (dir == NULL)
+    {
+        meter.Fail();
+        throw_pyexception_in_javascript(env, "python-ts._dir failed");
+        goto cleanup;
+    }
+
+    names = pyobject_to_napi_value(env, dir, substate).As<Napi::Array>();
+    j = 0;
+    for (i = 0; i < names.Length(); i++)
+    {
+        row = Napi::Array::New(env);
+        name = names.Get(i).As<Napi::String>().Utf8Value();
+        if (name == "__builtins__" || name == "__loader__" || name == "__spec__")
+        {
+            continue;
+        }
+        row.Set((uint32_t)0, names.Get(i));
+        pItem = PyList_GetItem(dir, i);
+        pAttr = PyObject_GetAttr(pObject, pItem);
+        is_method = (uint32_t)PyCallable_Check(pAttr);
+        row.Set((uint32_t)1, is_method);
+        if (is_method)
+        {
+            row.Set((uint32_t)2, env.Null());
+        }
+        else
+        {
+            row.Set((uint32_t)2, pyobject_to_napi_value(env, pAttr, substate));
+        }
+        Py_XDECREF(pAttr);
+        result.Set(j, row);
+        j += 1;
+    }
+
+    Py_XDECREF(dir);
+    // 逐个取属性也算在转换里
+    meter.Mark(PHASE_RESULT);
+
+cleanup:
+    LeavePython(previous);
+    return result;
+}
+
+/* _exec/_eval的实际执行函数
+_exec(code, context, callback, options)
+_eval(code, context, callback, options)
+核心代码 =>
+    pRet = PyRun_String(code.Utf8Value().c_str(), start, pDict, pDict);
+*/
+Napi::Value pyrun(const Napi::CallbackInfo &info, int start)
+{
+    TraceSpan span(start == Py_eval_input ? "eval" : "exec", "entry");
+    Napi::Env env = info.Env();
+    Napi::Value result = env.Null();
+    Napi::String code;
+    Napi::Object context;
+    Napi::Function callback;
+    PyObject *pRet, *pDict, *main;
+    PyThreadState *substate, *previous;
+    PyRunWorker *wk;
+    ConvertOptions options;
+    PyLane lane;
+    PyMeter meter;
+    bool has_callback = false;
+
+    if (info.Length() < 1 || !info[0].IsString())
+    {
+        Napi::TypeError::New(env, "Please call with (code) and `code` should be of type String")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    code = info[0].As<Napi::String>();
+    context = Napi::Object::New(env);
+
+    if (info.Length() >= 2)
+    {
+        if (!info[1].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
         }
         context = info[1].As<Napi::Object>();
     }
 
-    module_name = info[0].As<Napi::String>();
+    if (info.Length() >= 3 && !info[2].IsUndefined() && !info[2].IsNull())
+    {
+        if (!info[2].IsFunction())
+        {
+            Napi::TypeError::New(env, "Argument `callback` should be an Function")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        has_callback = true;
+        callback = info[2].As<Napi::Function>();
+    }
 
-    // 以防大家不手动init python, 不管怎样都init一下
+    if (!parse_convert_options(env, info.Length() >= 4 ? info[3] : env.Undefined(), options) ||
+        !parse_lane_option(env, info.Length() >= 4 ? info[3] : env.Undefined(), lane))
+    {
+        return result;
+    }
+
+    // 以防Python没有初始化
+    __init_python(env);
+
+    substate = pycontext_get(context, "state");
+    main = substate != NULL ? (PyObject *)pycontext_get(context, "main") : py_main;
+
+    if (has_callback)
+    {
+        // PyRunWorker异步调用, 这里不拿GIL
+        if (!pyscheduler_admit(env, substate, lane))
+        {
+            return result;
+        }
+        wk = new PyRunWorker(callback, code.Utf8Value(), start, main, substate, options);
+        return Napi::Number::New(env, wk->Schedule(lane));
+    }
+
+    meter.Start(substate, ENTRY_RUN);
+    meter.Describe(code);
+    previous = EnterPython(substate);
+    meter.Mark(PHASE_GIL);
+    pDict = PyModule_GetDict(main);
+    pRet = PyRun_String(code.Utf8Value().c_str(), start, pDict, pDict);
+    meter.Mark(PHASE_EXEC);
+    if (pRet == NULL)
+    {
+        meter.Fail();
+        throw_pyexception_in_javascript(env, "python-ts._exec failed");
+        goto cleanup;
+    }
+
+    result = pyobject_to_napi_value(env, pRet, substate, options);
+    Py_XDECREF(pRet);
+    meter.Mark(PHASE_RESULT);
+
+cleanup:
+    LeavePython(previous);
+    return result;
+}
+
+/* 执行代码块
+_exec(code, context, callback, options)
+*/
+Napi::Value _exec(const Napi::CallbackInfo &info)
+{
+    return pyrun(info, Py_file_input);
+}
+
+/* 执行表达式并返回
+_eval(code, context, callback, options)
+*/
+Napi::Value _eval(const Napi::CallbackInfo &info)
+{
+    return pyrun(info, Py_eval_input);
+}
+
+/* 删除python对象
+_delete_pyobject(obj, context)
+参数
+    obj: {"type": PYOBJECT_WRAPPER, ...}
+    context: 上下文
+返回
+    成功则返回True，失败raise
+*/
+Napi::Boolean _delete_pyobject(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object obj, ref, context = Napi::Object::New(env);
+    Napi::Number index;
+    Napi::Boolean result = Napi::Boolean::New(env, false);
+    Napi::Array references = addon_data(env)->references.Value().As<Napi::Array>();
+    Napi::Object objects = addon_data(env)->objects.Value();
+    PyThreadState *substate, *previous;
+    PyObject *pObj;
+
+    if (info.Length() < 1 || !info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Please call with (obj, context?), obj must be an Object")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+    obj = info[0].As<Napi::Object>();
+
+    if (info.Length() >= 2)
+    {
+        if (!info[1].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        context = info[1].As<Napi::Object>();
+    }
+
+    if (!in_same_context(env, obj, context))
+    {
+        Napi::TypeError::New(env, "Cannot delete object from different context!")
+            .ThrowAsJavaScriptException();
+        return result;
+    }
+
+    // 防止Python未被初始化
     __init_python(env);
 
     substate = pycontext_get(context, "state");
-    if (substate != NULL)
+    previous = EnterPython(substate);
+
+    index = obj.Get("index").As<Napi::Number>();
+    if (uint32_t(index) < references.Length())
     {
-        PyEval_RestoreThread(substate);
+        ref = references.Get(index).As<Napi::Object>();
+        if (obj.Get("value").As<Napi::String>() == ref.Get("value").As<Napi::String>())
+        {
+            pObj = deserialize_pyobject(env, obj);
+            if (pObj != NULL && !defer_pyobject_release(pObj))
+            {
+                Py_DECREF(pObj);
+            }
+            references.Set(index, env.Null());
+            objects.Delete(obj.Get("value").As<Napi::String>());
+        }
     }
     else
     {
-        PyEval_RestoreThread(py_mainstate);
+        LeavePython(previous);
+        return result;
     }
 
-    // Python Code for reload
-    PyRun_SimpleString("import importlib");
-    sprintf(single_code, "importlib.reload(sys.modules['''%s'''])", module_name.Utf8Value().c_str());
-    ret = PyRun_SimpleString(single_code);
-    if (ret != 0)
+    LeavePython(previous);
+    return Napi::Boolean::New(env, true);
+}
+
+// 新建一个sub-interpreter, 返回它的context, 失败的时候抛JS错误并返回null
+Napi::Value __create_pycontext(const Napi::Env &env)
+{
+    Napi::Object context;
+    PyThreadState *substate, *oldstate, *previous;
+
+    __init_python(env);
+
+    previous = EnterPython(NULL);
+
+    oldstate = PyThreadState_Swap(NULL);
+    substate = Py_NewInterpreter();
+    if (substate == NULL)
     {
-        throw_pyexception_in_javascript(env, "python-ts._reload_module failed");
-        result = failed;
+        /* Since no new thread state was created, there is no exception to
+           propagate; raise a fresh one after swapping in the old thread
+           state. */
+        PyThreadState_Swap(oldstate);
+        PyErr_SetString(PyExc_RuntimeError, "Sub-Interpreter Creation Failed");
+        throw_pyexception_in_javascript(env, "python-ts._create_pycontext failed");
+        LeavePython(previous);
+        return env.Null();
     }
     else
     {
-        result = succeeded;
+        // 这里不太会不成功, 因为之前__init_python的时候已经调用成功了
+        __prepare_python_env(env, false);
+        smutex.lock();
+        pycontext_states[substate->interp] = substate;
+        smutex.unlock();
     }
+    // 这里我们不回收subinterpreter，而是把它添加到contexts中
+    context = serialize_pycontext(env, substate);
+
+    // 切回主解释器
+    PyThreadState_Swap(oldstate);
+
+    LeavePython(previous);
+    return context;
+}
+
+/* 创建python隔离上下文
+_create_pycontext()
+返回
+    PyThreadState对象的指针(64位)
+*/
+Napi::Value _create_pycontext(const Napi::CallbackInfo &info)
+{
+    return __create_pycontext(info.Env());
+}
 
+// 销毁sub-interpreter, 不能持有GIL; 调用者负责确认没有异步调用还在用它
+void __end_pycontext(PyThreadState *substate, PyObject *main)
+{
+    PyInterpreterState *interp;
+
+    drop_pyscheduler(substate);
+    drop_pymetrics(substate);
+
+    smutex.lock();
+    pycontext_states.erase(substate->interp);
+    smutex.unlock();
+
+    PyEval_RestoreThread(substate);
+    drop_pool_states(substate->interp, true);
+    drop_pycaches(substate, true);
+    drop_record_types(substate->interp, true);
+    drop_native_types(substate->interp, true);
+    Py_XDECREF(main);
+    interp = substate->interp;
+    Py_EndInterpreter(substate);
+    // Py_EndInterpreter以后当前没有PyThreadState, 换回主解释器再放开GIL
+    PyThreadState_Swap(thread_main_state());
+    drop_pymem_slots(interp);
     PyEval_SaveThread();
-    return result;
 }
 
-/* 调用模块下的函数
-_call_python(object, attr, args, kwargs, context, callback)
+/* 删除pycontext
+_delete_pycontext(context)
 参数
-    object: Python对象, {"type": PYOBJECT_WRAPPER, "value": 0x12341234}
-    attr: 函数/类名称, "string"
-    args: 参数列表array, 可选，默认为[]
-    kwargs: 参数字典array, 可选，默认为{}
-    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
-    callback: 如果提供callback函数，则用AsyncWorker异步回调返回，否则同步返回
-返回值
-    如果可以dump成json的话, python dump一下再parse_json一下，最终返回一个Object
-    如果不行的话, 返回{"type": PYOBJECT_WRAPPER, "value": PyObject指针地址}
-错误处理
-    如果出错, traceback.format_exc将会被napi_throw_error出来
+    context: uintptr_t的string
+返回
+    成功则返回true
+    失败则throw相应的错误
 */
-Napi::Value _call_python(const Napi::CallbackInfo &info)
+Napi::Boolean _delete_pycontext(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
-    Napi::String attr;
-    Napi::Array args, keys;
-    Napi::Object object, kwargs, context;
-    Napi::Value result = env.Null();
-    Napi::Function callback;
-    PyObject *pObject, *pCallable, *pRet, *pArgs_, *pArgs, *pKwargs;
+    Napi::Object context;
+    Napi::Array contexts = addon_data(env)->contexts.Value().As<Napi::Array>();
+    Napi::Object objects = addon_data(env)->objects.Value();
     PyThreadState *substate;
-    PyCallWorker *wk;
-    bool has_callback = false;
+    PyObject *main;
+    uint32_t index;
 
-    // 初始化参数
-    if (info.Length() < 2)
-    {
-        Napi::TypeError::New(
-            env,
-            "Please call with (object, attr, args?=[], kwargs?={}, context?={}, callback?=()=>{})")
-            .ThrowAsJavaScriptException();
-        return result;
-    }
-    if (!info[0].IsObject())
-    {
-        Napi::TypeError::New(env, "Argument `module` should be an Object")
-            .ThrowAsJavaScriptException();
-        return result;
-    }
-    if (!info[1].IsString())
+    if (info.Length() < 1 || !info[0].IsObject())
     {
-        Napi::TypeError::New(env, "Argument `attr` should be a String")
-            .ThrowAsJavaScriptException();
-        return result;
+        Napi::TypeError::New(env, "Argument `context` is required, it must be a string").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
     }
 
-    object = info[0].As<Napi::Object>();
-    attr = info[1].As<Napi::String>();
-    args = Napi::Array::New(env);
-    kwargs = Napi::Object::New(env);
-    context = Napi::Object::New(env);
+    context = info[0].As<Napi::Object>();
 
-    if (info.Length() >= 3)
+    if (gil_session > 0)
     {
-        if (!info[2].IsArray())
-        {
-            Napi::TypeError::New(env, "Argument `args` should be an Array")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        args = info[2].As<Napi::Array>();
+        // 会话拿着的可能正是这个解释器的PyThreadState, 不能在会话中途把它销毁
+        Napi::Error::New(env, "Cannot delete context inside `withGIL`").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
     }
 
-    if (info.Length() >= 4)
-    {
-        if (!info[3].IsObject())
-        {
-            Napi::TypeError::New(env, "Argument `kwargs` should be an Object")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        kwargs = info[3].As<Napi::Object>();
-    }
+    // 以防Python未被初始化
+    __init_python(env);
 
-    if (info.Length() >= 5)
-    {
-        if (!info[4].IsObject())
-        {
-            Napi::TypeError::New(env, "Argument `context` should be an Object")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        context = info[4].As<Napi::Object>();
-    }
+    substate = pycontext_get(context, "state");
+    main = (PyObject *)pycontext_get(context, "main");
 
-    if (info.Length() >= 6)
+    if (!is_pycontext(context) || substate == NULL || main == NULL)
     {
-        if (!info[5].IsFunction())
-        {
-            Napi::TypeError::New(env, "Argument `callback` should be an Function")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        has_callback = true;
-        callback = info[5].As<Napi::Function>();
+        Napi::TypeError::New(env, "Invalid context").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
     }
-    // 参数初始化完毕 T.T
-
-    pObject = deserialize_pyobject(env, object);
-    if (pObject == NULL)
+    if (substate == addon_data(env)->worker_state)
     {
-        Napi::TypeError::New(env, "Argument `object` should be a <python-ts/PyObject*> object or `object` recycled!")
-            .ThrowAsJavaScriptException();
-        return result;
+        Napi::Error::New(env, "Cannot delete the context bound to a worker thread").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
     }
 
-    if ((object.Get("state") != context.Get("state") && !in_same_context(env, object, context)) || (args.Length() > 0 && !in_same_context(env, args, context)) || (!napi_object_is_empty(env, kwargs) && !in_same_context(env, kwargs, context)))
+    if (get_pyscheduler(substate).running > 0 || pyscheduler_queued(get_pyscheduler(substate)) > 0 ||
+        get_pyscheduler(substate).unfinished.load() > 0)
     {
-        Napi::TypeError::New(env, "Cannot call object/args/kwargs from different context!")
-            .ThrowAsJavaScriptException();
-        return result;
+        // 还有异步调用在这个解释器上跑或者排队, 或者取消的调用还没收尾
+        Napi::Error::New(env, "Cannot delete context while async calls are pending").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
     }
+    __end_pycontext(substate, main);
 
-    // 以防Python没有初始化
-    __init_python(env);
+    // 干掉contexts中的值
+    index = context.Get("index").As<Napi::Number>();
+    contexts.Set(index, env.Null());
+    objects.Delete(context.Get("state").As<Napi::String>());
 
-    substate = pycontext_get(context, "state");
-    if (substate != NULL)
-    {
-        PyEval_RestoreThread(substate);
-    }
-    else
+    return Napi::Boolean::New(env, true);
+}
+
+/* 把当前的worker_threads绑定到它自己的sub-interpreter上
+_bind_worker()
+返回
+    这个worker的默认context, 多次调用返回同一个; 没有传context的调用都在这个解释器上执行
+注意
+    主线程不需要调用; worker退出的时候自动销毁这个解释器
+*/
+Napi::Value _bind_worker(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    AddonData *data = addon_data(env);
+    Napi::Value context;
+
+    if (!data->worker_context.IsEmpty())
     {
-        PyEval_RestoreThread(py_mainstate);
+        return data->worker_context.Value();
     }
 
-    // 构造Python对象pArgs和pKwargs
-    if (args.Length() == 0)
+    __init_python(env);
+    context = __create_pycontext(env);
+    if (!context.IsObject())
     {
-        pArgs = PyList_New(0);
+        return context;
     }
-    else
+    data->worker_context = Napi::Persistent(context.As<Napi::Object>());
+    data->worker_state = pycontext_get(context.As<Napi::Object>(), "state");
+    data->worker_main = (PyObject *)pycontext_get(context.As<Napi::Object>(), "main");
+    bound_workers++;
+    return context;
+}
+
+/* JS环境销毁的时候调用(主线程退出或者worker退出), 在这个环境的JS线程上
+还在排队的调用直接丢掉; libuv线程上还有调用在用worker的解释器的话, 由最后跑完的那个调用去销毁它,
+在那之前bound_workers不减, _destroy_python会拒绝执行
+*/
+void release_addon_data(Napi::Env env, AddonData *data)
+{
+    PyScheduledWorker *worker;
+    int i;
+
+    if (data->worker_state != NULL && py_program)
     {
-        pArgs_ = napi_value_to_pyobject(env, args);
-        if (pArgs_ == NULL)
+        PyScheduler &scheduler = get_pyscheduler(data->worker_state);
+        for (i = 0; i < LANE_COUNT; i++)
         {
-            Napi::TypeError::New(env, "Argument `args` can not be converted to python list")
-                .ThrowAsJavaScriptException();
-            goto cleanup;
+            while (!scheduler.lanes[i].empty())
+            {
+                worker = scheduler.lanes[i].front();
+                scheduler.lanes[i].pop_front();
+                worker->Drop();
+                delete worker;
+            }
         }
-        else
+        scheduler.orphan_main = data->worker_main;
+        scheduler.orphaned = true;
+        if (scheduler.unfinished.load() == 0 && !scheduler.ended.exchange(true))
         {
-            pArgs = PyList_AsTuple(pArgs_);
-            Py_XDECREF(pArgs_);
+            __end_pycontext(data->worker_state, data->worker_main);
+            bound_workers--;
         }
-    }
-
-    if (napi_object_is_empty(env, kwargs))
-    {
-        pKwargs = PyDict_New();
-    }
-    else
-    {
-        pKwargs = napi_value_to_pyobject(env, kwargs);
-        if (pKwargs == NULL)
+        else if (debug)
         {
-            Napi::TypeError::New(env, "Argument `kwargs` can not be converted to python dict")
-                .ThrowAsJavaScriptException();
-            goto cleanup;
+            printf("python-ts: worker exited with pending async calls, its sub-interpreter is destroyed when they finish\n");
         }
     }
-
-    // 调用Python的函数
-    pCallable = PyObject_GetAttrString(pObject, attr.Utf8Value().c_str());
-    if (pCallable == NULL)
+    if (thread_mainstate != NULL && py_program)
     {
-        throw_pyexception_in_javascript(env, "python-ts._call_python failed");
-        goto cleanup;
+        PyEval_RestoreThread(thread_mainstate);
+        PyThreadState_Clear(thread_mainstate);
+        PyThreadState_DeleteCurrent();
+        thread_mainstate = NULL;
     }
+    delete data;
+}
 
-    // 真正地执行调用
-    if (has_callback)
+/* 取消一个还没完成的异步调用, 它的callback会马上收到'python-ts'开头的错误信息
+_cancel(id, timeout)
+参数
+    id: 异步调用返回的id
+    timeout: true表示是超时, 往Python里抛TimeoutError, 否则抛KeyboardInterrupt
+返回
+    true代表取消成功, false代表这个调用已经完成或者已经被取消了
+注意
+    还在排队的调用直接丢掉, 不会执行; 正在执行的调用要等Python回到字节码才会收到异常,
+    卡在time.sleep之类的C函数里的话, 要等它返回, 在这之前它还占着并发的名额
+*/
+Napi::Value _cancel(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    std::map<uint32_t, PyScheduledWorker *> &pytasks = addon_data(env)->pytasks;
+    std::map<uint32_t, PyScheduledWorker *>::iterator it;
+    PyScheduledWorker *wk;
+    bool timeout;
+
+    if (info.Length() < 1 || !info[0].IsNumber())
     {
-        // PyCallWorker异步调用
-        wk = new PyCallWorker(callback, pCallable, pArgs, pKwargs, substate);
-        wk->Queue();
-        goto cleanup;
+        Napi::TypeError::New(env, "Please call with (id, timeout?), id should be a Number").ThrowAsJavaScriptException();
+        return env.Null();
     }
-
-    pRet = PyObject_Call(pCallable, pArgs, pKwargs);
-    Py_DECREF(pCallable);
-    Py_XDECREF(pArgs);
-    Py_XDECREF(pKwargs);
-    if (pRet == NULL)
+    timeout = info.Length() >= 2 && info[1].ToBoolean().Value();
+    it = pytasks.find(info[0].As<Napi::Number>().Uint32Value());
+    if (it == pytasks.end())
     {
-        throw_pyexception_in_javascript(env, "python-ts._call_python failed");
-        goto cleanup;
+        return Napi::Boolean::New(env, false);
     }
-
-    result = pyobject_to_napi_value(env, pRet, substate);
-    Py_DECREF(pRet);
-
-cleanup:
-    PyEval_SaveThread();
-    return result;
+    wk = it->second;
+    pytasks.erase(it);
+    wk->Cancel(timeout ? "python-ts.Timeout: deadline exceeded" : "python-ts.Cancelled: call was aborted",
+               timeout ? PyExc_TimeoutError : PyExc_KeyboardInterrupt);
+    return Napi::Boolean::New(env, true);
 }
 
-/* 列表pyobject的可用方法
-_dir(object, context)
+/* 给object.attr开启/关闭结果缓存, 只适合没有副作用的纯函数
+_set_cache(object, attr, options, context)
 参数
-    object, serialize以后的PyObject*
-    context, 上下文
+    object: Python对象, {"type": PYOBJECT_WRAPPER, "value": 0x12341234}
+    attr: 方法名
+    options: {ttl_ms?: number, max_entries?: number, max_bytes?: number}, 0表示不限制; null表示关闭并清空缓存
+             已经开启的话只更新限制, 已有的结果保留
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
 返回
-    [[attr1, is_method, value], [attr2, is_method, value], ...]
+    true
 */
-Napi::Array _dir(const Napi::CallbackInfo &info)
+Napi::Value _set_cache(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
-    Napi::Array result = Napi::Array::New(env), names, row;
-    Napi::Object context = Napi::Object::New(env), object;
-    PyObject *pObject, *dir, *pItem, *pAttr;
-    PyThreadState *substate;
-    std::string name;
-    uint32_t i, j, is_method;
-
-    if (info.Length() < 1 || !info[0].IsObject())
+    Napi::Object options, context;
+    PyObject *pObject;
+    PyThreadState *substate, *previous;
+    PyCache *cache;
+    std::string attr;
+    double ttl_ms = -1, max_entries = -1, max_bytes = -1;
+
+    if (info.Length() < 3 || !info[0].IsObject() || !info[1].IsString() ||
+        !(info[2].IsObject() || info[2].IsNull()))
     {
-        Napi::TypeError::New(env, "Please call with (object) and `object` should be of type Object")
+        Napi::TypeError::New(env, "Please call with (object, attr, options | null, context?)")
             .ThrowAsJavaScriptException();
-        return result;
-    }
-    object = info[0].As<Napi::Object>();
-
-    if (info.Length() >= 2)
-    {
-        if (!info[1].IsObject())
-        {
-            Napi::TypeError::New(env, "Argument `context` should be an Object")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        context = info[1].As<Napi::Object>();
+        return env.Null();
     }
-
-    pObject = deserialize_pyobject(env, object);
+    pObject = deserialize_pyobject(env, info[0].As<Napi::Object>());
     if (pObject == NULL)
     {
-        Napi::TypeError::New(env, "Argument `object` should be a python-ts/PyObject* Object or `object` recycled!")
+        Napi::TypeError::New(env, "Argument `object` should be a <python-ts/PyObject*> object or `object` recycled!")
             .ThrowAsJavaScriptException();
-        return result;
+        return env.Null();
     }
+    attr = info[1].As<Napi::String>().Utf8Value();
+    context = info.Length() >= 4 && info[3].IsObject() ? info[3].As<Napi::Object>() : Napi::Object::New(env);
+    substate = pycontext_get(context, "state");
+    cache = find_pycache(pObject, attr);
 
-    if (object.Get("state") != context.Get("state") && !in_same_context(env, object, context))
+    if (info[2].IsNull())
     {
-        Napi::TypeError::New(env, "Cannot dir object from different context!")
-            .ThrowAsJavaScriptException();
-        return result;
+        if (cache != NULL)
+        {
+            previous = EnterPython(substate);
+            Py_DECREF(pObject);
+            LeavePython(previous);
+            pycache_mutex.lock();
+            pycaches.erase(std::make_pair(pObject, attr));
+            pycache_count = pycaches.size();
+            pycache_mutex.unlock();
+        }
+        return Napi::Boolean::New(env, true);
     }
 
-    // 防止python环境未初始化
-    __init_python(env);
-
-    substate = pycontext_get(context, "state");
-    if (substate != NULL)
-    {
-        PyEval_RestoreThread(substate);
-    }
-    else
+    // 先读完options(getter可能执行JS), 再拿着锁一起更新
+    options = info[2].As<Napi::Object>();
+    if (options.Get("ttl_ms").IsNumber())
+        ttl_ms = std::max(0.0, options.Get("ttl_ms").As<Napi::Number>().DoubleValue());
+    if (options.Get("max_entries").IsNumber())
+        max_entries = (double)std::max<int64_t>(0, options.Get("max_entries").As<Napi::Number>().Int64Value());
+    if (options.Get("max_bytes").IsNumber())
+        max_bytes = (double)std::max<int64_t>(0, options.Get("max_bytes").As<Napi::Number>().Int64Value());
+
+    cache = find_pycache(pObject, attr);
+    if (cache == NULL)
     {
-        PyEval_RestoreThread(py_mainstate);
+        previous = EnterPython(substate);
+        Py_INCREF(pObject);
+        LeavePython(previous);
     }
 
-    dir = PyObject_Dir(pObject);
-    if (dir == NULL)
+    pycache_mutex.lock();
+    cache = &pycaches[std::make_pair(pObject, attr)];
+    pycache_count = pycaches.size();
+    cache->state = substate;
+    if (ttl_ms >= 0)
+        cache->ttl_ms = ttl_ms;
+    if (max_entries >= 0)
+        cache->max_entries = (size_t)max_entries;
+    if (max_bytes >= 0)
+        cache->max_bytes = (size_t)max_bytes;
+    pycache_mutex.unlock();
+    return Napi::Boolean::New(env, true);
+}
+
+/* 查看object.attr的缓存状态
+_cache_stats(object, attr)
+返回
+    {entries, bytes, hits, misses, evictions}, 没有开启缓存的话返回null
+*/
+Napi::Value _cache_stats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object result;
+    PyObject *pObject;
+    PyCache *cache;
+
+    if (info.Length() < 2 || !info[0].IsObject() || !info[1].IsString())
     {
-        throw_pyexception_in_javascript(env, "python-ts._dir failed");
-        goto cleanup;
+        Napi::TypeError::New(env, "Please call with (object, attr)").ThrowAsJavaScriptException();
+        return env.Null();
     }
-
-    names = pyobject_to_napi_value(env, dir, substate).As<Napi::Array>();
-    j = 0;
-    for (i = 0; i < names.Length(); i++)
+    pObject = deserialize_pyobject(env, info[0].As<Napi::Object>());
+    cache = pObject == NULL ? NULL : find_pycache(pObject, info[1].As<Napi::String>().Utf8Value());
+    if (cache == NULL)
     {
-        row = Napi::Array::New(env);
-        name = names.Get(i).As<Napi::String>().Utf8Value();
-        if (name == "__builtins__" || name == "__loader__" || name == "__spec__")
-        {
-            continue;
-        }
-        row.Set((uint32_t)0, names.Get(i));
-        pItem = PyList_GetItem(dir, i);
-        pAttr = PyObject_GetAttr(pObject, pItem);
-        is_method = (uint32_t)PyCallable_Check(pAttr);
-        row.Set((uint32_t)1, is_method);
-        if (is_method)
-        {
-            row.Set((uint32_t)2, env.Null());
-        }
-        else
-        {
-            row.Set((uint32_t)2, pyobject_to_napi_value(env, pAttr, substate));
-        }
-        Py_XDECREF(pAttr);
-        result.Set(j, row);
-        j += 1;
+        return env.Null();
     }
-
-    Py_XDECREF(dir);
-
-cleanup:
-    PyEval_SaveThread();
+    result = Napi::Object::New(env);
+    result.Set("entries", (double)cache->entries.size());
+    result.Set("bytes", (double)cache->bytes);
+    result.Set("hits", cache->hits);
+    result.Set("misses", cache->misses);
+    result.Set("evictions", cache->evictions);
     return result;
 }
 
-/* _exec/_eval的实际执行函数
-_exec(code, context, callback)
-_eval(code, context, callback)
-核心代码 =>
-    pRet = PyRun_String(code.Utf8Value().c_str(), start, pDict, pDict);
+/* 设置context的异步调度参数
+_set_scheduler(context, options)
+参数
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则设置全局context
+    options: {max_concurrency?: number, max_queue?: number}, 0表示不限制, 不提供的保持原样
+返回
+    true
 */
-Napi::Value pyrun(const Napi::CallbackInfo &info, int start)
+Napi::Value _set_scheduler(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
-    Napi::Value result = env.Null();
-    Napi::String code;
-    Napi::Object context;
-    Napi::Function callback;
-    PyObject *pRet, *pDict, *main;
+    Napi::Object options;
     PyThreadState *substate;
-    PyRunWorker *wk;
-    bool has_callback = false;
 
-    if (info.Length() < 1 || !info[0].IsString())
+    if (info.Length() < 2 || !info[0].IsObject() || !info[1].IsObject())
     {
-        Napi::TypeError::New(env, "Please call with (code) and `code` should be of type String")
+        Napi::TypeError::New(env, "Please call with (context, options), both should be Objects")
             .ThrowAsJavaScriptException();
-        return result;
+        return env.Null();
     }
-    code = info[0].As<Napi::String>();
-    context = Napi::Object::New(env);
+    substate = pycontext_get(info[0].As<Napi::Object>(), "state");
+    options = info[1].As<Napi::Object>();
+    PyScheduler &scheduler = get_pyscheduler(substate);
+
+    if (options.Get("max_concurrency").IsNumber())
+        scheduler.max_concurrency = (size_t)std::max<int64_t>(0, options.Get("max_concurrency").As<Napi::Number>().Int64Value());
+    if (options.Get("max_queue").IsNumber())
+        scheduler.max_queue = (size_t)std::max<int64_t>(0, options.Get("max_queue").As<Napi::Number>().Int64Value());
+    return Napi::Boolean::New(env, true);
+}
 
-    if (info.Length() >= 2)
+/* 查看context的调度状态
+_scheduler_stats(context)
+返回
+    {max_concurrency, max_queue, running, queued,
+     lanes: {interactive: {queued, submitted, rejected, completed, cancelled, wait_ms, wait_max_ms, exec_ms, exec_max_ms}, normal, background}}
+    wait_ms/exec_ms是累计值, 除以completed就是平均值
+*/
+Napi::Value _scheduler_stats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object result = Napi::Object::New(env), lanes = Napi::Object::New(env), lane;
+    PyThreadState *substate = NULL;
+    int i;
+
+    if (info.Length() >= 1 && info[0].IsObject())
     {
-        if (!info[1].IsObject())
-        {
-            Napi::TypeError::New(env, "Argument `context` should be an Object")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        context = info[1].As<Napi::Object>();
+        substate = pycontext_get(info[0].As<Napi::Object>(), "state");
     }
+    PyScheduler &scheduler = get_pyscheduler(substate);
 
-    if (info.Length() >= 3)
+    result.Set("max_concurrency", (double)scheduler.max_concurrency);
+    result.Set("max_queue", (double)scheduler.max_queue);
+    result.Set("running", (double)scheduler.running);
+    result.Set("queued", (double)pyscheduler_queued(scheduler));
+    for (i = 0; i < LANE_COUNT; i++)
     {
-        if (!info[2].IsFunction())
-        {
-            Napi::TypeError::New(env, "Argument `callback` should be an Function")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        has_callback = true;
-        callback = info[2].As<Napi::Function>();
+        lane = Napi::Object::New(env);
+        lane.Set("queued", (double)scheduler.lanes[i].size());
+        lane.Set("submitted", scheduler.stats[i].submitted);
+        lane.Set("rejected", scheduler.stats[i].rejected);
+        lane.Set("completed", scheduler.stats[i].completed);
+        lane.Set("cancelled", scheduler.stats[i].cancelled);
+        lane.Set("wait_ms", scheduler.stats[i].wait_ms);
+        lane.Set("wait_max_ms", scheduler.stats[i].wait_max_ms);
+        lane.Set("exec_ms", scheduler.stats[i].exec_ms);
+        lane.Set("exec_max_ms", scheduler.stats[i].exec_max_ms);
+        lanes.Set(LANE_NAMES[i], lane);
     }
+    result.Set("lanes", lanes);
+    return result;
+}
 
-    // 以防Python没有初始化
-    __init_python(env);
+/* 运行时指标
+_stats(context?, reset?)
+参数
+    context: 上下文引用, 不传(或者传null)的话返回所有context的
+    reset: 为true的时候读完清零
+返回
+    {call: {calls, errors, phases: {args, gil, exec, result}}, run, dir, import, pipeline, batch}
+    每个阶段是{count, sum_ms, max_ms, p50_ms, p90_ms, p99_ms, buckets: [[上界ms, 个数], ...]}
+    不传context的时候是{main: 上面的结构, <state>: 上面的结构, ...}, key是context的state, 全局Context是main
+*/
+Napi::Value _stats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Object result = Napi::Object::New(env);
+    std::map<PyThreadState *, PyMetrics>::iterator it;
+    PyThreadState *substate;
+    bool reset = info.Length() >= 2 && info[1].ToBoolean();
 
-    substate = pycontext_get(context, "state");
-    if (substate != NULL)
-    {
-        PyEval_RestoreThread(substate);
-        main = (PyObject *)pycontext_get(context, "main");
-        pDict = PyModule_GetDict(main);
-    }
-    else
+    if (info.Length() >= 1 && info[0].IsObject())
     {
-        PyEval_RestoreThread(py_mainstate);
-        pDict = PyModule_GetDict(py_main);
+        substate = pycontext_get(info[0].As<Napi::Object>(), "state");
+        std::lock_guard<std::mutex> lock(smutex);
+        return pymetrics_snapshot(env, pymetrics[substate], reset);
     }
 
-    if (has_callback)
-    {
-        // PyRunWorker异步调用
-        wk = new PyRunWorker(callback, code.Utf8Value().c_str(), start, pDict, pDict, substate);
-        wk->Queue();
-        goto cleanup;
-    }
-    pRet = PyRun_String(code.Utf8Value().c_str(), start, pDict, pDict);
-    if (pRet == NULL)
+    std::lock_guard<std::mutex> lock(smutex);
+    for (it = pymetrics.begin(); it != pymetrics.end(); it++)
     {
-        throw_pyexception_in_javascript(env, "python-ts._exec failed");
-        goto cleanup;
+        result.Set(it->first == NULL ? "main" : uintptr_to_str((uintptr_t)it->first),
+                   pymetrics_snapshot(env, it->second, reset));
     }
-
-    result = pyobject_to_napi_value(env, pRet, substate);
-    Py_XDECREF(pRet);
-
-cleanup:
-    PyEval_SaveThread();
     return result;
 }
 
-/* 执行代码块
-_exec(code, context, callback)
+/* 打开按context的内存统计, 必须在Python初始化之前调用
+_enable_memory_accounting()
+返回
+    是否打开了, free-threaded的Python不支持, 返回false; 已经打开的再调用也返回true
 */
-Napi::Value _exec(const Napi::CallbackInfo &info)
+Napi::Value _enable_memory_accounting(const Napi::CallbackInfo &info)
 {
-    return pyrun(info, Py_file_input);
+    Napi::Env env = info.Env();
+    if (!pymem_accounting && Py_IsInitialized())
+    {
+        Napi::Error::New(env, "Memory accounting must be enabled before Python is initialized").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    return Napi::Boolean::New(env, install_pymem_hooks());
 }
 
-/* 执行表达式并返回
-_eval(code, context, callback)
-*/
-Napi::Value _eval(const Napi::CallbackInfo &info)
+// 一个context的内存统计, state为NULL的是全局的
+Napi::Object pymem_snapshot(const Napi::Env &env, PyThreadState *state)
 {
-    return pyrun(info, Py_eval_input);
+    Napi::Object result = Napi::Object::New(env), item;
+    Napi::Array references = addon_data(env)->references.Value().As<Napi::Array>();
+    Napi::Value expected = state == NULL ? env.Undefined() : Napi::String::New(env, uintptr_to_str((uintptr_t)state));
+    PyInterpreterState *interp = state == NULL ? py_mainstate->interp : state->interp;
+    uint32_t slot = pymem_accounting ? pymem_slot_of(interp, false) : 0;
+    uint32_t i, handles = 0;
+
+    for (i = 0; i < references.Length(); i++)
+    {
+        // 已经回收的是null
+        if (references.Get(i).IsObject())
+        {
+            item = references.Get(i).As<Napi::Object>();
+            handles += item.Get("state").StrictEquals(expected) ? 1 : 0;
+        }
+    }
+    result.Set("enabled", pymem_accounting.load());
+    result.Set("live_bytes", (double)(slot == 0 ? 0 : pymem_slots[slot].live.load()));
+    result.Set("peak_bytes", (double)(slot == 0 ? 0 : pymem_slots[slot].peak.load()));
+    result.Set("blocks", (double)(slot == 0 ? 0 : pymem_slots[slot].blocks.load()));
+    result.Set("limit_bytes", (double)(slot == 0 ? 0 : pymem_slots[slot].limit.load()));
+    result.Set("denied", (double)(slot == 0 ? 0 : pymem_slots[slot].denied.load()));
+    result.Set("handles", handles);
+    return result;
 }
 
-/* 删除python对象
-_delete_pyobject(obj, context)
+/* 按context读内存统计
+_memory(context?)
 参数
-    obj: {"type": PYOBJECT_WRAPPER, ...}
-    context: 上下文
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}; 不提供的话返回所有context的, {main: ..., <state>: ...}
 返回
-    成功则返回True，失败raise
+    {enabled, live_bytes, peak_bytes, blocks, limit_bytes, denied, handles}
+    live_bytes/blocks是这个解释器分配了还没释放的内存和块数, 每个线程最多有64KB还没加进来;
+    denied是因为超过上限被拒绝的分配次数; handles是JS这边还拿着的PyWrapper个数
+    没有打开_enable_memory_accounting的时候只有handles
 */
-Napi::Boolean _delete_pyobject(const Napi::CallbackInfo &info)
+Napi::Value _memory(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
-    Napi::Object obj, ref, context = Napi::Object::New(env);
-    Napi::Number index;
-    Napi::Boolean result = Napi::Boolean::New(env, false);
-    Napi::Array references = env.Global().Get(REFERENCES).As<Napi::Array>();
-    Napi::Object objects = env.Global().Get(OBJECTS).As<Napi::Object>();
-    PyThreadState *substate;
+    Napi::Object result = Napi::Object::New(env);
+    std::map<PyInterpreterState *, PyThreadState *>::iterator it;
+    std::map<PyInterpreterState *, PyThreadState *> states;
 
-    if (info.Length() < 1 || !info[0].IsObject())
+    __init_python(env);
+    pymem_flush(); // JS线程自己攒下的
+    if (info.Length() >= 1 && info[0].IsObject())
     {
-        Napi::TypeError::New(env, "Please call with (obj, context?), obj must be an Object")
-            .ThrowAsJavaScriptException();
-        return result;
+        return pymem_snapshot(env, pycontext_get(info[0].As<Napi::Object>(), "state"));
     }
-    obj = info[0].As<Napi::Object>();
 
-    if (info.Length() >= 2)
+    smutex.lock();
+    states = pycontext_states;
+    smutex.unlock();
+    result.Set("main", pymem_snapshot(env, NULL));
+    for (it = states.begin(); it != states.end(); it++)
     {
-        if (!info[1].IsObject())
-        {
-            Napi::TypeError::New(env, "Argument `context` should be an Object")
-                .ThrowAsJavaScriptException();
-            return result;
-        }
-        context = info[1].As<Napi::Object>();
+        result.Set(uintptr_to_str((uintptr_t)it->second), pymem_snapshot(env, it->second));
     }
+    return result;
+}
 
-    if (!in_same_context(env, obj, context))
+/* 设置context的内存上限, 超过以后这个context里的分配会失败, Python里抛MemoryError
+_set_memory_limit(limit_bytes, context?)
+参数
+    limit_bytes: 0表示不限制
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则是全局的
+注意
+    上限是软的: 已经超过的不会回收, 只是之后的分配都失败; 每个线程攒着的计数最多让实际用量超出64KB
+*/
+Napi::Value _set_memory_limit(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    PyThreadState *substate = NULL, *previous;
+    uint32_t slot;
+
+    if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Napi::Number>().DoubleValue() < 0)
     {
-        Napi::TypeError::New(env, "Cannot delete object from different context!")
+        Napi::TypeError::New(env, "Please call with (limit_bytes, context?) and `limit_bytes` should be a non-negative Number")
             .ThrowAsJavaScriptException();
-        return result;
+        return env.Undefined();
+    }
+    if (!pymem_accounting)
+    {
+        Napi::Error::New(env, "Memory accounting is not enabled").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    if (info.Length() >= 2 && info[1].IsObject())
+    {
+        substate = pycontext_get(info[1].As<Napi::Object>(), "state");
     }
 
-    // 防止Python未被初始化
-    __init_python(env);
-
-    substate = pycontext_get(context, "state");
-    if (substate != NULL)
+    // 拿着GIL占slot, 免得跟分配的线程抢
+    previous = EnterPython(substate);
+    slot = pymem_current_slot();
+    LeavePython(previous);
+    if (slot == 0)
     {
-        PyEval_RestoreThread(substate);
+        Napi::Error::New(env, "Too many contexts for memory accounting").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
-    else
+    pymem_slots[slot].limit = (int64_t)info[0].As<Napi::Number>().DoubleValue();
+    return env.Undefined();
+}
+
+/* 开始追踪, 之前记下的事件全部清掉
+_trace_start()
+*/
+Napi::Value _trace_start(const Napi::CallbackInfo &info)
+{
+    size_t i;
+    trace_mutex.lock();
+    for (i = 0; i < trace_buffers.size(); i++)
     {
-        PyEval_RestoreThread(py_mainstate);
+        trace_buffers[i]->head.store(0, std::memory_order_relaxed);
     }
+    trace_mutex.unlock();
+    tracing = true;
+    return info.Env().Undefined();
+}
 
-    index = obj.Get("index").As<Napi::Number>();
-    if (uint32_t(index) < references.Length())
+/* 停止追踪, 已经记下的事件还可以导出
+_trace_stop()
+*/
+Napi::Value _trace_stop(const Napi::CallbackInfo &info)
+{
+    tracing = false;
+    return info.Env().Undefined();
+}
+
+/* 导出追踪到的事件
+_trace_dump()
+返回
+    Chrome trace-event格式的JSON字符串, {traceEvents: [{name, cat, ph: 'X', ts, dur, pid, tid}, ...]}, 时间单位是微秒
+注意
+    追踪还开着的时候导出, 每个线程最旧的几个事件可能正在被覆盖, 最好先_trace_stop
+*/
+Napi::Value _trace_dump(const Napi::CallbackInfo &info)
+{
+    std::ostringstream out;
+    TraceBuffer *buffer;
+    TraceEvent *event;
+    uint64_t head, first, j;
+    size_t i;
+    bool comma = false;
+
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    trace_mutex.lock();
+    for (i = 0; i < trace_buffers.size(); i++)
     {
-        ref = references.Get(index).As<Napi::Object>();
-        if (obj.Get("value").As<Napi::String>() == ref.Get("value").As<Napi::String>())
+        buffer = trace_buffers[i];
+        out << (comma ? "," : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << (buffer->main ? "main" : "thread") << " " << buffer->tid << "\"}}";
+        comma = true;
+        head = buffer->head.load(std::memory_order_acquire);
+        first = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+        for (j = first; j < head; j++)
         {
-            Py_XDECREF(deserialize_pyobject(env, obj));
-            references.Set(index, env.Null());
-            objects.Delete(obj.Get("value").As<Napi::String>());
+            event = &buffer->events[j % TRACE_CAPACITY];
+            out << ",{\"name\":\"" << event->name << "\",\"cat\":\"" << event->cat << "\",\"ph\":\"X\",\"ts\":"
+                << event->start_ns / 1000.0 << ",\"dur\":" << event->dur_ns / 1000.0 << ",\"pid\":1,\"tid\":"
+                << buffer->tid << "}";
         }
     }
-    else
+    trace_mutex.unlock();
+    out << "]}";
+    return Napi::String::New(info.Env(), out.str());
+}
+
+/* 设置同步调用的卡顿阈值
+_set_watchdog(threshold_ms)
+参数
+    threshold_ms: 同步调用超过这么多毫秒就记一个卡顿事件, 0表示关闭
+*/
+Napi::Value _set_watchdog(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Napi::Number>().DoubleValue() < 0)
     {
-        PyEval_SaveThread();
-        return result;
+        Napi::TypeError::New(env, "Please call with (threshold_ms) and `threshold_ms` should be a non-negative Number")
+            .ThrowAsJavaScriptException();
+        return env.Undefined();
     }
-
-    PyEval_SaveThread();
-    return Napi::Boolean::New(env, true);
+    start_watchdog(info[0].As<Napi::Number>().DoubleValue());
+    return env.Undefined();
 }
 
-/* 创建python隔离上下文
-_create_pycontext()
+/* 取走记下的卡顿事件
+_stalls()
 返回
-    PyThreadState对象的指针(64位)
+    {count, events: [{entry, detail, time, duration_ms, gil_wait_ms, gil_wait_share, sampled, stack}, ...]}
+    count是开始以来的总数(包括被丢掉的), stack是watchdog看到的Python调用栈, 最里面的在前;
+    sampled为false表示调用在watchdog来得及看之前就结束了, 没有栈
 */
-Napi::Value _create_pycontext(const Napi::CallbackInfo &info)
+Napi::Value _stalls(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
-    Napi::Object context;
-    PyThreadState *substate, *oldstate;
-
-    __init_python(env);
+    Napi::Object result = Napi::Object::New(env), item;
+    Napi::Array events = Napi::Array::New(env), stack;
+    std::deque<StallEvent> taken;
+    size_t i, j;
 
-    PyEval_RestoreThread(py_mainstate);
+    watchdog_mutex.lock();
+    taken.swap(stall_events);
+    watchdog_mutex.unlock();
 
-    oldstate = PyThreadState_Swap(NULL);
-    substate = Py_NewInterpreter();
-    if (substate == NULL)
+    for (i = 0; i < taken.size(); i++)
     {
-        /* Since no new thread state was created, there is no exception to
-           propagate; raise a fresh one after swapping in the old thread
-           state. */
-        PyThreadState_Swap(oldstate);
-        PyErr_SetString(PyExc_RuntimeError, "Sub-Interpreter Creation Failed");
-        throw_pyexception_in_javascript(env, "python-ts._create_pycontext failed");
-        PyEval_SaveThread();
-        return env.Null();
+        item = Napi::Object::New(env);
+        stack = Napi::Array::New(env, taken[i].stack.size());
+        for (j = 0; j < taken[i].stack.size(); j++)
+        {
+            stack.Set((uint32_t)j, taken[i].stack[j]);
+        }
+        item.Set("entry", ENTRY_NAMES[taken[i].entry]);
+        item.Set("detail", taken[i].detail);
+        item.Set("time", taken[i].time);
+        item.Set("duration_ms", taken[i].duration_ms);
+        item.Set("gil_wait_ms", taken[i].gil_wait_ms);
+        item.Set("gil_wait_share", taken[i].gil_wait_ms / std::max(taken[i].duration_ms, 1e-9));
+        item.Set("sampled", taken[i].sampled);
+        item.Set("stack", stack);
+        events.Set((uint32_t)i, item);
     }
-    else
+    result.Set("count", (double)stall_count);
+    result.Set("events", events);
+    return result;
+}
+
+/* 开始采样, 之前的样本全部清掉
+_profile_start(interval_ms?)
+参数
+    interval_ms: 采样间隔, 默认10ms
+*/
+Napi::Value _profile_start(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    double interval = 10;
+    if (info.Length() >= 1 && !info[0].IsUndefined())
     {
-        // 这里不太会不成功, 因为之前__init_python的时候已经调用成功了
-        __prepare_python_env(env, false);
+        if (!info[0].IsNumber() || info[0].As<Napi::Number>().DoubleValue() <= 0)
+        {
+            Napi::TypeError::New(env, "Argument `interval_ms` should be a positive Number").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        interval = info[0].As<Napi::Number>().DoubleValue();
     }
-    // 这里我们不回收subinterpreter，而是把它添加到contexts中
-    context = serialize_pycontext(env, substate);
+    watchdog_mutex.lock();
+    profile_stacks.clear();
+    watchdog_mutex.unlock();
+    start_profiler(interval);
+    return env.Undefined();
+}
 
-    // 切回主解释器
-    PyThreadState_Swap(oldstate);
+/* 导出采到的样本
+_profile_dump()
+返回
+    collapsed格式的字符串, 每行是"入口;方法名或代码;最外层frame;...;最里层frame 次数", frame是"函数名 (文件名)"
+    可以直接交给flamegraph.pl或者speedscope
+*/
+Napi::Value _profile_dump(const Napi::CallbackInfo &info)
+{
+    std::ostringstream out;
+    std::map<std::string, uint64_t>::iterator it;
+    std::lock_guard<std::mutex> lock(watchdog_mutex);
+    for (it = profile_stacks.begin(); it != profile_stacks.end(); it++)
+    {
+        out << it->first << " " << it->second << "\n";
+    }
+    return Napi::String::New(info.Env(), out.str());
+}
 
-    PyEval_SaveThread();
-    return context;
+/* 停止采样, 已经采到的样本还可以导出
+_profile_stop()
+返回
+    采样的结果, 同_profile_dump()
+*/
+Napi::Value _profile_stop(const Napi::CallbackInfo &info)
+{
+    start_profiler(0);
+    return _profile_dump(info);
 }
 
-/* 删除pycontext
-_delete_pycontext(context)
+/* 在一次GIL获取内执行一连串同步调用
+_with_gil(callback, context)
 参数
-    context: uintptr_t的string
+    callback: 同步函数, 里面的_call_python/_eval/_dir等同步调用不再反复Restore/Save
+    context: 上下文引用，{"type": PYTHREADSTATE_WRAPPER}, 如不提供则不隔离
 返回
-    成功则返回true
-    失败则throw相应的错误
+    callback的返回值
+注意
+    callback返回Promise的话, await之后的代码已经不在会话里了, 这种用法直接报错
 */
-Napi::Boolean _delete_pycontext(const Napi::CallbackInfo &info)
+Napi::Value _with_gil(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
-    Napi::Object context;
-    Napi::Array contexts = env.Global().Get(CONTEXTS).As<Napi::Array>();
-    Napi::Object objects = env.Global().Get(OBJECTS).As<Napi::Object>();
-    PyThreadState *substate;
-    PyObject *main;
-    uint32_t index;
+    Napi::Value result = env.Null();
+    Napi::Function callback;
+    Napi::Object context = Napi::Object::New(env);
+    PyThreadState *substate, *previous;
 
-    if (info.Length() < 1 || !info[0].IsObject())
+    if (info.Length() < 1 || !info[0].IsFunction())
     {
-        Napi::TypeError::New(env, "Argument `context` is required, it must be a string").ThrowAsJavaScriptException();
-        return Napi::Boolean::New(env, false);
+        Napi::TypeError::New(env, "Please call with (callback, context?) and `callback` should be a Function")
+            .ThrowAsJavaScriptException();
+        return result;
     }
+    callback = info[0].As<Napi::Function>();
 
-    context = info[0].As<Napi::Object>();
+    if (info.Length() >= 2)
+    {
+        if (!info[1].IsObject())
+        {
+            Napi::TypeError::New(env, "Argument `context` should be an Object")
+                .ThrowAsJavaScriptException();
+            return result;
+        }
+        context = info[1].As<Napi::Object>();
+    }
 
-    // 以防Python未被初始化
     __init_python(env);
 
     substate = pycontext_get(context, "state");
-    main = (PyObject *)pycontext_get(context, "main");
-
-    if (substate == NULL || main == NULL)
-    {
-        Napi::TypeError::New(env, "Invalid context").ThrowAsJavaScriptException();
-        return Napi::Boolean::New(env, false);
-    }
+    previous = EnterPython(substate);
+    gil_session++;
 
-    PyEval_RestoreThread(substate);
-    Py_XDECREF(main);
-    Py_EndInterpreter(substate);
-    PyEval_SaveThread();
+    result = callback.Call({});
 
-    // 干掉contexts中的值
-    index = context.Get("index").As<Napi::Number>();
-    contexts.Set(index, env.Null());
-    objects.Delete(context.Get("state").As<Napi::String>());
+    // 不管callback是否抛错, 都要把会话结束掉
+    gil_session--;
+    LeavePython(previous);
 
-    return Napi::Boolean::New(env, true);
+    if (!env.IsExceptionPending() && !result.IsEmpty() && result.IsPromise())
+    {
+        Napi::TypeError::New(env, "Callback of `withGIL` should be synchronous, GIL is released before any await")
+            .ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    return result;
 }
 
 /* 用来写一些测试方法的内部调用，不删是为了方便 */
@@ -1620,17 +7481,35 @@ Napi::Value __internal(const Napi::CallbackInfo &info)
     return val;
 }
 
+#ifdef PYTHON_TS_BENCH
+#include "bench.h"
+#endif
+
 Napi::Object Init(Napi::Env env, Napi::Object exports)
 {
-    Napi::Object references = Napi::Array::New(env); // 所有没被Py_DECREF的序列化对象必须都在这里面
-    Napi::Object contexts = Napi::Array::New(env);   // 所有创建的context, str表示的uintptr_t指针
-    Napi::Object objects = Napi::Object::New(env);   // 为了复用references/contexts, str指针 -> {type, index}
-    env.Global().Set(REFERENCES, references);
-    env.Global().Set(CONTEXTS, contexts);
-    env.Global().Set(OBJECTS, objects);
+    AddonData *data = new AddonData();
+    Napi::Object references = Napi::Array::New(env);
+    Napi::Object contexts = Napi::Array::New(env);
+    Napi::Object objects = Napi::Object::New(env);
+
+    // 每个JS环境(主线程/worker_threads)各自一份
+    data->references = Napi::Persistent(references);
+    data->contexts = Napi::Persistent(contexts);
+    data->objects = Napi::Persistent(objects);
+    data->rtop = data->ctop = data->pytask_top = 0;
+    data->worker_state = NULL;
+    data->worker_main = NULL;
+    env.SetInstanceData<AddonData, release_addon_data>(data);
+
     exports.Set(Napi::String::New(env, "references"), references);
     exports.Set(Napi::String::New(env, "contexts"), contexts);
     exports.Set(Napi::String::New(env, "objects"), objects);
+#ifdef Py_GIL_DISABLED
+    // free-threaded的Python, 异步调用可以在同一个解释器里并行执行
+    exports.Set(Napi::String::New(env, "free_threaded"), Napi::Boolean::New(env, true));
+#else
+    exports.Set(Napi::String::New(env, "free_threaded"), Napi::Boolean::New(env, false));
+#endif
 
     exports.Set(Napi::String::New(env, "_set_runtime_path"), Napi::Function::New(env, _set_runtime_path));
     exports.Set(Napi::String::New(env, "_set_debug"), Napi::Function::New(env, _set_debug));
@@ -1639,15 +7518,39 @@ Napi::Object Init(Napi::Env env, Napi::Object exports)
     exports.Set(Napi::String::New(env, "_import_module"), Napi::Function::New(env, _import_module));
     exports.Set(Napi::String::New(env, "_reload_module"), Napi::Function::New(env, _reload_module));
     exports.Set(Napi::String::New(env, "_call_python"), Napi::Function::New(env, _call_python));
+    exports.Set(Napi::String::New(env, "_call_batch"), Napi::Function::New(env, _call_batch));
+    exports.Set(Napi::String::New(env, "_pipeline"), Napi::Function::New(env, _pipeline));
     exports.Set(Napi::String::New(env, "_dir"), Napi::Function::New(env, _dir));
     exports.Set(Napi::String::New(env, "_exec"), Napi::Function::New(env, _exec));
     exports.Set(Napi::String::New(env, "_eval"), Napi::Function::New(env, _eval));
     exports.Set(Napi::String::New(env, "_delete_pyobject"), Napi::Function::New(env, _delete_pyobject));
     exports.Set(Napi::String::New(env, "_create_pycontext"), Napi::Function::New(env, _create_pycontext));
+    exports.Set(Napi::String::New(env, "_bind_worker"), Napi::Function::New(env, _bind_worker));
     exports.Set(Napi::String::New(env, "_delete_pycontext"), Napi::Function::New(env, _delete_pycontext));
+    exports.Set(Napi::String::New(env, "_with_gil"), Napi::Function::New(env, _with_gil));
+    exports.Set(Napi::String::New(env, "_cancel"), Napi::Function::New(env, _cancel));
+    exports.Set(Napi::String::New(env, "_set_cache"), Napi::Function::New(env, _set_cache));
+    exports.Set(Napi::String::New(env, "_cache_stats"), Napi::Function::New(env, _cache_stats));
+    exports.Set(Napi::String::New(env, "_set_scheduler"), Napi::Function::New(env, _set_scheduler));
+    exports.Set(Napi::String::New(env, "_scheduler_stats"), Napi::Function::New(env, _scheduler_stats));
+    exports.Set(Napi::String::New(env, "_stats"), Napi::Function::New(env, _stats));
+    exports.Set(Napi::String::New(env, "_trace_start"), Napi::Function::New(env, _trace_start));
+    exports.Set(Napi::String::New(env, "_trace_stop"), Napi::Function::New(env, _trace_stop));
+    exports.Set(Napi::String::New(env, "_trace_dump"), Napi::Function::New(env, _trace_dump));
+    exports.Set(Napi::String::New(env, "_set_watchdog"), Napi::Function::New(env, _set_watchdog));
+    exports.Set(Napi::String::New(env, "_stalls"), Napi::Function::New(env, _stalls));
+    exports.Set(Napi::String::New(env, "_enable_memory_accounting"), Napi::Function::New(env, _enable_memory_accounting));
+    exports.Set(Napi::String::New(env, "_memory"), Napi::Function::New(env, _memory));
+    exports.Set(Napi::String::New(env, "_set_memory_limit"), Napi::Function::New(env, _set_memory_limit));
+    exports.Set(Napi::String::New(env, "_profile_start"), Napi::Function::New(env, _profile_start));
+    exports.Set(Napi::String::New(env, "_profile_stop"), Napi::Function::New(env, _profile_stop));
+    exports.Set(Napi::String::New(env, "_profile_dump"), Napi::Function::New(env, _profile_dump));
 
     // testing only
     exports.Set(Napi::String::New(env, "__internal"), Napi::Function::New(env, __internal));
+#ifdef PYTHON_TS_BENCH
+    exports.Set(Napi::String::New(env, "_bench"), Napi::Function::New(env, _bench));
+#endif
     return exports;
 }
 
@@ -1,12 +1,35 @@
 #!/usr/bin/env node
 // 获取python编译参数
 const { execSync } = require('child_process')
+const fs = require('fs')
+
+// 用哪个Python编译, free-threaded的Python可以用PYTHON_TS_PYTHON=python3.13t指定
+const python = process.env.PYTHON_TS_PYTHON || 'python3'
+
+// 是不是free-threaded(没有GIL)的Python, 3.13t以后才有
+function isFreeThreaded () {
+  if (process.platform === 'win32') {
+    // Windows用自带的runtime, 看目录里有没有python3xxt.dll
+    return fs.existsSync(process.arch) && fs.readdirSync(process.arch).some((x) => /^python3\d+t\.dll$/.test(x))
+  }
+  const flag = execSync(`${python} -c "import sysconfig; print(sysconfig.get_config_var('Py_GIL_DISABLED') or 0)"`,
+    { encoding: 'utf-8' })
+  return flag.trim() === '1'
+}
+
+function getDefines () {
+  // Windows的pyconfig.h是共用的, free-threaded要自己定义Py_GIL_DISABLED; 其他平台pyconfig.h里已经有了
+  if (process.platform === 'win32' && isFreeThreaded()) {
+    return 'Py_GIL_DISABLED=1'
+  }
+  return ''
+}
 
 function getIncludeDirs () {
   if (process.platform === 'win32') {
     return [`${process.arch}/include`]
   } else if (process.platform === 'linux' || process.platform === 'darwin') {
-    const includes = execSync('python3-config --includes', { encoding: 'utf-8' })
+    const includes = execSync(`${python}-config --includes`, { encoding: 'utf-8' })
       .split(' ')
       .map((x) => {
         return x.replace(/(^-I|\n$)/g, '')
@@ -22,12 +45,12 @@ function getLibraries () {
     return ''
   } else if (process.platform === 'linux' || process.platform === 'darwin') {
     let libs
-    const pver = execSync('python3 -V', { encoding: 'utf-8' }).split(' ')[1]
+    const pver = execSync(`${python} -V`, { encoding: 'utf-8' }).split(' ')[1]
     const minor = pver.split('.')[1]
     if (parseInt(minor) >= 8) {
-      libs = execSync('python3-config --libs --embed', { encoding: 'utf-8' })
+      libs = execSync(`${python}-config --libs --embed`, { encoding: 'utf-8' })
     } else {
-      libs = execSync('python3-config --libs', { encoding: 'utf-8' })
+      libs = execSync(`${python}-config --libs`, { encoding: 'utf-8' })
     }
     libs = libs
       .split(' ')
@@ -37,7 +60,7 @@ function getLibraries () {
     libs = Array.from(new Set(libs))
     if (process.platform === 'linux') {
       // 不把这个加上的话加载的时候会找不到PyFloatType等各种奇怪
-      const shares = execSync('python3-config --configdir', { encoding: 'utf-8' })
+      const shares = execSync(`${python}-config --configdir`, { encoding: 'utf-8' })
         .replace(/\/config-.*\n$/, '/lib-dynload/*.so')
       libs.push(shares)
     }
@@ -51,7 +74,7 @@ function getLibraryDirs () {
   if (process.platform === 'win32') {
     return [`${process.arch}/libs`]
   } else if (process.platform === 'linux' || process.platform === 'darwin') {
-    const ld = execSync('python3-config --ldflags', { encoding: 'utf-8' })
+    const ld = execSync(`${python}-config --ldflags`, { encoding: 'utf-8' })
       .split(' ')
       .filter((x) => {
         return x.startsWith('-L')
@@ -68,5 +91,6 @@ function getLibraryDirs () {
 module.exports = {
   include_dirs: getIncludeDirs(),
   libraries: getLibraries(),
-  library_dirs: getLibraryDirs()
+  library_dirs: getLibraryDirs(),
+  defines: getDefines()
 }
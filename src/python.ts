@@ -1,6 +1,7 @@
 import bindings = require('bindings')
 import process = require('process')
 import path = require('path')
+import workerThreads = require('worker_threads')
 
 if (process.platform === 'win32') {
   // 不使用系统自带的Python, 可能会缺包
@@ -20,9 +21,9 @@ interface PyWrapper {
   value?: string // 指针对象 string(uint64_t(pointer))
   state?: string // PyThreadState* sub-interpreter state
   main?: string // PyObject * __main__ module addr, 只有"PREFIX/PyThreadState*"对象才有这个玩意, 用于隔离exec和eval
-  repr?: string // repr(object)
+  repr?: string // repr(object), 第一次读取的时候才计算, 之后不再变
   pytype?: string // type(object).__name__
-  time?: number // 创建的时间
+  time?: number // 创建的时间, 秒
   index?: number // 本对象在references列表中的index, 就是第几个新建的对象
 
   hasOwnProperty?: Function // 假装自己是个Object对象
@@ -56,6 +57,99 @@ interface PythonOptions {
   runtime_path?: string // Python Runtime的路径，就是有python3.dll的那个路径
   context?: boolean // 是否每个new Python对应一个新的context
   debug?: boolean // 多输出一些调试日志, 不过也没啥大用处就是了
+  // 合并call_async: true表示合并同一个tick里的调用, 数字表示合并这么多毫秒之内的调用, 默认不合并
+  coalesce?: boolean | number
+  scheduler?: SchedulerOptions // 异步调用的调度参数
+  // 按context统计Python的内存, 要在第一次new Python之前打开, 打开以后整个进程都生效
+  memory_accounting?: boolean
+}
+
+// 结果缓存的参数, 0表示不限制
+interface CacheOptions {
+  ttl_ms?: number // 缓存多久, 默认不过期
+  max_entries?: number // 最多缓存多少个结果
+  max_bytes?: number // 最多占用多少内存
+}
+
+// 异步调用的调度参数, 每个context一份
+interface SchedulerOptions {
+  max_concurrency?: number // 同时在worker线程上执行的调用个数, 0表示不限制(默认)
+  max_queue?: number // 排队的调用个数上限, 0表示不限制(默认)
+  overflow?: 'reject' | 'wait' // 队列满了以后直接reject(默认), 还是等前面的调用完成再提交
+}
+
+// 异步调用的选项
+interface CallOptions extends ConvertOptions {
+  lane?: 'interactive' | 'normal' | 'background' // 排队的优先级, 默认normal
+  timeout?: number // 从提交开始算的超时时间(毫秒), 到点以后promise马上reject, 还在执行的话往Python里抛TimeoutError
+  signal?: AbortSignalLike // abort以后promise马上reject, 还在执行的话往Python里抛KeyboardInterrupt
+  // 只对call_async有效: auto的时候按这个方法以往的执行时间决定, 估计低于inline_ms(默认1ms)而且GIL空闲的话
+  // 直接在JS线程上执行, 否则照常交给worker线程; 默认async
+  dispatch?: 'async' | 'auto'
+  inline_ms?: number
+}
+
+// AbortController().signal, 只用到这几个成员
+interface AbortSignalLike {
+  readonly aborted: boolean
+  addEventListener: (type: 'abort', listener: () => void) => void
+  removeEventListener: (type: 'abort', listener: () => void) => void
+}
+
+// 异步调用的排队时间和执行时间
+interface CallTiming {
+  lane: string // 就地执行的调用是inline
+  wait_ms: number
+  exec_ms: number
+  gil_ms: number // exec_ms里等GIL的时间
+  cached?: boolean // 命中了结果缓存, 没有进Python
+}
+
+// 超过watchdog阈值的同步调用
+interface StallEvent {
+  entry: string // call/run/dir/import/pipeline
+  detail: string // 方法名/代码/模块名
+  time: number // 开始时间, 毫秒时间戳
+  duration_ms: number
+  gil_wait_ms: number // 其中等GIL的时间
+  gil_wait_share: number
+  sampled: boolean // watchdog有没有来得及看到, 没有的话stack为空
+  stack: string[] // 超时那一刻的Python调用栈, 最里面的在前
+}
+
+type AsyncCallback = (data: any, timing?: CallTiming) => void
+
+const QUEUE_FULL = 'python-ts.Scheduler queue is full'
+
+// overflow为wait的时候, 等着队列空出位置的调用, 每完成一个异步调用唤醒一个
+// 调度器按context分开, 等待的队列也挂在context对象上, 用symbol不会被当成context的字段
+const WAITERS = Symbol('waiters')
+
+// 主线程的全局Context, 所有不隔离的Python对象共用一个, 这样它们也共用一个等待队列
+const GLOBAL_CONTEXT: any = {}
+
+function waitersOf (context: any): Array<() => void> {
+  if (context[WAITERS] === undefined) {
+    Object.defineProperty(context, WAITERS, { value: [] })
+  }
+  return context[WAITERS]
+}
+
+// 等待合并执行的call_async
+interface PendingCall {
+  call: any[] // [object, name, args, kwargs, options]
+  resolve: (value: PyWrapper | Primitive) => void
+  reject: (reason: any) => void
+}
+
+// 返回值的转换选项
+interface ConvertOptions {
+  // deep: 全部展开(默认); shallow: 只展开一层, 里面的容器返回PyWrapper
+  // handle: 除了None/bool/int/float之外都返回PyWrapper; auto: 超出预算的子树返回PyWrapper
+  convert?: 'deep' | 'shallow' | 'handle' | 'auto'
+  max_items?: number // auto模式下容器元素个数的总预算, 默认10000
+  max_bytes?: number // auto模式下str/bytes长度的总预算, 默认1MB
+  records?: boolean // dataclass/namedtuple/__slots__对象按字段展开成普通的JS对象, 默认返回PyWrapper
 }
 
 // 参考`docs/DESIGN.md`或者`src/plugins.cc`
@@ -63,6 +157,7 @@ interface CLib {
   references: PyWrapper[]
   contexts: PyWrapper[]
   objects: Object
+  free_threaded: boolean // 是不是free-threaded(没有GIL)的Python
   _set_debug: (debug: boolean) => any
   _set_runtime_path: (path: string) => any
   _init_python: () => boolean
@@ -71,13 +166,89 @@ interface CLib {
   _reload_module: (name: string, context?: PyWrapper) => boolean
   _call_python: (pyobject: PyWrapper, method: string,
     args?: any[], kwargs?: Object,
-    context?: PyWrapper, callback?: Function) => PyWrapper | Primitive
+    context?: PyWrapper, callback?: AsyncCallback, options?: CallOptions) => any
+  _pipeline: (pyobject: PyWrapper, steps: any[][],
+    context?: PyWrapper, callback?: AsyncCallback, options?: CallOptions) => any
   _dir: (pyobject: PyWrapper, context?: PyWrapper) => any[]
-  _exec: (code: string, context?: PyWrapper, callback?: Function) => PyWrapper | Primitive
-  _eval: (code: string, context?: PyWrapper, callback?: Function) => PyWrapper | Primitive
+  _exec: (code: string, context?: PyWrapper, callback?: AsyncCallback, options?: CallOptions) => any
+  _eval: (code: string, context?: PyWrapper, callback?: AsyncCallback, options?: CallOptions) => any
   _delete_pyobject: (pyobject: PyWrapper, context?: PyWrapper) => boolean
   _create_pycontext: () => PyWrapper
+  _bind_worker: () => PyWrapper
   _delete_pycontext: (pycontext: PyWrapper) => boolean
+  _with_gil: <T>(callback: () => T, context?: PyWrapper) => T
+  _cancel: (id: number, timeout?: boolean) => boolean
+  _set_cache: (pyobject: PyWrapper, method: string, options: CacheOptions | null, context?: PyWrapper) => boolean
+  _cache_stats: (pyobject: PyWrapper, method: string) => any
+  _set_scheduler: (context: PyWrapper, options: SchedulerOptions) => boolean
+  _scheduler_stats: (context?: PyWrapper) => any
+  _stats: (context?: PyWrapper | null, reset?: boolean) => any
+  _trace_start: () => void
+  _trace_stop: () => void
+  _trace_dump: () => string
+  _set_watchdog: (threshold_ms: number) => void
+  _stalls: () => { count: number, events: StallEvent[] }
+  _profile_start: (interval_ms?: number) => void
+  _profile_stop: () => string
+  _profile_dump: () => string
+  _enable_memory_accounting: () => boolean
+  _memory: (context?: PyWrapper | null) => any
+  _set_memory_limit: (limit_bytes: number, context?: PyWrapper) => void
+  _call_batch: (calls: any[][], context: PyWrapper, callback: AsyncCallback) => number
+}
+
+/* 一串在Python里执行的属性访问和调用, 中间结果不会转换成JS对象
+
+  ```typescript
+  const summary = py.pipeline(loader)
+    .call('load', [path])
+    .call('transform')
+    .get('summary')
+    .run()
+  ```
+  */
+class Pipeline {
+  private readonly py: Python
+  private readonly object: PyWrapper | Unwrapped
+  private readonly steps: any[][]
+
+  constructor (py: Python, object: PyWrapper | Unwrapped) {
+    this.py = py
+    this.object = object
+    this.steps = []
+  }
+
+  // current = current.name
+  public get (name: string): Pipeline {
+    this.steps.push(['get', name])
+    return this
+  }
+
+  // current = current[key]
+  public item (key: any): Pipeline {
+    this.steps.push(['item', key])
+    return this
+  }
+
+  // current = current.name(*args, **kwargs)
+  public call (name: string, args?: any[], kwargs?: Object): Pipeline {
+    this.steps.push(['call', name, args ?? [], kwargs ?? {}])
+    return this
+  }
+
+  // current = current(*args, **kwargs)
+  public invoke (args?: any[], kwargs?: Object): Pipeline {
+    this.steps.push(['invoke', args ?? [], kwargs ?? {}])
+    return this
+  }
+
+  public run (options?: ConvertOptions): PyWrapper | Primitive {
+    return this.py.run_pipeline(this.object, this.steps, options)
+  }
+
+  public async run_async (options?: CallOptions): Promise<PyWrapper | Primitive> {
+    return await this.py.run_pipeline_async(this.object, this.steps, options)
+  }
 }
 
 class Python {
@@ -85,24 +256,159 @@ class Python {
   public context: PyWrapper // 是否每个new Python对应一个新的context
   public debug: boolean // 多输出一些调试日志, 不过也没啥大用处就是了
   public is_deleted: boolean
+  private is_bound: boolean // context是worker_threads绑定的sub-interpreter, 跟着worker销毁, 不能手动删
+  private coalesce_window: number | null // null代表不合并call_async
+  private overflow: 'reject' | 'wait'
+  private pending: PendingCall[]
 
   constructor (options: PythonOptions = {}) {
     this.is_deleted = false
+    this.pending = []
     this.configure(options)
   }
 
   private configure (options: PythonOptions): void {
     this.runtime_path = options.runtime_path ?? process.arch
     this.debug = options.debug || false
+    this.coalesce(options.coalesce ?? false)
+    this.overflow = 'reject'
+    this.is_bound = false
 
     clib._set_debug(this.debug)
     clib._set_runtime_path(this.runtime_path)
+    if (options.memory_accounting === true) {
+      clib._enable_memory_accounting()
+    }
     clib._init_python()
     if (options.context) {
       this.context = clib._create_pycontext()
+    } else if (!workerThreads.isMainThread) {
+      // worker_threads里的全局Context是这个worker自己的sub-interpreter, worker退出的时候自动销毁
+      this.context = clib._bind_worker()
+      this.is_bound = true
     } else {
       // 空字典代表全局Context
-      this.context = {}
+      this.context = GLOBAL_CONTEXT
+    }
+    if (options.scheduler !== undefined) {
+      this.configure_scheduler(options.scheduler)
+    }
+  }
+
+  /* 设置本context的异步调度参数
+
+    ```typescript
+    py.configure_scheduler({ max_concurrency: 2, max_queue: 100, overflow: 'wait' })
+    await py.call_async(obj, 'export', [], {}, { lane: 'background' })
+    ```
+
+    有空位的时候优先执行interactive的调用, 然后是normal, 最后是background
+    */
+  public configure_scheduler (options: SchedulerOptions): void {
+    this._check_ok()
+    clib._set_scheduler(this.context, options)
+    if (options.overflow !== undefined) {
+      this.overflow = options.overflow
+    }
+  }
+
+  /* 给没有副作用的方法开启结果缓存, 相同参数的调用直接返回上次的结果, 不进Python也不拿GIL
+
+    ```typescript
+    py.memoize(config, 'resolve', { ttl_ms: 60000, max_entries: 1000 })
+    config.resolve('a.b') // 第二次调用命中缓存
+    ```
+
+    参数或者结果里有PyWrapper的调用不会被缓存
+    */
+  public memoize (object: PyWrapper | Unwrapped, name: string, options: CacheOptions = {}): void {
+    this._check_ok()
+    clib._set_cache(this._wrapper(object), name, options, this.context)
+  }
+
+  // 关闭并清空缓存
+  public unmemoize (object: PyWrapper | Unwrapped, name: string): void {
+    this._check_ok()
+    clib._set_cache(this._wrapper(object), name, null, this.context)
+  }
+
+  // {entries, bytes, hits, misses, evictions}, 没开缓存的话返回null
+  public cache_stats (object: PyWrapper | Unwrapped, name: string): any {
+    return clib._cache_stats(this._wrapper(object), name)
+  }
+
+  private _wrapper (object: PyWrapper | Unwrapped): PyWrapper {
+    return this.isPyObject(object) ? object as PyWrapper : (object as Unwrapped).__wrapper__
+  }
+
+  // 本context的调度状态, 包括每条lane的排队时间和执行时间
+  public scheduler_stats (): any {
+    return clib._scheduler_stats(this.context)
+  }
+
+  // 本context的运行时指标: 每个入口的调用数和错误数, 以及args/gil/exec/result四个阶段的延迟直方图
+  // reset为true的时候读完清零
+  public metrics (reset: boolean = false): any {
+    return clib._stats(this.context, reset)
+  }
+
+  // 本context的内存: {enabled, live_bytes, peak_bytes, blocks, limit_bytes, denied, handles}
+  public memory (): any {
+    return clib._memory(this.context)
+  }
+
+  // 本context的内存上限, 超过以后Python里的分配抛MemoryError, 0表示不限制
+  public set_memory_limit (limit_bytes: number): void {
+    clib._set_memory_limit(limit_bytes, this.context)
+  }
+
+  // 提交一个异步调用, 失败的时候reject'python-ts'开头的错误信息
+  // options里的timeout/signal到点以后调用_cancel, promise马上以'python-ts.Timeout'/'python-ts.Cancelled'结束
+  private async _async (submit: (callback: AsyncCallback) => number | null,
+    options?: CallOptions): Promise<any> {
+    while (true) {
+      try {
+        return await new Promise((resolve, reject) => {
+          let timer: ReturnType<typeof setTimeout> | undefined
+          let id: number | null = null
+          let settled = false
+          const abort = (): void => { if (id !== null) clib._cancel(id, false) }
+          id = submit((data) => {
+            settled = true
+            if (timer !== undefined) clearTimeout(timer)
+            options?.signal?.removeEventListener('abort', abort)
+            const waiter = waitersOf(this.context).shift()
+            if (waiter !== undefined) {
+              waiter()
+            }
+            if (typeof data === 'string' && data.startsWith(PREFIX)) {
+              reject(data)
+            } else {
+              resolve(this._attach_unwrap(data))
+            }
+          })
+          if (settled) {
+            // 就地执行(dispatch: 'auto')的时候callback是同步调用的
+            return
+          }
+          if (options?.signal !== undefined) {
+            if (options.signal.aborted) {
+              abort()
+            } else {
+              options.signal.addEventListener('abort', abort)
+            }
+          }
+          if (options?.timeout !== undefined) {
+            timer = setTimeout(() => { if (id !== null) clib._cancel(id, true) }, options.timeout)
+          }
+        })
+      } catch (err) {
+        if (this.overflow !== 'wait' || !(err instanceof Error) || err.message !== QUEUE_FULL) {
+          throw err
+        }
+        // 队列满了, 等前面有调用完成再重新提交
+        await new Promise<void>(resolve => waitersOf(this.context).push(resolve))
+      }
     }
   }
 
@@ -174,34 +480,124 @@ class Python {
   }
 
   public call (object: PyWrapper, name: string,
-    args?: any[], kwargs?: Object): PyWrapper | Primitive {
+    args?: any[], kwargs?: Object, options?: ConvertOptions): PyWrapper | Primitive {
     this._check_ok()
     args = args ?? []
     kwargs = kwargs ?? {}
-    let result = clib._call_python(object, name, args, kwargs, this.context)
+    return this._attach_unwrap(clib._call_python(object, name, args, kwargs, this.context, undefined, options))
+  }
+
+  // 返回值是PyWrapper的话, 给它加上unwrap方法
+  private _attach_unwrap (result: PyWrapper | Primitive): PyWrapper | Primitive {
     if (this.isPyObject(result)) {
-      result = result as PyWrapper
-      result.unwrap = () => {
-        return this.unwrap(result as PyWrapper)
+      const wrapper = result as PyWrapper
+      wrapper.unwrap = () => {
+        return this.unwrap(wrapper)
       }
     }
     return result
   }
 
+  // 从object开始构造一个pipeline, 参见Pipeline
+  public pipeline (object: PyWrapper | Unwrapped): Pipeline {
+    this._check_ok()
+    return new Pipeline(this, object)
+  }
+
+  // 一次native调用执行整条pipeline, 只转换最后的结果
+  public run_pipeline (object: PyWrapper | Unwrapped, steps: any[][],
+    options?: ConvertOptions): PyWrapper | Primitive {
+    this._check_ok()
+    return this._attach_unwrap(clib._pipeline(object as PyWrapper, steps, this.context, undefined, options))
+  }
+
+  // 异步执行整条pipeline, 中间步骤都在worker线程里完成
+  public async run_pipeline_async (object: PyWrapper | Unwrapped, steps: any[][],
+    options?: CallOptions): Promise<PyWrapper | Primitive> {
+    this._check_ok()
+    return await this._async(callback => clib._pipeline(object as PyWrapper, steps, this.context, callback, options), options)
+  }
+
   public async call_async (object: PyWrapper, name: string,
-    args?: any[], kwargs?: Object): Promise<PyWrapper | Primitive> {
+    args?: any[], kwargs?: Object, options?: CallOptions): Promise<PyWrapper | Primitive> {
     this._check_ok()
     args = args ?? []
     kwargs = kwargs ?? {}
-    return await new Promise((resolve, reject) => {
-      clib._call_python(object, name, args, kwargs, this.context, (data) => {
-        if (typeof data === 'string' && data.startsWith(PREFIX)) {
-          reject(data)
-        } else {
-          resolve(data)
+    if (this.coalesce_window !== null && options?.timeout === undefined && options?.signal === undefined &&
+      options?.dispatch !== 'auto') {
+      // 带超时或者可以取消的调用单独提交, 不然取消的时候会连累整批; auto派发的调用自己决定怎么执行
+      return await new Promise((resolve, reject) => {
+        this._enqueue({ call: [object, name, args, kwargs, options], resolve, reject })
+      })
+    }
+    return await this._async(callback => clib._call_python(object, name, args, kwargs, this.context, callback, options), options)
+  }
+
+  /* 设置call_async的合并策略
+
+    ```typescript
+    py.coalesce(true) // 同一个tick里发起的call_async合并成一批, 一次拿GIL全部执行
+    py.coalesce(5)    // 合并5ms之内发起的call_async
+    py.coalesce(false) // 不合并, 每个call_async单独一个AsyncWorker
+    ```
+
+    合并以后的调用在同一个worker线程上按发起顺序依次执行, 互相之间不会并行
+    */
+  public coalesce (window: boolean | number): void {
+    if (window === false) {
+      this.coalesce_window = null
+      this._flush()
+    } else {
+      this.coalesce_window = window === true ? 0 : Math.max(0, window)
+    }
+  }
+
+  private _enqueue (pending: PendingCall): void {
+    this.pending.push(pending)
+    if (this.pending.length > 1) {
+      // 已经安排过flush了
+      return
+    }
+    if (this.coalesce_window === 0 || this.coalesce_window === null) {
+      queueMicrotask(() => this._flush())
+    } else {
+      setTimeout(() => this._flush(), this.coalesce_window)
+    }
+  }
+
+  private _flush (): void {
+    const batch = this.pending
+    if (batch.length > 0) {
+      this.pending = []
+      this._submit(batch)
+    }
+  }
+
+  private _submit (batch: PendingCall[]): void {
+    this._async(callback => clib._call_batch(batch.map(pending => pending.call), this.context, callback))
+      .then((results: any[]) => {
+        for (let i = 0; i < batch.length; i++) {
+          const data = results[i]
+          if (typeof data === 'string' && data.startsWith(PREFIX)) {
+            batch[i].reject(data)
+          } else {
+            batch[i].resolve(this._attach_unwrap(data))
+          }
+        }
+      })
+      .catch((err) => {
+        if (batch.length === 1 || !(err instanceof TypeError) || !/^Call \d+: /.test(err.message)) {
+          // 队列满了之类的错误拆开也一样会失败, 整批都按这个错误结束
+          for (const pending of batch) {
+            pending.reject(err)
+          }
+          return
+        }
+        // 某一个调用的参数检查失败的时候整批都不会执行, 拆开重新提交, 只让有问题的那个失败
+        for (const pending of batch) {
+          this._submit([pending])
         }
       })
-    })
   }
 
   public import (name: string): Unwrapped {
@@ -229,37 +625,34 @@ class Python {
   }
 
   // 异步调用exec
-  public async exec_async (code: string): Promise<PyWrapper | Primitive> {
+  public async exec_async (code: string, options?: CallOptions): Promise<PyWrapper | Primitive> {
     this._check_ok()
-    return await new Promise((resolve, reject) => {
-      clib._exec(code, this.context, (data) => {
-        if (typeof data === 'string' && data.startsWith(PREFIX)) {
-          reject(data)
-        } else {
-          resolve(data)
-        }
-      })
-    })
+    return await this._async(callback => clib._exec(code, this.context, callback, options), options)
   }
 
   // 调用Python下的eval, code必须是一个合法的Python表达式
-  public eval (code: string): PyWrapper | Primitive {
+  public eval (code: string, options?: ConvertOptions): PyWrapper | Primitive {
     this._check_ok()
-    return clib._eval(code, this.context)
+    return this._attach_unwrap(clib._eval(code, this.context, undefined, options))
   }
 
   // 异步调用eval
-  public async eval_async (code: string, context?: PyWrapper): Promise<PyWrapper | Primitive> {
+  public async eval_async (code: string, options?: CallOptions): Promise<PyWrapper | Primitive> {
     this._check_ok()
-    return await new Promise((resolve, reject) => {
-      clib._eval(code, this.context, (data) => {
-        if (typeof data === 'string' && data.startsWith(PREFIX)) {
-          reject(data)
-        } else {
-          resolve(data)
-        }
-      })
-    })
+    return await this._async(callback => clib._eval(code, this.context, callback, options), options)
+  }
+
+  /* 在一次GIL获取内执行一连串同步调用, 省掉每次调用的Restore/Save开销
+
+    ```typescript
+    const total = py.withGIL(() => rows.map(r => dm.process(r)))
+    ```
+
+    fn必须是同步函数, 会话期间Python的后台线程拿不到GIL, 所以不要在里面做太久的事情
+    */
+  public withGIL<T> (fn: () => T): T {
+    this._check_ok()
+    return clib._with_gil(fn, this.context)
   }
 
   // 刷新(更新)Unwrapped对象下面的非method属性
@@ -301,12 +694,15 @@ class Python {
   // 直接把Context都关了, 同时会清理Context下的所有PyObject对象
   public delete (): boolean {
     this._check_ok()
+    for (const pending of this.pending.splice(0)) {
+      pending.reject(Error('This Python context has been deleted before the call was executed'))
+    }
     this.clear()
-    if (this.context as boolean) {
+    if (this.context as boolean && !this.is_bound) {
       this.is_deleted = clib._delete_pycontext(this.context)
     }
     return this.is_deleted
   }
 }
 
-export { Python, clib }
+export { Python, Pipeline, ConvertOptions, CallOptions, SchedulerOptions, CacheOptions, clib }
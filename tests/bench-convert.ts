@@ -0,0 +1,154 @@
+import { clib, Python } from '../src/python'
+import assert = require('assert')
+import process = require('process')
+
+/* 参数和返回值转换的吞吐量, 按数据的形状分开测
+  固定种子生成一组payload(宽对象, 深层嵌套, 长字符串, 数字数组, Buffer, 记录数组), 每种有S/M/L三个大小,
+  分别测 JS => Python(sink, 只转换参数), Python => JS(load, 只转换返回值), 往返(identity) 三个方向
+  用法: ts-node tests/bench-convert.ts [--json], 加上 node --expose-gc 的话堆的增长是gc之后的数字
+  */
+
+const SIZES: Array<[string, number]> = [['S', 1], ['M', 10], ['L', 100]]
+const BUDGET_BYTES = 64 << 20 // 每个用例大概转换这么多字节
+const MAX_REPEAT = 10000
+
+// mulberry32, 每次运行生成的数据都一样
+function random (seed: number): () => number {
+  return () => {
+    seed = (seed + 0x6D2B79F5) | 0
+    let t = Math.imul(seed ^ (seed >>> 15), 1 | seed)
+    t = (t + Math.imul(t ^ (t >>> 7), 61 | t)) ^ t
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296
+  }
+}
+
+function word (rand: () => number, length: number): string {
+  let text = ''
+  for (let i = 0; i < length; i++) {
+    text += String.fromCharCode(97 + Math.floor(rand() * 26))
+  }
+  return text
+}
+
+// 每种形状在scale=1的时候大约几KB
+const SHAPES: { [name: string]: (rand: () => number, scale: number) => any } = {
+  wide: (rand, scale) => {
+    const object = {}
+    for (let i = 0; i < 100 * scale; i++) {
+      object[`key_${i}`] = rand() < 0.5 ? Math.floor(rand() * 1e6) : word(rand, 8)
+    }
+    return object
+  },
+  deep: (rand, scale) => {
+    let object: any = { leaf: true }
+    for (let i = 0; i < 8 * Math.sqrt(scale); i++) {
+      object = { level: i, name: word(rand, 6), items: [rand(), rand(), rand()], child: object }
+    }
+    return object
+  },
+  strings: (rand, scale) => Array.from({ length: 4 }, () => word(rand, 1024 * scale)),
+  numbers: (rand, scale) => Array.from({ length: 512 * scale }, () => rand() * 1e6),
+  buffer: (rand, scale) => Buffer.from(Array.from({ length: 4096 * scale }, () => Math.floor(rand() * 256))),
+  records: (rand, scale) => Array.from({ length: 32 * scale }, (_, i) => ({
+    id: i,
+    name: word(rand, 12),
+    price: Math.round(rand() * 10000) / 100,
+    qty: Math.floor(rand() * 100),
+    active: rand() < 0.5,
+    tags: [word(rand, 4), word(rand, 4)]
+  }))
+}
+
+// payload的大小(UTF-8字节数, 数字按8字节算)和值的个数
+function measure (value: any): { bytes: number, values: number } {
+  const result = { bytes: 0, values: 1 }
+  let child: { bytes: number, values: number }
+  if (typeof value === 'string') {
+    result.bytes = Buffer.byteLength(value)
+  } else if (typeof value === 'number') {
+    result.bytes = 8
+  } else if (Buffer.isBuffer(value)) {
+    result.bytes = value.byteLength
+  } else if (value !== null && typeof value === 'object') {
+    for (const key of Object.keys(value)) {
+      child = measure(value[key])
+      result.bytes += child.bytes + (Array.isArray(value) ? 0 : Buffer.byteLength(key))
+      result.values += child.values
+    }
+  } else {
+    result.bytes = 1
+  }
+  return result
+}
+
+function main (): void {
+  const py = new Python({})
+  py.exec(`stash = None
+def sink(x):
+    return None
+def keep(x):
+    global stash
+    stash = x
+def load():
+    return stash
+def identity(x):
+    return x`)
+  const main = py.eval('__import__("__main__")')
+  const rows: any[] = []
+  const heapBefore = process.memoryUsage().heapUsed
+  let seed = 42
+
+  for (const shape of Object.keys(SHAPES)) {
+    for (const [size, scale] of SIZES) {
+      const payload = SHAPES[shape](random(seed++), scale)
+      const { bytes, values } = measure(payload)
+      const repeat = Math.max(3, Math.min(MAX_REPEAT, Math.ceil(BUDGET_BYTES / bytes)))
+      const directions: Array<[string, string, any[]]> = [
+        ['js->py', 'sink', [payload]],
+        ['py->js', 'load', []],
+        ['roundtrip', 'identity', [payload]]
+      ]
+      clib._call_python(main, 'keep', [payload], {}, {})
+      const echo = clib._call_python(main, 'identity', [payload], {}, {})
+      // Buffer回来是Uint8Array
+      assert.deepStrictEqual(Buffer.isBuffer(payload) ? Buffer.from(echo) : echo, payload)
+
+      for (const [direction, method, args] of directions) {
+        const t1 = process.hrtime.bigint()
+        for (let i = 0; i < repeat; i++) {
+          clib._call_python(main, method, args, {}, {})
+        }
+        const seconds = Number(process.hrtime.bigint() - t1) / 1e9
+        rows.push({
+          shape,
+          size,
+          direction,
+          bytes,
+          values,
+          repeat,
+          'MB/s': Math.round(bytes * repeat / seconds / 1048576 * 100) / 100,
+          'values/s': Math.round(values * repeat / seconds)
+        })
+      }
+      clib._call_python(main, 'keep', [null], {}, {})
+    }
+  }
+
+  const gc = (global as any).gc
+  if (gc !== undefined) {
+    gc()
+  }
+  const memory = {
+    peak_rss_mb: Math.round(process.resourceUsage().maxRSS / 1024 * 100) / 100,
+    heap_growth_mb: Math.round((process.memoryUsage().heapUsed - heapBefore) / 1048576 * 100) / 100,
+    gc_exposed: gc !== undefined
+  }
+  if (process.argv.includes('--json')) {
+    console.log(JSON.stringify({ rows, memory }, null, 2))
+  } else {
+    console.table(rows)
+    console.log(memory)
+  }
+}
+
+main()
@@ -0,0 +1,25 @@
+import bindings = require('bindings')
+import process = require('process')
+
+// binding内部函数的微基准, 需要先用 PYTHON_TS_BENCH=1 npm run build 编译出python-ts-bench
+// 用法: ts-node tests/bench-native.ts [iterations] [batch], 结果是JSON, 可以直接存下来对比
+function main (): void {
+  const bench = bindings('python-ts-bench')
+  const iterations = Number(process.argv[2] ?? 100000)
+  const batch = Number(process.argv[3] ?? 100)
+
+  bench._set_runtime_path(process.arch)
+  bench._init_python()
+  const report = JSON.parse(bench._bench({ iterations, batch }))
+  console.log(JSON.stringify(report, null, 2))
+  bench._destroy_python()
+
+  // operator_new每次都new一个int, 数出来是0说明替换的operator new没生效, 其他用例的allocs_per_op也不可信
+  const sanity = report.cases.find((c: any) => c.name === 'operator_new')
+  if (sanity === undefined || !(sanity.allocs_per_op > 0)) {
+    console.error('operator new is not counted, allocs_per_op of every case is meaningless')
+    process.exitCode = 1
+  }
+}
+
+main()
@@ -0,0 +1,145 @@
+import { clib, Python } from '../src/python'
+import process = require('process')
+
+/* 异步调用的并发扩展性
+  扫一遍 负载类型 x context个数 x 并发数, 每个组合发起固定数量的call_async, 用c个"车道"各自串行地await来控制并发
+  负载: cpu(纯Python计算), io(time.sleep, 会放开GIL), thread(Threader在Python自己的线程池里跑, 调用等它跑完),
+  process(MultiProcessor在子进程里跑)
+  输出每个组合的吞吐量, 延迟的p50/p90/p99, 以及执行时间里等GIL的比例(timing.gil_ms / timing.exec_ms)
+  用法: ts-node tests/bench-scaling.ts [--json]
+  */
+
+const CONCURRENCY = [1, 4, 16, 64]
+const CONTEXTS = [1, 4]
+const CALLS = 256
+
+const CODE = `import time
+def spin(n):
+    total = 0
+    for i in range(n):
+        total += i
+    return total
+def nap(ms):
+    time.sleep(ms / 1000)`
+
+interface Workload {
+  calls: number
+  // 在每个context里准备好, 返回要调用的[对象, 方法名, 参数]
+  setup: (py: Python) => [any, string, any[]]
+}
+
+const WORKLOADS: { [name: string]: Workload } = {
+  cpu: { calls: CALLS, setup: py => [py.eval('__import__("__main__")'), 'spin', [20000]] },
+  io: { calls: CALLS, setup: py => [py.eval('__import__("__main__")'), 'nap', [2]] },
+  thread: { calls: CALLS, setup: py => [py.import('Threader').__wrapper__, 'incr_and_wait', [1]] },
+  process: { calls: CALLS / 4, setup: py => [py.import('MultiProcessor').__wrapper__, 'run_in_executor', []] }
+}
+
+function percentile (sorted: number[], p: number): number {
+  const rank = Math.ceil(p * sorted.length)
+  return sorted[Math.max(0, rank - 1)]
+}
+
+function round (value: number): number {
+  return Math.round(value * 100) / 100
+}
+
+async function call (py: Python, target: [any, string, any[]]): Promise<any> {
+  const context = (py as any).context
+  return await new Promise((resolve, reject) => {
+    clib._call_python(target[0], target[1], target[2], {}, context, (data, timing) => {
+      if (typeof data === 'string' && data.startsWith('python-ts')) {
+        reject(data)
+      } else {
+        resolve(timing)
+      }
+    })
+  })
+}
+
+async function run (workload: string, contexts: number, concurrency: number): Promise<any> {
+  const pythons: Python[] = []
+  const targets: Array<[any, string, any[]]> = []
+  const latencies: number[] = []
+  const lanes: Array<Promise<void>> = []
+  const calls = WORKLOADS[workload].calls
+  let next = 0
+  let exec = 0
+  let gil = 0
+
+  try {
+    for (let i = 0; i < contexts; i++) {
+      // 一个context的时候用全局Context, 和普通用法一样
+      const py = new Python({ context: contexts > 1 })
+      pythons.push(py)
+      py.add_syspath('plugins')
+      py.exec(CODE)
+      targets.push(WORKLOADS[workload].setup(py))
+    }
+    await call(pythons[0], targets[0])
+
+    const t1 = process.hrtime.bigint()
+    for (let c = 0; c < concurrency; c++) {
+      lanes.push((async () => {
+        while (next < calls) {
+          const i = next++
+          const start = process.hrtime.bigint()
+          const timing = await call(pythons[i % contexts], targets[i % contexts])
+          latencies.push(Number(process.hrtime.bigint() - start) / 1e6)
+          exec += timing.exec_ms
+          gil += timing.gil_ms
+        }
+      })())
+    }
+    await Promise.all(lanes)
+    const seconds = Number(process.hrtime.bigint() - t1) / 1e9
+
+    latencies.sort((a, b) => a - b)
+    return {
+      workload,
+      contexts,
+      concurrency,
+      calls,
+      'calls/s': round(calls / seconds),
+      p50_ms: round(percentile(latencies, 0.5)),
+      p90_ms: round(percentile(latencies, 0.9)),
+      p99_ms: round(percentile(latencies, 0.99)),
+      gil_wait_share: exec > 0 ? round(gil / exec) : 0
+    }
+  } catch (err) {
+    // 比如MultiProcessor在sub-interpreter里不能用
+    return { workload, contexts, concurrency, calls, error: String(err).split('\n')[0] }
+  } finally {
+    // 一条车道出错的时候别的车道还有调用在跑, 不再发新的, 等它们都结束再删context
+    next = calls
+    await Promise.all(lanes.map(async lane => await lane.catch(() => {})))
+    for (const py of pythons) {
+      if ((py as any).context.state !== undefined) {
+        try {
+          py.delete()
+        } catch (err) {
+          console.error(`failed to delete context: ${String(err)}`)
+        }
+      }
+    }
+  }
+}
+
+async function main (): Promise<void> {
+  const rows: any[] = []
+  for (const workload of Object.keys(WORKLOADS)) {
+    for (const contexts of CONTEXTS) {
+      for (const concurrency of CONCURRENCY) {
+        rows.push(await run(workload, contexts, concurrency))
+      }
+    }
+  }
+  if (process.argv.includes('--json')) {
+    console.log(JSON.stringify({ free_threaded: clib.free_threaded, rows }, null, 2))
+  } else {
+    console.log(clib.free_threaded ? 'free-threaded Python' : 'Python with GIL')
+    console.table(rows)
+  }
+}
+
+main().catch(err => console.error(err))
@@ -1,5 +1,6 @@
-import { Python } from '../src/python'
+import { clib, Python } from '../src/python'
 import assert = require('assert')
+import process = require('process')
 
 function benchDummy (times: number): void {
   const py = new Python({})
@@ -16,6 +17,22 @@ function benchDummy (times: number): void {
   console.log('dummy function call', times, 'times in', t2 - t1, 'milliseconds => qps =', (times * 1000 / (t2 - t1)))
 }
 
+function benchWithGIL (times: number): void {
+  const py = new Python({})
+  py.add_syspath('plugins')
+  const Dummy = py.import('Dummy')
+  const dm = Dummy.Dummy().unwrap()
+
+  const t1 = +new Date()
+  py.withGIL(() => {
+    for (let i = 0; i < times; i++) {
+      dm.dummy()
+    }
+  })
+  const t2 = +new Date()
+  console.log('withGIL function call', times, 'times in', t2 - t1, 'milliseconds => qps =', (times * 1000 / (t2 - t1)))
+}
+
 function benchExel (times: number): void {
   const py = new Python({})
   py.add_syspath('plugins')
@@ -67,14 +84,70 @@ function benchImport (times, module?: string): void {
   console.log('import function call', times, 'times in', t2 - t1, 'milliseconds => qps =', (times * 1000 / (t2 - t1)))
 }
 
-function main (): void {
+// 嵌套的dict/list/tuple/set, 测一下返回值转换的开销
+async function benchConvert (times: number): Promise<void> {
+  const py = new Python({})
+  py.exec(`payload = {
+    'rows': [{'id': i, 'name': 'row%d' % i, 'tags': ('a', 'b'), 'score': i / 3, 'seen': {1, 2, 3}} for i in range(200)],
+    'meta': {'total': 200, 'page': {'index': 1, 'size': 200}},
+}`)
+  assert(py.eval('payload').rows.length === 200)
+
+  let t1 = +new Date()
+  for (let i = 0; i < times; i++) {
+    py.eval('payload')
+  }
+  let t2 = +new Date()
+  console.log('convert nested payload', times, 'times in', t2 - t1, 'milliseconds => qps =', (times * 1000 / (t2 - t1)))
+
+  t1 = +new Date()
+  for (let i = 0; i < times; i++) {
+    await py.eval_async('payload')
+  }
+  t2 = +new Date()
+  console.log('async convert nested payload', times, 'times in', t2 - t1, 'milliseconds => qps =', (times * 1000 / (t2 - t1)))
+}
+
+// CPU密集的异步调用一个一个等和全部同时发起各跑一遍, free-threaded的Python应该能看到并行的加速
+async function benchParallel (times: number): Promise<void> {
+  const py = new Python({})
+  py.exec(`def spin(n):
+    total = 0
+    for i in range(n):
+        total += i
+    return total`)
+  const main = py.eval('__import__("__main__")')
+  const build = clib.free_threaded ? 'free-threaded' : 'GIL'
+  assert(await py.call_async(main, 'spin', [10]) === 45)
+
+  let t1 = +new Date()
+  for (let i = 0; i < times; i++) {
+    await py.call_async(main, 'spin', [100000])
+  }
+  let t2 = +new Date()
+  const serial = t2 - t1
+  console.log(build, 'serial cpu-bound async call', times, 'times in', serial, 'milliseconds => qps =', (times * 1000 / serial))
+
+  t1 = +new Date()
+  await Promise.all(Array.from({ length: times }, async () => await py.call_async(main, 'spin', [100000])))
+  t2 = +new Date()
+  console.log(build, 'parallel cpu-bound async call', times, 'times in', t2 - t1, 'milliseconds => qps =',
+    (times * 1000 / (t2 - t1)), 'speedup =', serial / (t2 - t1))
+}
+
+// 异步的几项一项一项等, 同时跑的话会抢同一个GIL和线程池, 互相把数字拉低
+async function main (): Promise<void> {
   console.log('Benchmarking...')
   benchImport(1000, 'os')
   benchDummy(100000)
+  benchWithGIL(100000)
   benchExel(10000)
-  benchAsync(10000).catch((err) => {
-    console.error(err)
-  })
+  await benchAsync(10000)
+  await benchConvert(1000)
+  await benchParallel(64)
 }
 
-main()
+main().catch((err) => {
+  console.error(err)
+  process.exitCode = 1
+})
@@ -1,5 +1,7 @@
 import { clib, Python } from '../src/python'
 import assert = require('assert')
+import path = require('path')
+import { Worker } from 'worker_threads'
 
 async function sleep (ms): Promise<void> {
   return await new Promise(resolve => setTimeout(resolve, ms))
@@ -104,6 +106,513 @@ function testMultiprocessor (): void {
   }
 }
 
+function testWithGIL (): void {
+  const py = new Python()
+  py.add_syspath('plugins')
+  const Dummy = py.import('Dummy')
+  const dm = Dummy.Dummy().unwrap()
+  const results = py.withGIL(() => {
+    const nested = py.withGIL(() => py.eval('1+2'))
+    return [dm.dummy(), nested, py.eval('3+4')]
+  })
+  assert.deepStrictEqual(results, ['dummy', 3, 7])
+  assert.throws(() => {
+    py.withGIL(() => { throw Error('oops') })
+  })
+  // 抛错之后会话必须已经结束, 否则这里会死锁
+  assert(py.eval('1+1') === 2)
+  assert.throws(() => {
+    py.withGIL(async () => await sleep(0))
+  })
+  console.log('. testWithGIL OK!')
+}
+
+async function testPipeline (): Promise<void> {
+  const py = new Python()
+  py.exec(`class Loader:
+    def load(self, n):
+        return list(range(n))
+    def transform(self, rows, scale=1):
+        return {'rows': [r * scale for r in rows]}
+loader = Loader()
+    `)
+  const loader = py.eval('loader')
+  const pipe = py.pipeline(loader).get('load').invoke([4])
+  assert.deepStrictEqual(pipe.run(), [0, 1, 2, 3])
+  const rows = py.pipeline(py.eval('loader'))
+    .call('transform', [[1, 2, 3]], { scale: 2 })
+    .item('rows')
+    .call('__len__')
+  assert(rows.run() === 3)
+  assert(await rows.run_async() === 3)
+  assert.throws(() => {
+    py.pipeline(loader).get('missing').run()
+  })
+  console.log('. testPipeline OK!')
+}
+
+async function testAsyncFlatten (): Promise<void> {
+  const py = new Python()
+  py.exec(`class Echo:
+    def echo(self, *args, **kwargs):
+        return [list(args), kwargs]
+    def nested(self):
+        a = [1, 'x', b'y', None, True, 1.5]
+        a.append(a)
+        return {'a': a, 'b': a, 'o': object()}
+echo = Echo()
+    `)
+  const echo = py.eval('echo')
+  const payload = { n: 1, s: 'str', list: [1, 2.5, null], buf: Buffer.from('abc') }
+  const [args, kwargs] = await py.call_async(echo, 'echo', [payload, echo], { k: [1, 2] }) as any[]
+  assert(args[0].n === 1 && args[0].list[1] === 2.5 && args[0].s === 'str')
+  assert(args[0].buf.toString() === 'abc')
+  assert.deepStrictEqual(kwargs, { k: [1, 2] })
+  const nested = await py.call_async(echo, 'nested') as any
+  assert(nested.a === nested.b && nested.a[6] === nested.a)
+  assert(nested.a[4] === true && nested.a[3] === null)
+  assert(py.isPyObject(nested.o))
+  await assert.rejects(async () => await py.call_async(echo, 'missing'))
+  console.log('. testAsyncFlatten OK!')
+}
+
+async function testCoalesce (): Promise<void> {
+  const py = new Python({ coalesce: true })
+  py.exec(`class Counter:
+    def __init__(self):
+        self.calls = []
+    def add(self, n):
+        self.calls.append(n)
+        return n * 2
+counter = Counter()
+    `)
+  const counter = py.eval('counter')
+  const results = await Promise.all([1, 2, 3, 4].map(async n => await py.call_async(counter, 'add', [n])))
+  assert.deepStrictEqual(results, [2, 4, 6, 8])
+  assert.deepStrictEqual(py.eval('counter.calls'), [1, 2, 3, 4])
+  const failed = py.call_async(counter, 'missing')
+  const ok = py.call_async(counter, 'add', [5])
+  await assert.rejects(failed)
+  assert(await ok === 10)
+  py.coalesce(false)
+  assert(await py.call_async(counter, 'add', [6]) === 12)
+  console.log('. testCoalesce OK!')
+}
+
+async function testScheduler (): Promise<void> {
+  const py = new Python({ context: true, scheduler: { max_concurrency: 1, max_queue: 3 } })
+  py.exec(`import time
+order = []
+def work(name, seconds=0.01):
+    time.sleep(seconds)
+    order.append(name)
+    return name
+    `)
+  const main = py.eval('__import__("__main__")')
+  const calls = [
+    py.call_async(main, 'work', ['b1'], {}, { lane: 'background' }),
+    py.call_async(main, 'work', ['b2'], {}, { lane: 'background' }),
+    py.call_async(main, 'work', ['b3'], {}, { lane: 'background' }),
+    py.call_async(main, 'work', ['i1'], {}, { lane: 'interactive' })
+  ]
+  // b1已经在执行, 队列里有3个, 再提交就满了
+  await assert.rejects(py.call_async(main, 'work', ['n1']))
+  await Promise.all(calls)
+  assert.deepStrictEqual(py.eval('order'), ['b1', 'i1', 'b2', 'b3'])
+  const stats = py.scheduler_stats()
+  assert(stats.lanes.background.completed === 3 && stats.lanes.normal.rejected === 1)
+  assert(stats.lanes.background.wait_max_ms >= stats.lanes.interactive.wait_max_ms)
+  py.configure_scheduler({ overflow: 'wait' })
+  const waited = await Promise.all([1, 2, 3, 4, 5, 6].map(async n => await py.call_async(main, 'work', [`w${n}`, 0])))
+  assert(waited.length === 6)
+  py.delete()
+  console.log('. testScheduler OK!')
+}
+
+async function testCancel (): Promise<void> {
+  const py = new Python({ context: true, scheduler: { max_concurrency: 1 } })
+  py.exec(`import time
+done = []
+def spin():
+    while True:
+        pass
+def work(name):
+    time.sleep(0.05)
+    done.append(name)
+    return name
+    `)
+  const main = py.eval('__import__("__main__")')
+  const start = Date.now()
+  await assert.rejects(py.call_async(main, 'spin', [], {}, { timeout: 50 }), /python-ts.Timeout/)
+  assert(Date.now() - start < 1000)
+  // spin收到TimeoutError以后退出, 把位置让出来
+  const running = py.call_async(main, 'work', ['a'])
+  const controller = new (global as any).AbortController()
+  const queued = py.call_async(main, 'work', ['b'], {}, { signal: controller.signal })
+  controller.abort()
+  await assert.rejects(queued, /python-ts.Cancelled/)
+  assert(await running === 'a')
+  assert.deepStrictEqual(py.eval('done'), ['a'])
+  assert(py.scheduler_stats().lanes.normal.cancelled === 2)
+  py.delete()
+  console.log('. testCancel OK!')
+}
+
+async function testMetrics (): Promise<void> {
+  const py = new Python({ context: true })
+  py.exec(`def echo(x):
+    return x
+def fail():
+    raise ValueError('metrics')`)
+  const main = py.eval('__import__("__main__")')
+  py.metrics(true)
+  for (let i = 0; i < 10; i++) {
+    assert(py.call(main, 'echo', [{ i }]).i === i)
+  }
+  assert.throws(() => py.call(main, 'fail', []))
+  assert(await py.call_async(main, 'echo', [1]) === 1)
+  clib._dir(main, py.context)
+  let m = py.metrics()
+  assert(m.call.calls === 12 && m.call.errors === 1)
+  assert(m.call.phases.exec.count === 12 && m.call.phases.gil.count === 12 && m.call.phases.result.count === 11)
+  assert(m.call.phases.exec.p50_ms <= m.call.phases.exec.p99_ms && m.call.phases.exec.p99_ms <= m.call.phases.exec.max_ms * 1.13)
+  assert(m.call.phases.exec.buckets.reduce((n: number, b: number[]) => n + b[1], 0) === 12)
+  assert(m.dir.calls === 1 && m.run.calls === 0)
+  assert(py.metrics(true).call.calls === 12)
+  m = py.metrics()
+  assert(m.call.calls === 0 && m.call.phases.exec.count === 0 && m.call.phases.exec.buckets.length === 0)
+  assert(clib._stats()[py.context.state] !== undefined)
+  py.delete()
+  console.log('. testMetrics OK!')
+}
+
+async function testTrace (): Promise<void> {
+  const py = new Python({ context: true })
+  const main = py.eval('__import__("__main__")')
+  clib._trace_start()
+  py.eval('1 + 1')
+  await py.eval_async('[1, 2]')
+  py.call(main, '__dir__', [])
+  clib._trace_stop()
+  const trace = JSON.parse(clib._trace_dump())
+  const names = trace.traceEvents.filter((e: any) => e.ph === 'X').map((e: any) => e.name)
+  for (const name of ['eval', 'call', 'gil', 'execute', 'on_ok']) {
+    assert(names.includes(name), name)
+  }
+  assert(trace.traceEvents.every((e: any) => e.ph === 'M' || (e.dur >= 0 && e.ts >= 0)))
+  py.delete()
+  console.log('. testTrace OK!')
+}
+
+async function testProfiler (): Promise<void> {
+  const py = new Python({ context: true })
+  py.exec(`import time
+def inner():
+    end = time.time() + 0.1
+    while time.time() < end:
+        pass
+def outer():
+    inner()`)
+  const main = py.eval('__import__("__main__")')
+  clib._profile_start(2)
+  py.call(main, 'outer', [])
+  await py.call_async(main, 'outer', [])
+  const collapsed = clib._profile_stop()
+  const lines = collapsed.trim().split('\n')
+  assert(lines.every(line => /^[a-z]+;.+ \d+$/.test(line)))
+  assert(lines.some(line => line.startsWith('call;outer;')))
+  if (!clib.free_threaded) {
+    assert(lines.some(line => line.startsWith('call;outer;outer (<string>);inner (<string>) ')))
+  }
+  assert(clib._profile_dump() === collapsed)
+  clib._profile_start()
+  assert(clib._profile_stop() === '')
+  py.delete()
+  console.log('. testProfiler OK!')
+}
+
+async function testAutoDispatch (): Promise<void> {
+  const py = new Python({ context: true })
+  py.exec(`def fast(x):
+    return x + 1
+def fail():
+    raise ValueError('auto')`)
+  const main = py.eval('__import__("__main__")')
+  const call = async (name: string, args: any[], inline_ms?: number): Promise<[any, any]> => await new Promise(resolve => {
+    clib._call_python(main, name, args, {}, py.context, (data, timing) => resolve([data, timing]), { dispatch: 'auto', inline_ms })
+  })
+  // 第一次没有估计值, 走worker线程; 测试是一个一个跑的, 没有别的调用占着GIL, 第二次就地执行
+  let [data, timing] = await call('fast', [1], 50)
+  assert(data === 2 && timing.lane === 'normal')
+  ;[data, timing] = await call('fast', [2], 50)
+  assert(data === 3 && timing.lane === 'inline' && timing.wait_ms === 0)
+  assert(await py.call_async(main, 'fast', [3], {}, { dispatch: 'auto', inline_ms: 50 }) === 4)
+  ;[data, timing] = await call('fail', [], 50)
+  assert(timing.lane === 'normal' && data.includes('ValueError: auto'))
+  ;[data, timing] = await call('fail', [], 50)
+  assert(timing.lane === 'inline' && data.startsWith('python-ts._call_python failed') && data.includes('ValueError: auto'))
+  ;[, timing] = await call('fast', [4], 0)
+  assert(timing.lane === 'normal')
+  py.delete()
+  console.log('. testAutoDispatch OK!')
+}
+
+function testWatchdog (): void {
+  const py = new Python({ context: true })
+  py.exec(`import time
+def slow():
+    end = time.time() + 0.5
+    while time.time() < end:
+        pass`)
+  const main = py.eval('__import__("__main__")')
+  clib._set_watchdog(50)
+  clib._stalls()
+  py.eval('1 + 1')
+  py.call(main, 'slow', [])
+  clib._set_watchdog(0)
+  const stalls = clib._stalls().events
+  assert(stalls.length === 1 && stalls[0].entry === 'call' && stalls[0].detail === 'slow')
+  assert(stalls[0].duration_ms >= 500 && stalls[0].gil_wait_share < 1)
+  assert(stalls[0].sampled && stalls[0].stack[0].startsWith('slow ('))
+  py.delete()
+  console.log('. testWatchdog OK!')
+}
+
+async function testMemoize (): Promise<void> {
+  const py = new Python()
+  py.exec(`class Resolver:
+    def __init__(self):
+        self.calls = 0
+    def resolve(self, key, upper=False):
+        self.calls += 1
+        return {'key': key.upper() if upper else key, 'parts': key.split('.')}
+resolver = Resolver()
+    `)
+  const resolver = py.eval('resolver')
+  py.memoize(resolver, 'resolve', { max_entries: 2 })
+  assert.deepStrictEqual(py.call(resolver, 'resolve', ['a.b']), { key: 'a.b', parts: ['a', 'b'] })
+  assert.deepStrictEqual(py.call(resolver, 'resolve', ['a.b']), { key: 'a.b', parts: ['a', 'b'] })
+  assert(await py.call_async(resolver, 'resolve', ['a.b'], { upper: true }) !== null)
+  assert.deepStrictEqual(await py.call_async(resolver, 'resolve', ['a.b'], { upper: true }), { key: 'A.B', parts: ['a', 'b'] })
+  py.call(resolver, 'resolve', ['c'])
+  assert(py.eval('resolver.calls') === 3)
+  const stats = py.cache_stats(resolver, 'resolve')
+  assert(stats.hits === 2 && stats.misses === 3 && stats.entries === 2 && stats.evictions === 1)
+  // 命中的异步调用不返回id, 也不在返回之前回调
+  let called = false
+  const hit = new Promise<any>(resolve => {
+    assert(clib._call_python(resolver, 'resolve', ['c'], {}, py.context, (data, timing) => {
+      called = true
+      resolve([data, timing])
+    }) === null)
+  })
+  assert(!called)
+  const [hitData, hitTiming] = await hit
+  assert(hitData.key === 'c' && hitTiming.cached === true && hitTiming.exec_ms === 0)
+  py.unmemoize(resolver, 'resolve')
+  assert(py.cache_stats(resolver, 'resolve') === null)
+  py.call(resolver, 'resolve', ['a.b'])
+  assert(py.eval('resolver.calls') === 4)
+  console.log('. testMemoize OK!')
+}
+
+async function testJsCallback (): Promise<void> {
+  const py = new Python()
+  py.exec(`def apply(fn, value):
+    return fn(value, scale=2) + 1
+def work(n, progress):
+    total = 0
+    for i in range(n):
+        total += i
+        progress(i, {'total': total})
+    return total
+    `)
+  const main = py.eval('__import__("__main__")')
+  assert(py.call(main, 'apply', [(x: number, kwargs: any) => x * kwargs.scale, 20]) === 41)
+
+  const seen: number[] = []
+  let arrived = (): void => {}
+  const all = new Promise<void>(resolve => { arrived = resolve })
+  const total = await py.call_async(main, 'work', [5000, (i: number, info: any) => {
+    assert(typeof info.total === 'number')
+    seen.push(i)
+    if (seen.length === 5000) arrived()
+  }])
+  assert(total === 4999 * 5000 / 2)
+  // 进度事件和结果分别送到JS线程, 等剩下的events到齐
+  await all
+  assert(seen[4999] === 4999)
+
+  // 同步调用过程中Python自己开的线程也能调用JS函数, 事件在调用返回以后送到
+  py.exec(`import threading
+def spawn(n, progress):
+    def run():
+        for i in range(n):
+            progress(i)
+    thread = threading.Thread(target=run)
+    thread.start()
+    thread.join()
+    return n`)
+  const events: number[] = []
+  let delivered = (): void => {}
+  const done = new Promise<void>(resolve => { delivered = resolve })
+  assert(py.call(main, 'spawn', [100, (i: number) => {
+    events.push(i)
+    if (events.length === 100) delivered()
+  }]) === 100)
+  await done
+  assert.deepStrictEqual(events, Array.from({ length: 100 }, (_, i) => i))
+  console.log('. testJsCallback OK!')
+}
+
+async function testNativeTypes (): Promise<void> {
+  const py = new Python()
+  py.exec(`import datetime, decimal, array
+def describe(*values):
+    return [type(v).__name__ for v in values]
+def values():
+    return {
+        'when': datetime.datetime(2020, 1, 2, 3, 4, 5),
+        'big': 2 ** 64,
+        'price': decimal.Decimal('19.99'),
+        'ints': array.array('i', [1, 2, 3]),
+        'lookup': {1: 'a', (2, 3): 'b'},
+        'flag': True,
+    }
+    `)
+  const main = py.eval('__import__("__main__")')
+  const big = (global as any).BigInt // lib是es2017, 没有BigInt的声明
+  const args = [new Date(2020, 0, 2), big('18446744073709551616'), new Map([[1, 'a']]), new Set([1, 2]),
+    new Float64Array([0.5]), new ArrayBuffer(4)]
+  assert.deepStrictEqual(py.call(main, 'describe', args), ['datetime', 'int', 'dict', 'set', 'array', 'bytes'])
+  assert.deepStrictEqual(await py.call_async(main, 'describe', args), ['datetime', 'int', 'dict', 'set', 'array', 'bytes'])
+
+  for (const result of [py.call(main, 'values'), await py.call_async(main, 'values')]) {
+    assert(result.when instanceof Date && result.when.getTime() === new Date(2020, 0, 2, 3, 4, 5).getTime())
+    assert(result.big === big('18446744073709551616'))
+    assert(result.price === '19.99')
+    assert(result.ints instanceof Int32Array && result.ints[2] === 3)
+    assert(result.lookup instanceof Map && result.lookup.get(1) === 'a')
+    assert(result.flag === true)
+  }
+  console.log('. testNativeTypes OK!')
+}
+
+async function testRecords (): Promise<void> {
+  const py = new Python()
+  py.exec(`import dataclasses, collections
+Point = collections.namedtuple('Point', ['x', 'y'])
+class Slotted:
+    __slots__ = ('name', 'tags')
+    def __init__(self, name):
+        self.name = name
+        self.tags = ['a']
+@dataclasses.dataclass
+class User:
+    id: int
+    where: Point
+    extra: Slotted
+user = User(1, Point(2, 3), Slotted('s'))
+    `)
+  const expected = { id: 1, where: { x: 2, y: 3 }, extra: { name: 's', tags: ['a'] } }
+  assert(py.isPyObject(py.eval('user')))
+  assert.deepStrictEqual(py.eval('user', { records: true }), expected)
+  assert.deepStrictEqual(await py.eval_async('user', { records: true }), expected)
+  assert.deepStrictEqual(py.eval('[Point(1, 2), Point(3, 4)]', { records: true }), [{ x: 1, y: 2 }, { x: 3, y: 4 }])
+  console.log('. testRecords OK!')
+}
+
+async function testCycles (): Promise<void> {
+  const py = new Python()
+  py.exec(`shared = [1]
+pair = [shared, shared]
+loop = []
+loop.append(loop)
+def same(x):
+    return x[0] is x
+    `)
+  const main = py.eval('__import__("__main__")')
+  for (const pair of [py.eval('pair'), await py.eval_async('pair')]) {
+    assert(pair[0] === pair[1])
+  }
+  for (const loop of [py.eval('loop'), await py.eval_async('loop')]) {
+    assert(loop[0] === loop)
+  }
+  const arr: any[] = []
+  arr.push(arr)
+  assert(py.call(main, 'same', [arr]) === true)
+  assert(await py.call_async(main, 'same', [arr]) === true)
+  console.log('. testCycles OK!')
+}
+
+function testLazyWrapper (): void {
+  const py = new Python()
+  py.exec(`class Slow:
+    calls = 0
+    def __repr__(self):
+        Slow.calls += 1
+        return '<slow>'
+    `)
+  const wrapper = py.eval('Slow()')
+  assert(py.eval('Slow.calls') === 0)
+  assert(wrapper.repr === '<slow>')
+  assert(py.eval('Slow.calls') === 1)
+  // 算过一次以后就缓存下来了
+  assert(wrapper.repr === '<slow>')
+  assert(py.eval('Slow.calls') === 1)
+  assert(wrapper.pytype === 'Slow')
+  assert(typeof wrapper.time === 'number' && wrapper.time > 0)
+  console.log('. testLazyWrapper OK!')
+}
+
+async function testWorkers (): Promise<void> {
+  // 每个worker有自己的sub-interpreter, 互相之间和主线程的全局变量都是隔离的
+  const code = `
+require('ts-node/register')
+const { parentPort, workerData } = require('worker_threads')
+const { Python } = require(workerData.module)
+const py = new Python()
+py.exec('owner = ' + workerData.n)
+py.eval_async('sum(range(owner))').then(total => parentPort.postMessage([py.eval('owner'), total]))
+`
+  const module = path.join(__dirname, '..', 'src', 'python.ts')
+  const results = await Promise.all([1000, 2000, 3000].map(async n => await new Promise((resolve, reject) => {
+    const worker = new Worker(code, { eval: true, workerData: { module, n } })
+    worker.once('message', resolve)
+    worker.once('error', reject)
+  })))
+  assert.deepStrictEqual(results, [[1000, 499500], [2000, 1999000], [3000, 4498500]])
+  const py = new Python()
+  assert(py.eval('"owner" in globals()') === false)
+  console.log('. testWorkers OK!')
+}
+
+function testConvertModes (): void {
+  const py = new Python()
+  py.exec('nested = {"rows": [[1, 2], [3, 4]], "name": "x" * 100}')
+  assert.deepStrictEqual(py.eval('nested', { convert: 'deep' }), { rows: [[1, 2], [3, 4]], name: 'x'.repeat(100) })
+
+  const handle = py.eval('nested', { convert: 'handle' })
+  assert(py.isPyObject(handle))
+  assert(py.call(handle, '__len__') === 2)
+  assert(py.eval('1', { convert: 'handle' }) === 1)
+
+  const shallow = py.eval('nested', { convert: 'shallow' })
+  assert(py.isPyObject(shallow.rows))
+  assert(shallow.name === 'x'.repeat(100))
+
+  const auto = py.eval('list(range(100))', { convert: 'auto', max_items: 10 })
+  assert(py.isPyObject(auto))
+  assert.deepStrictEqual(py.eval('[1, 2]', { convert: 'auto', max_items: 10 }), [1, 2])
+  const capped = py.eval('nested', { convert: 'auto', max_bytes: 10 })
+  assert(py.isPyObject(capped.name))
+  assert.deepStrictEqual(capped.rows, [[1, 2], [3, 4]])
+  assert.throws(() => py.eval('1', { convert: 'auto', max_items: -1 }), TypeError)
+  assert.throws(() => py.eval('1', { convert: 'auto', max_bytes: NaN }), TypeError)
+  assert.throws(() => py.eval('1', { convert: 'auto', max_bytes: Infinity }), TypeError)
+  console.log('. testConvertModes OK!')
+}
+
 function testRefresh (): void {
   const py = new Python()
   const sys = py.import('sys')
@@ -115,6 +624,33 @@ function testRefresh (): void {
   console.log('. testRefresh OK!')
 }
 
+function testMemory (): void {
+  // 必须是第一个初始化Python的测试
+  const py = new Python({ context: true, memory_accounting: !clib.free_threaded })
+  if (!py.memory().enabled) {
+    py.delete()
+    console.log('. testMemory skipped')
+    return
+  }
+  const before = py.memory()
+  py.exec('blob = [str(i) * 10 for i in range(100000)]')
+  const after = py.memory()
+  assert(after.live_bytes - before.live_bytes > 4 << 20 && after.blocks > before.blocks)
+  assert(clib._memory().main.live_bytes > 0 && clib._memory()[py.context.state].live_bytes === after.live_bytes)
+  py.exec('del blob')
+  assert(py.memory().live_bytes < after.live_bytes && py.memory().peak_bytes >= after.live_bytes)
+
+  py.import('os')
+  assert(py.memory().handles === before.handles + 1)
+  py.set_memory_limit(py.memory().live_bytes + (1 << 20))
+  assert.throws(() => py.exec('blob = [str(i) * 10 for i in range(100000)]'), /MemoryError/)
+  assert(py.memory().denied > 0)
+  py.set_memory_limit(0)
+  py.exec('blob = [str(i) * 10 for i in range(100000)]')
+  py.delete()
+  console.log('. testMemory OK!')
+}
+
 function testGc (): void {
   const py = new Python()
   const os = py.import('os')
@@ -155,12 +691,33 @@ function testBytes (): void {
   console.log('. testBytes OK!')
 }
 
-function test (): void {
+async function test (): Promise<void> {
+  testMemory()
   testClear()
   testGc()
   testRefresh()
   testDummy()
   testExecEval()
+  testWithGIL()
+  testConvertModes()
+  testLazyWrapper()
+  testWatchdog()
+  // 异步测试一个一个跑, 互相之间不抢GIL和调度器的名额; 任何一个失败都让整个测试失败
+  await testPipeline()
+  await testAsyncFlatten()
+  await testCoalesce()
+  await testScheduler()
+  await testCancel()
+  await testMemoize()
+  await testMetrics()
+  await testTrace()
+  await testJsCallback()
+  await testNativeTypes()
+  await testRecords()
+  await testCycles()
+  await testAutoDispatch()
+  await testProfiler()
+  await testWorkers()
   testContext()
   testExcel()
   testAsync().catch((err) => console.error(err))
@@ -169,4 +726,7 @@ function test (): void {
   testBytes()
 }
 
-test()
+test().catch((err) => {
+  console.error(err)
+  process.exitCode = 1
+})